@@ -28,6 +28,7 @@
 
 #include "SDCard.h"
 #include "gpio.h"
+#include "timebase.h"
 
 static const uint8_t OXFF = 0xFF;
 
@@ -41,7 +42,12 @@ int SDCard_initialise_card_v1();
 int SDCard_initialise_card_v2();
 
 int SDCard__read(uint8_t *buffer, int length);
+static uint16_t SDCard__crc16(const uint8_t *data, int length);
+int SDCard__read_block(uint8_t *buffer, int length);
 int SDCard__write(const uint8_t *buffer, int length);
+int SDCard__write_block(const uint8_t *buffer, int length);
+static int SDCard__wait_busy();
+void SDCard__stop_transmission();
 
 // int start_multi_write(uint32_t start_block, uint32_t n_blocks);
 // int validate_buffer(uint8_t *, int);
@@ -55,6 +61,10 @@ int SDCard__write(const uint8_t *buffer, int length);
 uint32_t SDCard__sd_sectors();
 uint32_t _sectors;
 
+// data rate from the CSD, and the rate we are actually running at
+uint32_t _tran_speed;
+uint32_t _frequency;
+
 // SPI _spi;
 PinName _cs;
 
@@ -67,7 +77,18 @@ uint32_t busy_buffers;
 int cardtype;
 
 
-#define SD_COMMAND_TIMEOUT 4096
+// timeouts, from the physical layer spec where it gives one. A command
+// response is due within 8 bytes, so that one only matters with no card
+#define SD_COMMAND_TIMEOUT_MS   10
+#define SD_INIT_TIMEOUT_MS    1000
+#define SD_READ_TIMEOUT_MS     100
+#define SD_WRITE_TIMEOUT_MS    500
+
+#define SD_INIT_FREQUENCY    400000
+#define SD_MAX_FREQUENCY   25000000
+
+// data block failed its token or CRC, worth retrying slower
+#define SD_DATA_ERROR 2
 
 void SDCard_init(PinName mosi, PinName miso, PinName sclk, PinName cs)
 {
@@ -144,8 +165,8 @@ void SDCard_init(PinName mosi, PinName miso, PinName sclk, PinName cs)
 // #define fputs(...) do {} while (0)
 
 int SDCard_initialise_card() {
-    // Set to 25kHz for initialisation, and clock card with cs = 1
-    SPI_frequency(25000);
+    // Set to 400kHz for initialisation, and clock card with cs = 1
+    SPI_frequency(SD_INIT_FREQUENCY);
     GPIO_set(_cs);
 
     for(int i=0; i<16; i++) {
@@ -172,7 +193,7 @@ int SDCard_initialise_card() {
 }
 
 int SDCard_initialise_card_v1() {
-    for(int i=0; i<SD_COMMAND_TIMEOUT; i++) {
+    for(uint32_t t = deadline_ms(SD_INIT_TIMEOUT_MS); !deadline_passed(t);) {
 		SDCard__cmd(SDCMD_APP_CMD, 0);
 		if(SDCard__cmd(SD_ACMD_SD_SEND_OP_COND, 0) == 0) {
             return cardtype = SDCARD_V1;
@@ -184,7 +205,7 @@ int SDCard_initialise_card_v1() {
 }
 
 int SDCard_initialise_card_v2() {
-    for(int i=0; i<SD_COMMAND_TIMEOUT; i++) {
+    for(uint32_t t = deadline_ms(SD_INIT_TIMEOUT_MS); !deadline_passed(t);) {
         SDCard__cmd(SDCMD_APP_CMD, 0);
 		if(SDCard__cmd(SD_ACMD_SD_SEND_OP_COND, (1UL<<30)) == 0) {
 			uint32_t ocr;
@@ -218,8 +239,26 @@ int SDCard_disk_initialize()
         return 1;
     }
 
-//     SPI_frequency(1000000); // Set to 1MHz for data transfer
-    SPI_frequency(4000000); // Set to 4MHz for data transfer
+    // Run data transfers as fast as both the card and the SSP allow
+    if ((_tran_speed == 0) || (_tran_speed > SD_MAX_FREQUENCY))
+        _tran_speed = SD_MAX_FREQUENCY;
+    _frequency = SPI_frequency(_tran_speed);
+
+    // and prove it with a block read, which slows down until the CRC passes
+    uint8_t block[512];
+    if (SDCard_disk_read(block, 0) != 0) {
+        fprintf(stderr, "Can't read block 0\n");
+        return 1;
+    }
+    return 0;
+}
+
+// step the data clock down after a bad block, until we reach the init rate
+static int SDCard__slow_down()
+{
+    if (_frequency <= SD_INIT_FREQUENCY)
+        return 1;
+    _frequency = SPI_frequency(_frequency / 2);
     return 0;
 }
 
@@ -231,11 +270,46 @@ int SDCard_disk_write(const uint8_t *buffer, uint32_t block_number)
     }
 
     // send the data block
-    SDCard__write(buffer, 512);
-    return 0;
+    return SDCard__write(buffer, 512);
 }
 
-int SDCard_disk_read(uint8_t *buffer, uint32_t block_number)
+int SDCard_disk_write_multi(const uint8_t *buffer, uint32_t block_number, int count)
+{
+    int r = 0;
+
+    if (count == 1)
+        return SDCard_disk_write(buffer, block_number);
+
+    // start writing consecutive blocks (CMD25), keeping the card selected
+    if(SDCard__cmdx(SDCMD_WRITE_MULTIPLE_BLOCK, BLOCK2ADDR(block_number)) != 0) {
+        GPIO_set(_cs);
+        SPI_write(0xFF);
+        return 1;
+    }
+    SPI_write(0xFF);
+
+    for (; count; count--, buffer += 512) {
+        if ((r = SDCard__write_block(buffer, 512)) != 0)
+            break;
+    }
+
+    if (r) {
+        // a rejected block ends the write with CMD12 instead
+        SDCard__stop_transmission();
+        return 1;
+    }
+
+    // stop token, then the card programs what it has buffered
+    SPI_write(0xFD);
+    SPI_write(0xFF);
+    r = SDCard__wait_busy();
+
+    GPIO_set(_cs);
+    SPI_write(0xFF);
+    return r;
+}
+
+static int SDCard__read_single(uint8_t *buffer, uint32_t block_number)
 {
 // 	printf("SD:read type %d: %d(%x) -> %d(%x)\n", cardtype, block_number, block_number, BLOCK2ADDR(block_number), BLOCK2ADDR(block_number));
     // set read address for single block (CMD17)
@@ -244,10 +318,104 @@ int SDCard_disk_read(uint8_t *buffer, uint32_t block_number)
     }
 
     // receive the data
-    SDCard__read(buffer, 512);
+    return SDCard__read(buffer, 512);
+}
+
+int SDCard_disk_read(uint8_t *buffer, uint32_t block_number)
+{
+    int r;
+
+    while ((r = SDCard__read_single(buffer, block_number)) == SD_DATA_ERROR) {
+        if (SDCard__slow_down())
+            break;
+    }
+    return r?1:0;
+}
+
+static int SDCard__read_multi(uint8_t *buffer, uint32_t block_number, int count)
+{
+    int r = 0;
+
+    // start reading consecutive blocks (CMD18), keeping the card selected
+    if(SDCard__cmdx(SDCMD_READ_MULTIPLE_BLOCK, BLOCK2ADDR(block_number)) != 0) {
+        GPIO_set(_cs);
+        SPI_write(0xFF);
+        return 1;
+    }
+
+    for (; count; count--, buffer += 512) {
+        if ((r = SDCard__read_block(buffer, 512)) != 0)
+            break;
+    }
+
+    // the card keeps streaming blocks until we stop it (CMD12)
+    SDCard__stop_transmission();
+    return r;
+}
+
+int SDCard_disk_read_multi(uint8_t *buffer, uint32_t block_number, int count)
+{
+    int r;
+
+    if (count == 1)
+        return SDCard_disk_read(buffer, block_number);
+
+    while ((r = SDCard__read_multi(buffer, block_number, count)) == SD_DATA_ERROR) {
+        if (SDCard__slow_down())
+            break;
+    }
+    return r?1:0;
+}
+
+/*
+ * Streaming reads: one CMD18 left open, and each block's data phase left
+ * running on DMA so the caller can get on with something else meanwhile
+ */
+static uint8_t *stream_buffer;
+
+int SDCard_stream_start(uint32_t block_number)
+{
+    if(SDCard__cmdx(SDCMD_READ_MULTIPLE_BLOCK, BLOCK2ADDR(block_number)) != 0) {
+        GPIO_set(_cs);
+        SPI_write(0xFF);
+        return 1;
+    }
+    return 0;
+}
+
+int SDCard_stream_read_start(uint8_t *buffer)
+{
+    int token = 0xFF;
+
+    for(uint32_t t = deadline_ms(SD_READ_TIMEOUT_MS); (token == 0xFF) && !deadline_passed(t);) {
+        token = SPI_write(0xFF);
+    }
+    if (token != 0xFE)
+        return 1;
+
+    stream_buffer = buffer;
+    SPI_read_block_start(buffer, 512);
     return 0;
 }
 
+int SDCard_stream_busy()
+{
+    return SPI_block_busy();
+}
+
+int SDCard_stream_read_finish()
+{
+    SPI_block_wait();
+    uint16_t crc = SPI_write(0xFF) << 8; // checksum
+    crc |= SPI_write(0xFF);
+    return (crc == SDCard__crc16(stream_buffer, 512))?0:1;
+}
+
+void SDCard_stream_stop()
+{
+    SDCard__stop_transmission();
+}
+
 int SDCard_disk_erase(uint32_t block_number, int count)
 {
 	return -1;
@@ -439,7 +607,7 @@ int SDCard__cmd(int cmd, int arg) {
     SPI_write(0x95);
 
     // wait for the repsonse (response[7] == 0)
-    for(int i=0; i<SD_COMMAND_TIMEOUT; i++) {
+    for(uint32_t t = deadline_ms(SD_COMMAND_TIMEOUT_MS); !deadline_passed(t);) {
         int response = SPI_write(0xFF);
         if(!(response & 0x80)) {
             GPIO_set(_cs);
@@ -469,7 +637,7 @@ int SDCard__cmdx(int cmd, int arg) {
     SPI_write(0x95);
 
     // wait for the repsonse (response[7] == 0)
-    for(int i=0; i<SD_COMMAND_TIMEOUT; i++) {
+    for(uint32_t t = deadline_ms(SD_COMMAND_TIMEOUT_MS); !deadline_passed(t);) {
         int response = SPI_write(0xFF);
         if(!(response & 0x80)) {
 // 			printf(" <%u\n", response);
@@ -498,7 +666,7 @@ int SDCard__cmd58(uint32_t *ocr) {
     SPI_write(0x95);
 
     // wait for the repsonse (response[7] == 0)
-    for(int i=0; i<SD_COMMAND_TIMEOUT; i++) {
+    for(uint32_t t = deadline_ms(SD_COMMAND_TIMEOUT_MS); !deadline_passed(t);) {
         int response = SPI_write(0xFF);
         if(!(response & 0x80)) {
             *ocr = SPI_write(0xFF) << 24;
@@ -531,7 +699,7 @@ int SDCard__cmd8() {
     SPI_write(0x87);     // crc
 
     // wait for the repsonse (response[7] == 0)
-    for(int i=0; i<SD_COMMAND_TIMEOUT * 1000; i++) {
+    for(uint32_t t = deadline_ms(SD_COMMAND_TIMEOUT_MS); !deadline_passed(t);) {
         char response[5];
         response[0] = SPI_write(0xFF);
         if(!(response[0] & 0x80)) {
@@ -550,24 +718,88 @@ int SDCard__cmd8() {
     return -1; // timeout
 }
 
+// CRC16-CCITT of a data block, a nibble at a time
+static uint16_t SDCard__crc16(const uint8_t *data, int length) {
+    static const uint16_t crc_nibble[16] = {
+        0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+        0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+    };
+    uint16_t crc = 0;
+
+    for(int i=0; i<length; i++) {
+        crc = (crc << 4) ^ crc_nibble[(crc >> 12) ^ (data[i] >> 4)];
+        crc = (crc << 4) ^ crc_nibble[(crc >> 12) ^ (data[i] & 15)];
+    }
+    return crc;
+}
+
 int SDCard__read(uint8_t *buffer, int length) {
 //     _cs = 0;
 	GPIO_clear(_cs);
 
-    // read until start byte (0xFF)
-    while(SPI_write(0xFF) != 0xFE);
+    // read until start byte (0xFE)
+    int token = 0xFF;
+    for(uint32_t t = deadline_ms(SD_READ_TIMEOUT_MS); (token == 0xFF) && !deadline_passed(t);) {
+        token = SPI_write(0xFF);
+    }
+    if (token != 0xFE) {
+        GPIO_set(_cs);
+        SPI_write(0xFF);
+        return SD_DATA_ERROR;
+    }
 
     // read data
-    for(int i=0; i<length; i++) {
-        buffer[i] = SPI_write(0xFF);
+    SPI_read_block(buffer, length);
+    uint16_t crc = SPI_write(0xFF) << 8; // checksum
+    crc |= SPI_write(0xFF);
+
+//     _cs = 1;
+	GPIO_set(_cs);
+    SPI_write(0xFF);
+    return (crc == SDCard__crc16(buffer, length))?0:SD_DATA_ERROR;
+}
+
+// one data block of a multiple block read, card stays selected
+int SDCard__read_block(uint8_t *buffer, int length) {
+    int token = 0xFF;
+
+    // wait for the start token (0xFE), an error token has the top bits clear
+    for(uint32_t t = deadline_ms(SD_READ_TIMEOUT_MS); (token == 0xFF) && !deadline_passed(t);) {
+        token = SPI_write(0xFF);
     }
-    SPI_write(0xFF); // checksum
+    if (token != 0xFE)
+        return SD_DATA_ERROR;
+
+    // read data
+    SPI_read_block(buffer, length);
+    uint16_t crc = SPI_write(0xFF) << 8; // checksum
+    crc |= SPI_write(0xFF);
+    return (crc == SDCard__crc16(buffer, length))?0:SD_DATA_ERROR;
+}
+
+void SDCard__stop_transmission() {
+    SPI_write(0x40 | SDCMD_STOP_TRANSMISSION);
+    SPI_write(0x00);
+    SPI_write(0x00);
+    SPI_write(0x00);
+    SPI_write(0x00);
+    SPI_write(0x95);
+
+    // skip the stuff byte, then wait for the R1 response
     SPI_write(0xFF);
+    for(uint32_t t = deadline_ms(SD_COMMAND_TIMEOUT_MS); !deadline_passed(t);) {
+        if(!(SPI_write(0xFF) & 0x80))
+            break;
+    }
+
+    // R1b: card holds the line low while busy
+    for(uint32_t t = deadline_ms(SD_READ_TIMEOUT_MS); !deadline_passed(t);) {
+        if(SPI_write(0xFF) != 0)
+            break;
+    }
 
-//     _cs = 1;
 	GPIO_set(_cs);
     SPI_write(0xFF);
-    return 0;
 }
 
 int SDCard__write(const uint8_t *buffer, int length) {
@@ -578,9 +810,7 @@ int SDCard__write(const uint8_t *buffer, int length) {
     SPI_write(0xFE);
 
     // write the data
-    for(int i=0; i<length; i++) {
-        SPI_write(buffer[i]);
-    }
+    SPI_transfer_block(buffer, (uint8_t *) 0, length);
 
     // write the checksum
     SPI_write(0xFF);
@@ -595,12 +825,37 @@ int SDCard__write(const uint8_t *buffer, int length) {
     }
 
     // wait for write to finish
-    while(SPI_write(0xFF) == 0);
+    int busy = SDCard__wait_busy();
 
 //     _cs = 1;
 	GPIO_set(_cs);
     SPI_write(0xFF);
-    return 0;
+    return busy;
+}
+
+// one data block of a multiple block write, card stays selected
+int SDCard__write_block(const uint8_t *buffer, int length) {
+    // multiple block write start token
+    SPI_write(0xFC);
+
+    SPI_transfer_block(buffer, (uint8_t *) 0, length);
+
+    SPI_write(0xFF);
+    SPI_write(0xFF);
+
+    if((SPI_write(0xFF) & 0x1F) != 0x05)
+        return 1;
+
+    return SDCard__wait_busy();
+}
+
+// the card holds DO low while it programs
+static int SDCard__wait_busy() {
+    int busy = 1;
+    for(uint32_t t = deadline_ms(SD_WRITE_TIMEOUT_MS); busy && !deadline_passed(t);) {
+        busy = (SPI_write(0xFF) == 0);
+    }
+    return busy;
 }
 
 static int ext_bits(uint8_t *data, int msb, int lsb)
@@ -617,6 +872,18 @@ static int ext_bits(uint8_t *data, int msb, int lsb)
     return bits;
 }
 
+// TRAN_SPEED is a time value (in tenths) times a rate unit (100kbit/s * 10^n)
+static uint32_t SDCard__tran_speed(int tran_speed)
+{
+    static const uint8_t time_value[16] = { 0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80 };
+    uint32_t unit = 10000;
+
+    for(int i=0; (i<(tran_speed & 7)) && (i<3); i++) {
+        unit *= 10;
+    }
+    return time_value[(tran_speed >> 3) & 15] * unit;
+}
+
 uint32_t SDCard__sd_sectors()
 {
     // CMD9, Response R2 (R1 byte + 16-byte block read)
@@ -638,6 +905,9 @@ uint32_t SDCard__sd_sectors()
 
     uint32_t csd_structure = ext_bits(csd, 127, 126);
 
+    // tran_speed    : csd[103:96] - maximum data rate, same place in both versions
+    _tran_speed = SDCard__tran_speed(ext_bits(csd, 103, 96));
+
 //    printf("CSD_STRUCT = %d\n", csd_structure);
 
     if (csd_structure == 0)
@@ -19,7 +19,14 @@
 void SDCard_init(PinName, PinName, PinName, PinName);
 int SDCard_disk_initialize();
 int SDCard_disk_write(const uint8_t *buffer, uint32_t block_number);
+int SDCard_disk_write_multi(const uint8_t *buffer, uint32_t block_number, int count);
 int SDCard_disk_read(uint8_t *buffer, uint32_t block_number);
+int SDCard_disk_read_multi(uint8_t *buffer, uint32_t block_number, int count);
+int SDCard_stream_start(uint32_t block_number);
+int SDCard_stream_read_start(uint8_t *buffer);
+int SDCard_stream_busy();
+int SDCard_stream_read_finish();
+void SDCard_stream_stop();
 int SDCard_disk_status();
 int SDCard_disk_sync();
 uint32_t SDCard_disk_sectors();
@@ -25,7 +25,9 @@
 
 /*
  * Run with:
- * gcc -std=gnu99 -ICMSISv2p00_LPC17xx/src -lm -o baudfinder baudfinder.c && ./baudfinder
+ * gcc -std=gnu99 -ICMSISv2p00_LPC17xx/src -lm -o baudfinder baudfinder.c && ./baudfinder [extra baud rates]
+ *
+ * The output is the baud_lut.h that uart.c includes, the Makefile does this for you
  */
 
 #ifndef __LPC17XX__
@@ -129,6 +131,8 @@ int baud_space_search(uint32_t target_baud, uint32_t SystemCoreClock, uart_regs
 
 uint32_t find_baud(uint32_t target_baud, uint32_t SystemCoreClock)
 {
+	// same starting point as the search in uart.c, so we find the same answer
+	best.baud = 0;
 	int i = baud_space_search(target_baud, SystemCoreClock, &best);
 
 	uint32_t b = real_baud(SystemCoreClock / (1<<best.pd), best.dl, best.divaddval, best.mulval);
@@ -153,21 +157,27 @@ uint32_t main(uint32_t argc, char **argv)
 // 	uint32_t usbclk = Fcco / (USBCLKCFG_Val + 1);
 // 	printf("USB CLK: %gMHz\n", usbclk / 1000000.0);
 
+	static const uint32_t standard[] = { 9600, 38400, 57600, 115200, 230400, 250000, 1000000, 2000000, 4000000, 0 };
+	uint32_t a, s;
+
 // 	printf(" TARGET PD DLM DLL MULVAL DIVADDVAL:    BAUD/  IBAUD [ERROR]\n");
+	printf("/* generated by baudfinder, do not edit */\n");
 	printf("#if (__CORE_CLK) == %d\n", SystemCoreClock);
-	printf("\ttypedef struct {\n\t\tuint32_t baud;\n\t\tuint8_t  pclk;\n\t\tuint16_t dl;\n\t\tuint8_t  mul;\n\t\tuint8_t  divadd;\n\t} BAUD_LUT;\n");
-	printf("\tBAUD_LUT baud_lut[] = {\n");
-	printf("\t\t//  BAUD PCLK     DL MUL DIV\n");
-
-	find_baud(9600   , SystemCoreClock);
-	find_baud(38400  , SystemCoreClock);
-	find_baud(57600  , SystemCoreClock);
-	find_baud(115200 , SystemCoreClock);
-	find_baud(230400 , SystemCoreClock);
-	find_baud(250000 , SystemCoreClock);
-	find_baud(1000000, SystemCoreClock);
-	find_baud(2000000, SystemCoreClock);
-	find_baud(4000000, SystemCoreClock);
+	printf("#define BAUD_LUT_CORE_CLK %d\n", SystemCoreClock);
+	printf("\tstatic const uart_regs baud_lut[] = {\n");
+	printf("\t\t//  BAUD  PD     DL MUL DIV\n");
+
+	for (s = 0; standard[s]; s++)
+		find_baud(standard[s], SystemCoreClock);
+
+	// anything else asked for, such as APPBAUD
+	for (a = 1; a < argc; a++)
+	{
+		uint32_t b = strtoul(argv[a], NULL, 0);
+		for (s = 0; standard[s] && (standard[s] != b); s++);
+		if (b && (standard[s] == 0))
+			find_baud(b, SystemCoreClock);
+	}
 
 	printf("\t\t{%7d,%4d,%6d,%3d,%3d}\t// END\n", 0, 0, 0, 0, 0);
 	printf("\t};\n");
@@ -0,0 +1,253 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+#include "cdc.h"
+
+#include "usbhw.h"
+#include "descriptor_cdc.h"
+#include "profile.h"
+
+#include <LPC17xx.h>
+
+#include "min-printf.h"
+
+#if !(defined DEBUG)
+#define printf(...) do {} while (0)
+#endif
+
+// console output, sent from tail by the USB interrupt
+static uint8_t tx_buf[CDC_TX_RING];
+static volatile uint16_t tx_head;
+static volatile uint16_t tx_tail;
+static uint8_t tx_zlp;
+
+#define TX_QUEUED ((uint16_t) (tx_head - tx_tail))
+
+// the command being typed, handed to CDC_task() once it ends
+static char line[CDC_LINE_LENGTH];
+static uint8_t line_length;
+static volatile uint8_t line_ready;
+
+static usbcdc_line_coding line_coding = { 115200, 0, 0, 8 };
+static volatile uint8_t configured;
+static uint8_t boot;
+
+void CDC_init()
+{
+	tx_zlp = 0;
+	line_length = 0;
+	line_ready = 0;
+	configured = 0;
+	boot = 0;
+}
+
+uint32_t CDC_send(const uint8_t *data, uint32_t length)
+{
+	uint32_t i;
+	uint8_t intr = __get_IPSR() & 0x1F;
+
+	if (intr == 0)
+		__disable_irq();
+
+	// when the ring is full, keep the oldest output
+	if (length > CDC_TX_RING - TX_QUEUED)
+		length = CDC_TX_RING - TX_QUEUED;
+	for (i = 0; i < length; i++)
+		tx_buf[(tx_head + i) & (CDC_TX_RING - 1)] = data[i];
+	tx_head += length;
+
+	if (intr == 0)
+		__enable_irq();
+
+	return length;
+}
+
+// move the ring into the IN endpoint. Full packets go whenever there's
+// room, a short one only when the endpoint has drained, so that output
+// arriving in dribs is gathered up while the last packet goes out.
+// Runs in the USB interrupt, or with it masked
+static void CDC_kick()
+{
+	uint8_t packet[CDC_PACKET_SIZE] __attribute__ ((aligned(4)));
+
+	while (configured && usb_can_write(CDC_EP_IN))
+	{
+		uint16_t n = TX_QUEUED;
+		uint16_t i;
+
+		if (n < CDC_PACKET_SIZE)
+		{
+			// a transfer ending on a full packet needs a ZLP to finish it
+			if (usb_write_pending(CDC_EP_IN) || ((n == 0) && (tx_zlp == 0)))
+				return;
+		}
+		else
+			n = CDC_PACKET_SIZE;
+
+		for (i = 0; i < n; i++)
+			packet[i] = tx_buf[(tx_tail + i) & (CDC_TX_RING - 1)];
+		usb_write_packet(CDC_EP_IN, packet, n);
+		tx_tail += n;
+		tx_zlp = (n == CDC_PACKET_SIZE);
+	}
+}
+
+// collect typed characters into line, and stop reading (so the host is
+// NAKed) once a command is waiting for CDC_task().
+// Runs in the USB interrupt, or with it masked
+static void CDC_receive()
+{
+	uint8_t packet[CDC_PACKET_SIZE];
+
+	while ((line_ready == 0) && usb_can_read(CDC_EP_OUT))
+	{
+		int l = usb_read_packet(CDC_EP_OUT, packet, sizeof(packet));
+		int i;
+
+		for (i = 0; i < l; i++)
+		{
+			uint8_t c = packet[i];
+			if ((c == '\r') || (c == '\n'))
+			{
+				if (line_length == 0)
+					continue;
+				CDC_send((const uint8_t *) "\r\n", 2);
+				line[line_length] = 0;
+				line_ready = 1;
+				// the rest of the packet is dropped
+				break;
+			}
+			else if ((c == '\b') || (c == 0x7F))
+			{
+				if (line_length == 0)
+					continue;
+				CDC_send((const uint8_t *) "\b \b", 3);
+				line_length--;
+			}
+			else if ((c >= ' ') && (line_length < CDC_LINE_LENGTH - 1))
+			{
+				CDC_send(&c, 1);
+				line[line_length++] = c;
+			}
+		}
+	}
+	CDC_kick();
+}
+
+// SET_CONFIGURATION, from the USB interrupt
+void CDC_configure()
+{
+	usb_realise_endpoint(CDC_EP_NOTIFY, 8);
+	usb_realise_endpoint(CDC_EP_OUT, CDC_PACKET_SIZE);
+	usb_realise_endpoint(CDC_EP_IN, CDC_PACKET_SIZE);
+	usb_ep_unstall(CDC_EP_NOTIFY);
+	usb_ep_unstall(CDC_EP_OUT);
+	usb_ep_unstall(CDC_EP_IN);
+	usb_set_callback(CDC_EP_OUT, CDC_receive);
+	usb_set_callback(CDC_EP_IN, CDC_kick);
+	tx_zlp = 0;
+	configured = 1;
+}
+
+void CDC_controlTransfer(CONTROL_TRANSFER *control)
+{
+	switch (control->setup.bRequest)
+	{
+		case CDC_SET_LINE_CODING:
+			// the console doesn't care, but the host reads it back
+			if (control->setup.wLength != sizeof(line_coding))
+			{
+				usb_ep0_stall();
+				break;
+			}
+			control->buffer = &line_coding;
+			control->bufferlen = sizeof(line_coding);
+			break;
+		case CDC_GET_LINE_CODING:
+			control->buffer = &line_coding;
+			control->bufferlen = sizeof(line_coding);
+			break;
+		case CDC_SET_CONTROL_LINE_STATE:
+			printf("CDC: DTR %d RTS %d\n", control->setup.wValue & 1, (control->setup.wValue >> 1) & 1);
+			break;
+		default:
+			usb_ep0_stall();
+			break;
+	}
+}
+
+static int streq(const char *a, const char *b)
+{
+	while (*a && (*a == *b))
+		a++, b++;
+	return *a == *b;
+}
+
+static void CDC_command(const char *cmd)
+{
+	if (streq(cmd, "help"))
+		fprintf(CDC_FD, "help    this list\r\nprofile boot timings\r\nreset   restart the bootloader\r\nboot    leave DFU mode and start the firmware\r\n");
+	else if (streq(cmd, "profile"))
+		profile_print(CDC_FD);
+	else if (streq(cmd, "reset"))
+		NVIC_SystemReset();
+	else if (streq(cmd, "boot"))
+	{
+		fprintf(CDC_FD, "booting\r\n");
+		boot = 1;
+	}
+	else
+		fprintf(CDC_FD, "%s: unknown command, try help\r\n", cmd);
+}
+
+void CDC_task()
+{
+	NVIC_DisableIRQ(USB_IRQn);
+	if (line_ready)
+	{
+		NVIC_EnableIRQ(USB_IRQn);
+		CDC_command(line);
+		NVIC_DisableIRQ(USB_IRQn);
+		line_length = 0;
+		line_ready = 0;
+		// the endpoint may have NAKed while the command ran
+		CDC_receive();
+	}
+	else
+		CDC_kick();
+	NVIC_EnableIRQ(USB_IRQn);
+}
+
+// nothing to send, or waiting for the host to collect it
+int CDC_idle()
+{
+	return (line_ready == 0) && ((TX_QUEUED == 0) || (configured == 0) || usb_write_pending(CDC_EP_IN));
+}
+
+// boot requested, and its reply sent
+int CDC_complete()
+{
+	return boot && (TX_QUEUED == 0) && (tx_zlp == 0) && (usb_write_pending(CDC_EP_IN) == 0);
+}
@@ -0,0 +1,74 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+#ifndef _CDC_H
+#define _CDC_H
+
+#include <stdint.h>
+
+#include "usbcore.h"
+
+/*
+ * CDC-ACM serial port, added to the DFU configuration when built with CDC
+ * defined, so the device enumerates as a composite of both.
+ *
+ * Everything written to stdout goes into a ring here as well as to the
+ * UART. The ring is sent in 64 byte packets; a partial packet only goes
+ * once the endpoint has nothing else queued, so a burst of printf()s is
+ * batched rather than sent a few bytes at a time.
+ *
+ * The host can send commands, one per line (help lists them). Anything
+ * after the end of a line in the same packet is dropped.
+ */
+
+#if defined MSC && defined VENDOR
+#define CDC_INTERFACE		3
+#elif defined MSC || defined VENDOR
+#define CDC_INTERFACE		2
+#else
+#define CDC_INTERFACE		1
+#endif
+#define CDC_DATA_INTERFACE	(CDC_INTERFACE + 1)
+
+#define CDC_EP_NOTIFY		0x81
+#define CDC_EP_OUT			0x08
+#define CDC_EP_IN			0x88
+#define CDC_PACKET_SIZE		64
+
+#define CDC_TX_RING			1024
+#define CDC_LINE_LENGTH		64
+
+// file descriptor for fprintf() to the serial port alone
+#define CDC_FD				3
+
+void CDC_init(void);
+void CDC_configure(void);
+void CDC_controlTransfer(CONTROL_TRANSFER *);
+uint32_t CDC_send(const uint8_t *data, uint32_t length);
+void CDC_task(void);
+int  CDC_idle(void);
+int  CDC_complete(void);
+
+#endif /* _CDC_H */
@@ -0,0 +1,48 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+#include "crc32.h"
+
+// a nibble at a time, the table is small enough to stay out of the way
+static const uint32_t crc32_nibble[16] = {
+	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+	0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+	0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+uint32_t crc32(uint32_t crc, const void *data, uint32_t length)
+{
+	const uint8_t *p = data;
+
+	crc = ~crc;
+	while (length--)
+	{
+		crc = (crc >> 4) ^ crc32_nibble[(crc ^  *p      ) & 15];
+		crc = (crc >> 4) ^ crc32_nibble[(crc ^ (*p >> 4)) & 15];
+		p++;
+	}
+	return ~crc;
+}
@@ -0,0 +1,35 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+#ifndef _CRC32_H
+#define _CRC32_H
+
+#include <stdint.h>
+
+// IEEE 802.3 CRC32, as zlib's crc32(). Start with 0, pass the result back
+// in to continue over more data
+uint32_t crc32(uint32_t crc, const void *data, uint32_t length);
+
+#endif /* _CRC32_H */
@@ -0,0 +1,252 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+#include "delta.h"
+
+#ifdef IMAGE
+
+#include "crc32.h"
+
+#include "sbl_iap.h"
+
+enum
+{
+	DELTA_S_CONTROL,
+	DELTA_S_DIFF,
+	DELTA_S_EXTRA,
+	DELTA_S_DONE,
+};
+
+static IMAGE_delta patch;
+static uint8_t part;			// of the record being read
+
+// the record being read: diff bytes, extra bytes, seek
+static uint32_t control[3];
+static uint8_t field;
+static uint8_t shift;
+
+static uint32_t old;			// next byte of the old firmware a diff byte adds to
+
+static uint8_t buffer[DELTA_BUFFER] __attribute__ ((aligned(4)));
+static uint32_t made;			// bytes of new firmware made so far
+static uint32_t written;		// bytes of those passed on to the flash
+static uint32_t made_crc;		// of the written bytes
+
+// the sector being rebuilt, and whether that's going via the scratch sector
+static uint32_t sector_start;
+static uint32_t sector_end;
+static uint8_t scratch;
+
+static void DELTA_sector()
+{
+	unsigned sector = sector_of(USER_FLASH_START + made);
+
+	sector_start = SECTOR_START(sector);
+	sector_end = SECTOR_END(sector);
+	scratch = (patch.scratch >> sector) & 1;
+}
+
+// check the patch is for the firmware we have, before we touch anything
+unsigned DELTA_start(const IMAGE_delta *delta)
+{
+	patch = *delta;
+
+	if (patch.scratch & ~(((1UL << FLASH_SCRATCH_SECTOR) - 1) & ~((1UL << USER_START_SECTOR) - 1)))
+		return IMAGE_ERR_FORMAT;
+	if ((patch.old_length > USER_FLASH_SIZE) || (patch.new_length > USER_FLASH_SIZE))
+		return IMAGE_ERR_ADDRESS;
+
+	if (crc32(0, FLASH_MAP(USER_FLASH_START), patch.old_length) != patch.old_crc)
+		return IMAGE_ERR_SOURCE;
+
+	part = patch.new_length?DELTA_S_CONTROL:DELTA_S_DONE;
+	field = 0;
+	shift = 0;
+	control[0] = 0;
+	old = 0;
+	made = written = 0;
+	made_crc = 0;
+	DELTA_sector();
+	return CMD_SUCCESS;
+}
+
+// the sector is all in scratch, put it where it goes
+static unsigned DELTA_commit()
+{
+	unsigned r;
+
+	if ((r = flush_flash()) != CMD_SUCCESS)
+		return r;
+	return write_flash((unsigned *) (uintptr_t) sector_start, (char *) FLASH_MAP(SECTOR_START(FLASH_SCRATCH_SECTOR)), USER_FLASH_START + made - sector_start);
+}
+
+static unsigned DELTA_flush()
+{
+	uint32_t address = USER_FLASH_START + written;
+	uint32_t n = made - written;
+	unsigned r;
+
+	made_crc = crc32(made_crc, buffer, n);
+	written = made;
+
+	if (scratch)
+		address += SECTOR_START(FLASH_SCRATCH_SECTOR) - sector_start;
+	if ((r = write_flash((unsigned *) (uintptr_t) address, (char *) buffer, n)) != CMD_SUCCESS)
+		return r;
+
+	if ((USER_FLASH_START + made > sector_end) || (made == patch.new_length))
+	{
+		if (scratch && ((r = DELTA_commit()) != CMD_SUCCESS))
+			return r;
+		DELTA_sector();
+	}
+	return CMD_SUCCESS;
+}
+
+// buffered so it never spans two sectors
+static unsigned DELTA_put(uint8_t c)
+{
+	buffer[made - written] = c;
+	made++;
+	if ((made - written == DELTA_BUFFER) || (USER_FLASH_START + made > sector_end) || (made == patch.new_length))
+		return DELTA_flush();
+	return CMD_SUCCESS;
+}
+
+// a record is finished, or has no more bytes of one kind
+static void DELTA_next()
+{
+	if (control[0])
+		part = DELTA_S_DIFF;
+	else if (control[1])
+		part = DELTA_S_EXTRA;
+	else
+	{
+		old += control[2];
+		part = (made == patch.new_length)?DELTA_S_DONE:DELTA_S_CONTROL;
+		field = 0;
+		shift = 0;
+		control[0] = 0;
+	}
+}
+
+// the next length bytes of the patch stream
+unsigned DELTA_write(const uint8_t *data, uint32_t length)
+{
+	unsigned r;
+
+	while (length--)
+	{
+		uint8_t c = *data++;
+
+		switch (part)
+		{
+			case DELTA_S_CONTROL:
+				if (shift > 28)
+					return IMAGE_ERR_FORMAT;
+				control[field] |= (uint32_t) (c & 0x7F) << shift;
+				shift += 7;
+				if (c & 0x80)
+					break;
+				shift = 0;
+				if (++field < 3)
+				{
+					control[field] = 0;
+					break;
+				}
+				// zigzag, so small seeks back are small too
+				control[2] = (control[2] >> 1) ^ -(control[2] & 1);
+				if ((control[0] > patch.new_length - made) || (control[1] > patch.new_length - made - control[0]))
+					return IMAGE_ERR_FORMAT;
+				DELTA_next();
+				break;
+			case DELTA_S_DIFF:
+				// nothing behind the sector being rebuilt is left to read
+				if ((old >= patch.old_length) || (USER_FLASH_START + old < sector_start))
+					return IMAGE_ERR_FORMAT;
+				if ((r = DELTA_put(*(const uint8_t *) FLASH_MAP(USER_FLASH_START + old) + c)) != CMD_SUCCESS)
+					return r;
+				old++;
+				control[0]--;
+				if (control[0] == 0)
+					DELTA_next();
+				break;
+			case DELTA_S_EXTRA:
+				if ((r = DELTA_put(c)) != CMD_SUCCESS)
+					return r;
+				control[1]--;
+				if (control[1] == 0)
+					DELTA_next();
+				break;
+			case DELTA_S_DONE:
+				return IMAGE_ERR_FORMAT;
+		}
+	}
+	return CMD_SUCCESS;
+}
+
+// the patch stream is all here: check it made what it should have
+unsigned DELTA_finish()
+{
+	if (part != DELTA_S_DONE)
+		return IMAGE_ERR_LENGTH;
+	if (made_crc != patch.new_crc)
+		return IMAGE_ERR_CRC;
+	return CMD_SUCCESS;
+}
+
+// milliseconds of flash work for the next length bytes of new firmware, at
+// worst. A sector that goes via scratch costs its scratch pages, then an
+// erase and every page again to copy it into place
+unsigned DELTA_cost(uint32_t length)
+{
+	uint32_t at = USER_FLASH_START + written;
+	uint32_t end;
+	unsigned ms = 0;
+
+	if (length > patch.new_length - written)
+		length = patch.new_length - written;
+	end = at + length;
+
+	while (at < end)
+	{
+		unsigned sector = sector_of(at);
+		uint32_t top = SECTOR_END(sector) + 1;
+		uint32_t n = ((end < top)?end:top) - at;
+
+		if ((patch.scratch >> sector) & 1)
+		{
+			ms += write_flash_cost((unsigned *) (uintptr_t) (at + SECTOR_START(FLASH_SCRATCH_SECTOR) - SECTOR_START(sector)), 0, n);
+			if ((at + n == top) || (at + n == USER_FLASH_START + patch.new_length))
+				ms += FLASH_ERASE_MS + ((at + n - SECTOR_START(sector) + FLASH_BUF_SIZE - 1) / FLASH_BUF_SIZE) * FLASH_PROG_MS;
+		}
+		else
+			ms += write_flash_cost((unsigned *) (uintptr_t) at, 0, n);
+		at += n;
+	}
+	return ms;
+}
+
+#endif /* IMAGE */
@@ -0,0 +1,63 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+#ifndef _DELTA_H
+#define _DELTA_H
+
+#include <stdint.h>
+
+#include "image.h"
+
+#include "sbl_config.h"
+
+/*
+ * Patches, which rebuild new firmware out of the firmware already in
+ * user flash, so an update only has to carry what changed.
+ *
+ * The patch stream is bsdiff-like, a run of records that each have three
+ * LEB128 numbers: diff bytes, extra bytes and a seek (zigzag encoded),
+ * then that many diff bytes and extra bytes. Each diff byte is added to
+ * the next byte of the old firmware, extra bytes are copied as they are,
+ * and the seek then moves the place in the old firmware.
+ *
+ * New firmware overwrites old firmware as the patch goes, so a patch may
+ * only read old firmware from the sector being rebuilt onwards. Sectors
+ * that need their own old contents after the erase are built in
+ * FLASH_SCRATCH_SECTOR first, then copied into place. imagepack.c makes
+ * patches that keep to both rules.
+ *
+ * sbl_iap.c uses the scratch sector too, and user flash stops in front
+ * of it, so neither firmware can reach it.
+ */
+
+// new firmware goes to the flash in pieces this size
+#define DELTA_BUFFER			256
+
+unsigned DELTA_start(const IMAGE_delta *delta);
+unsigned DELTA_write(const uint8_t *data, uint32_t length);
+unsigned DELTA_finish(void);
+unsigned DELTA_cost(uint32_t length);
+
+#endif /* _DELTA_H */
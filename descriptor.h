@@ -8,6 +8,7 @@
 #define DL_INTERFACE                0x09
 #define DL_ENDPOINT                 0x07
 #define DL_LANGUAGE                 0x04
+#define DL_INTERFACE_ASSOCIATION    0x08
 
 #define mA                          /2
 
@@ -17,6 +18,7 @@
 #define DT_LANGUAGE                 3
 #define DT_INTERFACE                4
 #define DT_ENDPOINT                 5
+#define DT_INTERFACE_ASSOCIATION    11
 
 #define USB_VERSION_1_0             0x0100
 #define USB_VERSION_1_1             0x0110
@@ -128,6 +130,20 @@ __attribute__ ((packed))
 }
     usbdesc_interface;
 
+typedef struct
+__attribute__ ((packed))
+{
+    uint8_t         bLength;                // Interface Association Descriptor Length (0x08)
+    uint8_t         bDescType;              // DT_INTERFACE_ASSOCIATION (0x0B)
+    uint8_t         bFirstInterface;        // Number of the first interface of the function
+    uint8_t         bInterfaceCount;        // Number of contiguous interfaces in the function
+    uint8_t         bFunctionClass;         // Class Code - see UC_* defines
+    uint8_t         bFunctionSubClass;      // Subclass Code
+    uint8_t         bFunctionProtocol;      // Protocol Code
+    uint8_t         iFunction;              // Index of String Descriptor describing the function
+}
+    usbdesc_iad;
+
 typedef struct
 __attribute__ ((packed))
 {
@@ -119,4 +119,12 @@ typedef struct __attribute__ ((packed)) {
 } usbcdc_ether;
 #define USB_CDC_LENGTH_ETHER sizeof(usbcdc_ether)
 
+// CDC_SET_LINE_CODING / CDC_GET_LINE_CODING data
+typedef struct __attribute__ ((packed)) {
+	uint32_t	dwDTERate;					// bits per second
+	uint8_t	bCharFormat;					// 0: 1 stop bit, 1: 1.5, 2: 2
+	uint8_t	bParityType;					// 0: none, 1: odd, 2: even, 3: mark, 4: space
+	uint8_t	bDataBits;
+} usbcdc_line_coding;
+
 #endif /* _DESCRIPTOR_CDC_H */
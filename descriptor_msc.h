@@ -68,6 +68,7 @@ typedef struct __attribute__ ((packed)) {
 #define SCSI_READ10                     0x28
 #define SCSI_WRITE10                    0x2A
 #define SCSI_VERIFY10                   0x2F
+#define SCSI_SYNCHRONIZE_CACHE10        0x35
 #define SCSI_MODE_SELECT10              0x55
 #define SCSI_MODE_SENSE10               0x5A
 
@@ -33,11 +33,47 @@
 
 #include "descriptor.h"
 
+#ifdef MSC
+#include "descriptor_msc.h"
+#include "msc.h"
+
+#define MSC_INTERFACES	1
+#define DL_MSC			(DL_INTERFACE + DL_ENDPOINT + DL_ENDPOINT)
+#else
+#define MSC_INTERFACES	0
+#define DL_MSC			0
+#endif
+
+#ifdef VENDOR
+#include "vendor.h"
+
+#define VENDOR_INTERFACES	1
+#define DL_VENDOR			(DL_INTERFACE + DL_ENDPOINT + DL_ENDPOINT)
+#else
+#define VENDOR_INTERFACES	0
+#define DL_VENDOR			0
+#endif
+
+#ifdef CDC
+#include "descriptor_cdc.h"
+#include "cdc.h"
+
+#define CDC_INTERFACES	2
+#define DL_CDC			(DL_INTERFACE_ASSOCIATION + DL_INTERFACE + USB_CDC_LENGTH_HEADER + USB_CDC_LENGTH_CALLMGMT + USB_CDC_LENGTH_ACM + USB_CDC_LENGTH_UNION + DL_ENDPOINT + DL_INTERFACE + DL_ENDPOINT + DL_ENDPOINT)
+#else
+#define CDC_INTERFACES	0
+#define DL_CDC			0
+#endif
+
 #include "sbl_iap.h"
+#include "image.h"
+
+#include "profile.h"
 
 #include "string.h"
 
 #define DFU_BLOCK_SIZE 512
+#define DFU_BLOCK_BUFFERS 2
 
 #if !(defined DEBUG)
 #define printf(...) do {} while (0)
@@ -52,10 +88,43 @@ __attribute__ ((packed))
 	usbdesc_configuration configuration;
 	usbdesc_interface	interface;
 	DFU_functional_descriptor dfufunc;
+#ifdef MSC
+	usbdesc_interface	msc_interface;
+	usbdesc_endpoint	msc_out;
+	usbdesc_endpoint	msc_in;
+#endif
+#ifdef VENDOR
+	usbdesc_interface	vendor_interface;
+	usbdesc_endpoint	vendor_out;
+	usbdesc_endpoint	vendor_in;
+#endif
+#ifdef CDC
+	usbdesc_iad			cdc_iad;
+	usbdesc_interface	cdc_interface;
+	usbcdc_header		cdc_header;
+	usbcdc_callmgmt		cdc_callmgmt;
+	usbcdc_acm			cdc_acm;
+	usbcdc_union		cdc_union;
+	usbdesc_endpoint	cdc_notify;
+	usbdesc_interface	cdc_data_interface;
+	usbdesc_endpoint	cdc_out;
+	usbdesc_endpoint	cdc_in;
+#endif
 	usbdesc_language lang;
 	usbdesc_string_l(12) iManufacturer;
 	usbdesc_string_l(8) iProduct;
 	usbdesc_string_l(12) iInterface;
+#ifdef MSC_VFAT
+	usbdesc_string_l(14) iMSCInterface;
+#elif defined MSC
+	usbdesc_string_l(11) iMSCInterface;
+#endif
+#ifdef VENDOR
+	usbdesc_string_l(13) iVendorInterface;
+#endif
+#ifdef CDC
+	usbdesc_string_l(15) iCDCInterface;
+#endif
 	usbdesc_base endnull;
 } DFU_APP_Descriptor;
 
@@ -65,9 +134,15 @@ DFU_APP_Descriptor desc =
 		DL_DEVICE,
 		DT_DEVICE,
 		USB_VERSION_2_0,	// bcdUSBVersion
+#ifdef CDC
+		UC_MISC,					// bDeviceClass - composite with interface association
+		0x02,						// bDeviceSubClass
+		0x01,						// bDeviceProtocol
+#else
 		0,							// bDeviceClass
 		0,							// bDeviceSubClass
 		0,							// bDeviceProtocol
+#endif
 		64,						// bMaxPacketSize
 		0x1D50,					// idVendor
 		0x6015,					// idProduct
@@ -80,8 +155,8 @@ DFU_APP_Descriptor desc =
 	{
 		DL_CONFIGURATION,
 		DT_CONFIGURATION,
-		DL_CONFIGURATION + DL_INTERFACE + DL_DFU_FUNCTIONAL_DESCRIPTOR,
-		1,							// bNumInterfaces
+		DL_CONFIGURATION + DL_INTERFACE + DL_DFU_FUNCTIONAL_DESCRIPTOR + DL_MSC + DL_VENDOR + DL_CDC,
+		1 + MSC_INTERFACES + VENDOR_INTERFACES + CDC_INTERFACES,	// bNumInterfaces
 		1,							// bConfigurationValue
 		0,							// iConfiguration
 		CA_BUSPOWERED,	// bmAttributes
@@ -90,7 +165,7 @@ DFU_APP_Descriptor desc =
 	{
 		DL_INTERFACE,
 		DT_INTERFACE,
-		0,							// bInterfaceNumber
+		DFU_INTERFACE,				// bInterfaceNumber
 		0,							// bAlternate
 		0,							// bNumEndpoints
 		DFU_INTERFACE_CLASS,		// bInterfaceClass
@@ -106,6 +181,148 @@ DFU_APP_Descriptor desc =
 		DFU_BLOCK_SIZE,				// wTransferSize - the size of each packet of firmware sent from the host via control transfers
 		DFU_VERSION_1_1	// bcdDFUVersion
 	},
+#ifdef MSC
+	{
+		DL_INTERFACE,
+		DT_INTERFACE,
+		MSC_INTERFACE,				// bInterfaceNumber
+		0,							// bAlternate
+		2,							// bNumEndpoints
+		UC_MASS_STORAGE,			// bInterfaceClass
+		MSC_SUBCLASS_SCSI,			// bInterfaceSubClass
+		MSC_PROTOCOL_BULK_ONLY,		// bInterfaceProtocol
+		4							// iInterface
+	},
+	{
+		DL_ENDPOINT,
+		DT_ENDPOINT,
+		MSC_EP_OUT,					// bEndpointAddress
+		EA_BULK,					// bmAttributes
+		MSC_PACKET_SIZE,			// wMaxPacketSize
+		0							// bInterval
+	},
+	{
+		DL_ENDPOINT,
+		DT_ENDPOINT,
+		MSC_EP_IN,					// bEndpointAddress
+		EA_BULK,					// bmAttributes
+		MSC_PACKET_SIZE,			// wMaxPacketSize
+		0							// bInterval
+	},
+#endif
+#ifdef VENDOR
+	{
+		DL_INTERFACE,
+		DT_INTERFACE,
+		VENDOR_INTERFACE,			// bInterfaceNumber
+		0,							// bAlternate
+		2,							// bNumEndpoints
+		UC_VENDOR_SPEC,				// bInterfaceClass
+		0,							// bInterfaceSubClass
+		0,							// bInterfaceProtocol
+		4 + MSC_INTERFACES			// iInterface
+	},
+	{
+		DL_ENDPOINT,
+		DT_ENDPOINT,
+		VENDOR_EP_OUT,				// bEndpointAddress
+		EA_BULK,					// bmAttributes
+		VENDOR_PACKET_SIZE,			// wMaxPacketSize
+		0							// bInterval
+	},
+	{
+		DL_ENDPOINT,
+		DT_ENDPOINT,
+		VENDOR_EP_IN,				// bEndpointAddress
+		EA_BULK,					// bmAttributes
+		VENDOR_PACKET_SIZE,			// wMaxPacketSize
+		0							// bInterval
+	},
+#endif
+#ifdef CDC
+	{
+		DL_INTERFACE_ASSOCIATION,
+		DT_INTERFACE_ASSOCIATION,
+		CDC_INTERFACE,				// bFirstInterface
+		2,							// bInterfaceCount
+		UC_COMM,					// bFunctionClass
+		USB_CDC_SUBCLASS_ACM,		// bFunctionSubClass
+		USB_CDC_PROTOCOL_NONE,		// bFunctionProtocol
+		4 + MSC_INTERFACES + VENDOR_INTERFACES	// iFunction
+	},
+	{
+		DL_INTERFACE,
+		DT_INTERFACE,
+		CDC_INTERFACE,				// bInterfaceNumber
+		0,							// bAlternate
+		1,							// bNumEndpoints
+		UC_COMM,					// bInterfaceClass
+		USB_CDC_SUBCLASS_ACM,		// bInterfaceSubClass
+		USB_CDC_PROTOCOL_NONE,		// bInterfaceProtocol
+		4 + MSC_INTERFACES + VENDOR_INTERFACES	// iInterface
+	},
+	{
+		USB_CDC_LENGTH_HEADER,
+		DT_CDC_DESCRIPTOR,
+		USB_CDC_SUBTYPE_HEADER,
+		0x0110						// bcdCDC
+	},
+	{
+		USB_CDC_LENGTH_CALLMGMT,
+		DT_CDC_DESCRIPTOR,
+		USB_CDC_SUBTYPE_CALL_MANAGEMENT,
+		0,							// bmCapabilities - no call management
+		CDC_DATA_INTERFACE			// bDataInterface
+	},
+	{
+		USB_CDC_LENGTH_ACM,
+		DT_CDC_DESCRIPTOR,
+		USB_CDC_SUBTYPE_ACM,
+		USB_CDC_ACM_CAP_LINE		// bmCapabilities - line coding and control line state
+	},
+	{
+		USB_CDC_LENGTH_UNION,
+		DT_CDC_DESCRIPTOR,
+		USB_CDC_SUBTYPE_UNION,
+		CDC_INTERFACE,				// bMasterInterface
+		CDC_DATA_INTERFACE			// bSlaveInterface0
+	},
+	{
+		DL_ENDPOINT,
+		DT_ENDPOINT,
+		CDC_EP_NOTIFY,				// bEndpointAddress
+		EA_INTERRUPT,				// bmAttributes
+		8,							// wMaxPacketSize
+		10							// bInterval
+	},
+	{
+		DL_INTERFACE,
+		DT_INTERFACE,
+		CDC_DATA_INTERFACE,			// bInterfaceNumber
+		0,							// bAlternate
+		2,							// bNumEndpoints
+		UC_CDC_DATA,				// bInterfaceClass
+		0,							// bInterfaceSubClass
+		0,							// bInterfaceProtocol
+		0							// iInterface
+	},
+	{
+		DL_ENDPOINT,
+		DT_ENDPOINT,
+		CDC_EP_OUT,					// bEndpointAddress
+		EA_BULK,					// bmAttributes
+		CDC_PACKET_SIZE,			// wMaxPacketSize
+		0							// bInterval
+	},
+	{
+		DL_ENDPOINT,
+		DT_ENDPOINT,
+		CDC_EP_IN,					// bEndpointAddress
+		EA_BULK,					// bmAttributes
+		CDC_PACKET_SIZE,			// wMaxPacketSize
+		0							// bInterval
+	},
+#endif
 	{
 		DL_LANGUAGE,
 		DT_LANGUAGE,
@@ -114,6 +331,17 @@ DFU_APP_Descriptor desc =
 	usbstring(12, "SmoothieWare"),
 	usbstring(8 , "Smoothie"),
 	usbstring(12, "Smoothie DFU"),
+#ifdef MSC_VFAT
+	usbstring(14, "Smoothie Flash"),
+#elif defined MSC
+	usbstring(11, "Smoothie SD"),
+#endif
+#ifdef VENDOR
+	usbstring(13, "Smoothie Bulk"),
+#endif
+#ifdef CDC
+	usbstring(15, "Smoothie Serial"),
+#endif
 	{
 		0,							// bLength
 		0							// bDescType
@@ -168,13 +396,33 @@ DFU_STATE_enum current_state;
 
 DFU_STATUS_t DFU_status = {
 	OK,
-	500,
+	0,
 	dfuIDLE,
 	0
 };
 
-uint8_t block_buffer[DFU_BLOCK_SIZE];
+DFU_STATUS_t status_response;
+
+// downloaded blocks are queued at block_head when their control transfer
+// completes, and flashed from block_tail by DFU_task() so the host can send
+// the next block while the previous one is being written
+uint8_t block_buffer[DFU_BLOCK_BUFFERS][DFU_BLOCK_SIZE];
+const uint8_t * block_address[DFU_BLOCK_BUFFERS];
+uint16_t block_length[DFU_BLOCK_BUFFERS];
+volatile uint8_t block_head;
+volatile uint8_t block_tail;
+
+#define BLOCKS_QUEUED ((uint8_t) (block_head - block_tail))
+
+// DFU_task() is flashing the block at block_tail, so ABORT leaves it queued
+// rather than let the next DNLOAD reuse its buffer
+static volatile uint8_t block_busy;
+// bumped by ABORT and CLRSTATUS, for DFU_task() to see its block was dropped
+static volatile uint8_t block_generation;
+
 const uint8_t * flash_p;
+// IMAGE_write takes the image as one stream, so it has to come in order
+static const uint8_t * image_next;
 
 extern const uint8_t _user_flash_start;
 extern const uint8_t _user_flash_size;
@@ -192,7 +440,9 @@ void DFU_init()
 void DFU_GetStatus(CONTROL_TRANSFER *control)
 {
 	printf("DFU:GETSTATUS\n");
-	control->buffer = &DFU_status;
+	// DFU_task() may change DFU_status before the host collects it
+	status_response = DFU_status;
+	control->buffer = &status_response;
 	control->bufferlen = 6;
 }
 
@@ -206,7 +456,7 @@ void DFU_GetState(CONTROL_TRANSFER *control)
 void DFU_Download(CONTROL_TRANSFER *control)
 {
 	printf("DFU:DNLOAD\n");
-	control->buffer = block_buffer;
+	control->buffer = block_buffer[block_head % DFU_BLOCK_BUFFERS];
 	control->bufferlen = control->setup.wLength;
 
 	flash_p = (&_user_flash_start) + (control->setup.wValue * DFU_BLOCK_SIZE);
@@ -214,7 +464,16 @@ void DFU_Download(CONTROL_TRANSFER *control)
 	if (control->setup.wLength > 0)
 	{
 // 		printf("WRITE: %p\n", flash_p);
-		if ((flash_p + control->setup.wLength) <= ((&_user_flash_start) + ((uint32_t)(&_user_flash_size))))
+		if ((BLOCKS_QUEUED >= DFU_BLOCK_BUFFERS) || (control->setup.wLength > DFU_BLOCK_SIZE))
+		{
+			// host didn't wait for dfuDNLOADIDLE, we have nowhere to put this
+			control->bufferlen = 0;
+			usb_ep0_stall();
+			current_state = dfuERROR;
+			DFU_status.bStatus = errSTALLEDPKT;
+			DFU_status.bState = dfuERROR;
+		}
+		else if ((flash_p + control->setup.wLength) <= ((&_user_flash_start) + ((uintptr_t)(&_user_flash_size))))
 		{
 			current_state = dfuDNLOADSYNC;
 			DFU_status.bState = dfuDNLOADIDLE;
@@ -232,7 +491,7 @@ void DFU_Upload(CONTROL_TRANSFER *control)
 	printf("DFU:UPLOAD\n");
 	current_state = dfuUPLOADIDLE;
 	flash_p = &_user_flash_start + (control->setup.wValue * DFU_BLOCK_SIZE);
-	if ((flash_p + control->setup.wLength) <= ((&_user_flash_start) + ((uint32_t)(&_user_flash_size))))
+	if ((flash_p + control->setup.wLength) <= ((&_user_flash_start) + ((uintptr_t)(&_user_flash_size))))
 	{
 		control->buffer = (uint8_t *) flash_p;
 		control->bufferlen = control->setup.wLength;
@@ -250,6 +509,9 @@ void DFU_ClearStatus(CONTROL_TRANSFER *control)
 	printf("DFU:CLRSTATUS\n");
 	DFU_status.bStatus = OK;
 	DFU_status.bState = dfuIDLE;
+	DFU_status.bwPollTimeout = 0;
+	block_head = block_tail + block_busy;
+	block_generation++;
 	flash_p = &_user_flash_start;
 }
 
@@ -258,9 +520,22 @@ void DFU_Abort(CONTROL_TRANSFER *control)
 	printf("DFU:ABORT\n");
 	DFU_status.bStatus = OK;
 	DFU_status.bState = dfuIDLE;
+	DFU_status.bwPollTimeout = 0;
+	block_head = block_tail + block_busy;
+	block_generation++;
 	flash_p = &_user_flash_start;
 }
 
+// vendor request on our interface for the boot profile table
+void DFU_BootProfile(CONTROL_TRANSFER *control)
+{
+	printf("DFU:PROFILE\n");
+	control->buffer = (uint8_t *) &boot_profile;
+	control->bufferlen = sizeof(boot_profile);
+	if (control->bufferlen > control->setup.wLength)
+		control->bufferlen = control->setup.wLength;
+}
+
 void DFU_controlTransfer(CONTROL_TRANSFER *control)
 {
 	// 0x20 is CLASS request
@@ -293,6 +568,155 @@ void DFU_controlTransfer(CONTROL_TRANSFER *control)
 				break;
 		}
 	}
+	// 0x40 is VENDOR request, ours only if it's for the DFU interface
+	else if ((control->setup.bmRequestType & 0x7F) == 0x41)
+	{
+		if (control->setup.wIndex != DFU_INTERFACE)
+		{
+			usb_ep0_stall();
+			return;
+		}
+		switch(control->setup.bRequest)
+		{
+			case DFU_VENDOR_PROFILE:
+				DFU_BootProfile(control);
+				break;
+			default:
+				usb_ep0_stall();
+				break;
+		}
+	}
+}
+
+// milliseconds of flash work left before the queue is drained
+uint32_t DFU_queue_cost()
+{
+	uint32_t ms = 0;
+	uint8_t i;
+	for (i = block_tail; i != block_head; i++)
+		ms += IMAGE_cost((uintptr_t) block_address[i % DFU_BLOCK_BUFFERS], block_buffer[i % DFU_BLOCK_BUFFERS], block_length[i % DFU_BLOCK_BUFFERS]);
+	return ms;
+}
+
+// tell the host whether it can send another block, or how long to wait
+void DFU_update_status()
+{
+	switch (DFU_status.bState)
+	{
+		case dfuERROR:
+		case dfuMANIFESTWAITRESET:
+			return;
+		case dfuMANIFEST:
+			DFU_status.bwPollTimeout = DFU_queue_cost() + flush_flash_cost();
+			return;
+		default:
+			if (BLOCKS_QUEUED < DFU_BLOCK_BUFFERS)
+			{
+				DFU_status.bState = dfuDNLOADIDLE;
+				DFU_status.bwPollTimeout = 0;
+			}
+			else
+			{
+				uint8_t i = block_tail % DFU_BLOCK_BUFFERS;
+				DFU_status.bState = dfuDNBUSY;
+				DFU_status.bwPollTimeout = IMAGE_cost((uintptr_t) block_address[i], block_buffer[i], block_length[i]);
+			}
+			return;
+	}
+}
+
+// the DFU status for an IMAGE_write or IMAGE_finish failure
+static uint8_t DFU_error(int r)
+{
+	switch (r)
+	{
+		case IMAGE_ERR_FORMAT:
+		case IMAGE_ERR_LENGTH:
+		case IMAGE_ERR_CRC:
+			return errVERIFY;
+		case IMAGE_ERR_ADDRESS:
+			return errADDRESS;
+		case IMAGE_ERR_SOURCE:
+			return errTARGET;
+		default:
+			return errPROG;
+	}
+}
+
+void DFU_task()
+{
+	uint8_t generation;
+
+	__disable_irq();
+	block_busy = (BLOCKS_QUEUED != 0);
+	generation = block_generation;
+	__enable_irq();
+
+	if (block_busy)
+	{
+		uint8_t i = block_tail % DFU_BLOCK_BUFFERS;
+		printf("WRITE %p\n", block_address[i]);
+		setleds(((uintptr_t) (block_address[i] - 0x4000)) >> 15);
+		int r = IMAGE_ERR_ADDRESS;
+		// block 0 starts a new image, which may be a packed one, and the
+		// rest have to follow on from it
+		if (block_address[i] == &_user_flash_start)
+		{
+			IMAGE_start();
+			image_next = block_address[i];
+		}
+		if (block_address[i] == image_next)
+			r = IMAGE_write(block_buffer[i], block_length[i]);
+		image_next += block_length[i];
+		// the USB interrupt shares the queue and status with us
+		__disable_irq();
+		block_busy = 0;
+		if (generation != block_generation)
+		{
+			// the host aborted while we were writing, and may have queued
+			// blocks of a new download behind this one since
+			block_tail++;
+			if (BLOCKS_QUEUED)
+				DFU_update_status();
+		}
+		else
+		{
+			if (r == 0)
+				block_tail++;
+			else
+			{
+				printf("write flash error %d\n", r);
+				block_tail = block_head;
+				DFU_status.bStatus = DFU_error(r);
+				DFU_status.bState = dfuERROR;
+			}
+			DFU_update_status();
+		}
+		__enable_irq();
+	}
+	else if (DFU_status.bState == dfuMANIFEST)
+	{
+		int r = IMAGE_finish();
+		__disable_irq();
+		if (r == 0)
+		{
+			printf("%u sectors written, %u unchanged\n", flash_sectors_written, flash_sectors_skipped);
+			DFU_status.bState = dfuMANIFESTWAITRESET;
+			DFU_status.bwPollTimeout = 0;
+		}
+		else
+		{
+			printf("flush flash error %d\n", r);
+			DFU_status.bStatus = DFU_error(r);
+			DFU_status.bState = dfuERROR;
+		}
+		__enable_irq();
+	}
+}
+
+int DFU_idle()
+{
+	return (BLOCKS_QUEUED == 0) && (DFU_status.bState != dfuMANIFEST);
 }
 
 void DFU_transferComplete(CONTROL_TRANSFER *control)
@@ -303,7 +727,7 @@ void DFU_transferComplete(CONTROL_TRANSFER *control)
 		{
 			case DFU_GETSTATUS:
 			{
-				current_state = DFU_status.bState;
+				current_state = status_response.bState;
 
 				printf("new state is %d\n", current_state);
 
@@ -319,33 +743,21 @@ void DFU_transferComplete(CONTROL_TRANSFER *control)
 			{
 				if (control->setup.wLength > 0)
 				{
-					printf("WRITE %p\n", flash_p);
-					setleds(((uint32_t) (flash_p - 0x4000)) >> 15);
-					// we must pass DFU_BLOCK_SIZE to write_flash for some reason, it does not flash if we pass a smaller length
-					int r = write_flash((void *) flash_p, (char *) block_buffer, DFU_BLOCK_SIZE);
-// 					int r;
-// 					for (r = 0; r < control->setup.wLength; r++)
-// 					{
-// 						printf("0x%x ", flash_p[r]);
-// 						if ((r & 31) == 31)
-// 							printf("\n");
-// 					}
-					if (r == 0)
-					{
-						flash_p += control->setup.wLength;
-						DFU_status.bState = dfuDNLOADIDLE;
-					}
-					else
+					if (current_state == dfuDNLOADSYNC)
 					{
-						printf("write flash error %d\n", r);
-						DFU_status.bStatus = errPROG;
-						DFU_status.bState = dfuERROR;
+						uint8_t i = block_head % DFU_BLOCK_BUFFERS;
+						block_address[i] = flash_p;
+						block_length[i] = control->setup.wLength;
+						block_head++;
+						DFU_update_status();
 					}
 				}
 				else
 				{
+					// DFU_task() finishes the queue and flushes the last page
 					current_state = dfuMANIFESTSYNC;
-					DFU_status.bState = dfuMANIFESTWAITRESET;
+					DFU_status.bState = dfuMANIFEST;
+					DFU_update_status();
 				}
 				break;
 			}
@@ -362,11 +774,20 @@ int DFU_complete()
 	return (current_state == dfuMANIFESTWAITRESET);
 }
 
+// don't lose queued blocks or the last page if the host resets early
+static void DFU_finish_and_reset()
+{
+	while (BLOCKS_QUEUED || (DFU_status.bState == dfuMANIFEST))
+		DFU_task();
+	usb_disconnect();
+	NVIC_SystemReset();
+}
+
 void USBEvent_busReset()
 {
 	if (current_state == dfuMANIFESTWAITRESET || current_state == dfuMANIFESTSYNC ||current_state == dfuMANIFEST)
 	{
-		usb_disconnect();
-		NVIC_SystemReset();
+		// we are in the interrupt handler, flashing is done from the main loop
+		usb_defer(DFU_finish_and_reset);
 	}
 }
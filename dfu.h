@@ -34,6 +34,11 @@
 #define DFU_GETSTATE	5
 #define DFU_ABORT		6
 
+// vendor IN request, returns the boot profile_table_t
+#define DFU_VENDOR_PROFILE	0x50
+
+#define DFU_INTERFACE	0
+
 #include "usbcore.h"
 
 typedef struct
@@ -59,5 +64,7 @@ void DFU_init(void);
 void DFU_controlTransfer(CONTROL_TRANSFER *);
 void DFU_transferComplete(CONTROL_TRANSFER *);
 int DFU_complete(void);
+void DFU_task(void);
+int DFU_idle(void);
 
 #endif /* _DFU_H */
@@ -0,0 +1,194 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+/*
+ * Times a DFU download against the real dfu.c, with a host that behaves
+ * like dfu-util: DNLOAD a block, then GETSTATUS and wait bwPollTimeout
+ * until the device says dfuDNLOADIDLE. The flash is iapsim.c's, so the
+ * device is busy for as long as the datasheet says IAP takes, and a
+ * request that arrives while IAP has the CPU waits for it.
+ *
+ * Every control transfer takes a 1ms frame. -f reports a fixed
+ * bwPollTimeout instead, the way dfu.c used to with 500ms.
+ *
+ * Run with:
+ * gcc -std=gnu99 -O2 -no-pie -ICMSISv2p00_LPC17xx/inc -Wl,--defsym,_user_flash_start=0x4000 -Wl,--defsym,_user_flash_size=0x74000 -o dfusim dfusim.c
+ * ./dfusim									400k of random firmware
+ * ./dfusim firmware.bin
+ * ./dfusim -f 500 firmware.bin
+ */
+
+#ifndef __LPC17XX__
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "iapsim.c"
+
+#define NVIC_SystemReset()	exit(0)
+
+#include "crc32.c"
+#include "image.c"
+#include "delta.c"
+#include "dfu.c"
+
+#undef printf
+
+#define FRAME_US	1000
+
+// the rest of the bootloader, as far as dfu.c is concerned
+profile_table_t boot_profile;
+
+void usb_provideDescriptors(void *d) {}
+void usb_ep0_stall() {}
+void usb_disconnect() {}
+int usb_defer(usb_callback_pointer work) { return 0; }
+void setleds(int leds) {}
+
+static uint8_t firmware[USER_FLASH_SIZE];
+
+static uint64_t now;			// us
+static uint64_t device_free;	// when the device is next out of IAP
+static unsigned fixed_timeout;
+static unsigned transfers;
+
+// the main loop, flashing queued blocks up to time t
+static void device_run(uint64_t t)
+{
+	while ((device_free <= t) && !DFU_idle())
+	{
+		uint64_t before = iap_us;
+		DFU_task();
+		device_free += iap_us - before;
+	}
+}
+
+// one control transfer, with the data stage copied in or out
+static void request(uint8_t bRequest, uint16_t value, void *data, uint16_t length)
+{
+	CONTROL_TRANSFER c;
+
+	now += FRAME_US;
+	device_run(now);
+	if (device_free > now)
+		now = device_free;
+
+	memset(&c, 0, sizeof(c));
+	c.setup.bmRequestType = 0x21 | ((bRequest == DFU_GETSTATUS)?0x80:0);
+	c.setup.bRequest = bRequest;
+	c.setup.wValue = value;
+	c.setup.wLength = length;
+	DFU_controlTransfer(&c);
+	if (bRequest == DFU_DNLOAD)
+		memcpy(c.buffer, data, length);
+	else if (c.bufferlen)
+		memcpy(data, c.buffer, c.bufferlen);
+	DFU_transferComplete(&c);
+
+	if (device_free < now)
+		device_free = now;
+	transfers++;
+}
+
+// GETSTATUS until the device is ready for more
+static uint8_t wait_status()
+{
+	DFU_STATUS_t status;
+
+	for (;;)
+	{
+		request(DFU_GETSTATUS, 0, &status, 6);
+		now += (fixed_timeout?fixed_timeout:status.bwPollTimeout) * 1000ULL;
+		if ((status.bState != dfuDNBUSY) && (status.bState != dfuMANIFEST))
+			return status.bState;
+	}
+}
+
+static int download(long length)
+{
+	long i;
+	uint16_t block = 0;
+
+	for (i = 0; i < length; i += DFU_BLOCK_SIZE, block++)
+	{
+		unsigned n = (length - i > DFU_BLOCK_SIZE)?DFU_BLOCK_SIZE:(length - i);
+		request(DFU_DNLOAD, block, &firmware[i], n);
+		if (wait_status() != dfuDNLOADIDLE)
+			return 1;
+	}
+	request(DFU_DNLOAD, block, NULL, 0);
+	if (wait_status() != dfuMANIFESTWAITRESET)
+		return 1;
+	return memcmp(&iap_flash[USER_FLASH_START], firmware, length) != 0;
+}
+
+int main(int argc, char **argv)
+{
+	long length;
+	int i = 1;
+
+	if ((argc > 2) && (strcmp(argv[1], "-f") == 0))
+	{
+		fixed_timeout = atoi(argv[2]);
+		i += 2;
+	}
+
+	if (argc == i + 1)
+	{
+		FILE *f = fopen(argv[i], "rb");
+		if (f == NULL)
+		{
+			perror(argv[i]);
+			return 1;
+		}
+		length = fread(firmware, 1, sizeof(firmware), f);
+		fclose(f);
+	}
+	else if (argc == i)
+	{
+		length = 400 * 1024;
+		srand(1);
+		for (i = 0; i < length; i++)
+			firmware[i] = rand();
+	}
+	else
+	{
+		fprintf(stderr, "usage: %s [-f ms] [firmware.bin]\n", argv[0]);
+		return 1;
+	}
+
+	iap_blank();
+	DFU_init();
+	if (download(length))
+	{
+		fprintf(stderr, "download failed at %lu ms, status %u\n", (unsigned long) (now / 1000), DFU_status.bStatus);
+		return 1;
+	}
+	printf("%ld bytes in %.2f s, %.1f kB/s, %u control transfers, %.2f s of it in IAP\n",
+		length, now / 1e6, length / 1.024 / (now / 1000.0), transfers, iap_us / 1e6);
+	return 0;
+}
+
+#endif /* ifndef __LPC17XX__ */
@@ -115,9 +115,10 @@ DRESULT disk_read (
 	case SDCard :
 		// translate the arguments here
 
-		for (; count; count--, sector += 512)
-			SDCard_disk_read(buff, sector);
-		result = 0;
+		if (count > 1)
+			result = SDCard_disk_read_multi(buff, sector, count);
+		else
+			result = SDCard_disk_read(buff, sector);
 
 		// translate the reslut code here
 		res = result?RES_ERROR:RES_OK;
@@ -166,9 +167,10 @@ DRESULT disk_write (
 	case SDCard :
 		// translate the arguments here
 
-		for (; count; count--, sector += 512)
-			SDCard_disk_write(buff, sector);
-		result = 0;
+		if (count > 1)
+			result = SDCard_disk_write_multi(buff, sector, count);
+		else
+			result = SDCard_disk_write(buff, sector);
 
 		// translate the reslut code here
 		res = result?RES_ERROR:RES_OK;
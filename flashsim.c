@@ -0,0 +1,177 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+/*
+ * Times sbl_iap.c writing a firmware image the way DFU hands it over, 512
+ * bytes at a time, against iapsim.c's model of the IAP ROM, and checks
+ * what ends up in flash.
+ *
+ * The old write_flash() made a PREPARE and a COPY_RAM_TO_FLASH for every
+ * 512 bytes and erased each sector it came to, so its counts are worked
+ * out rather than run. -o sets the cost of an IAP call in us, which the
+ * datasheet doesn't give.
+ *
+ * Given two builds, the first is flashed and the second replayed over
+ * it, to see what skipping unchanged sectors saves.
+ *
+ * Run with:
+ * gcc -std=gnu99 -O2 -no-pie -ICMSISv2p00_LPC17xx/inc -o flashsim flashsim.c && ./flashsim firmware.bin
+ * ./flashsim -o 50 firmware.bin			with 50us per IAP call
+ * ./flashsim old.bin new.bin				new build over the old one
+ */
+
+#ifndef __LPC17XX__
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "iapsim.c"
+
+// the DFU transfer size
+#define BLOCK	512
+
+static uint8_t image[2][USER_FLASH_SIZE];
+
+static long load(const char *name, uint8_t *data)
+{
+	FILE *f = fopen(name, "rb");
+	long length;
+
+	if (f == NULL)
+	{
+		perror(name);
+		exit(1);
+	}
+	length = fread(data, 1, USER_FLASH_SIZE, f);
+	if (!feof(f))
+	{
+		fprintf(stderr, "%s: bigger than user flash\n", name);
+		exit(1);
+	}
+	fclose(f);
+	return length;
+}
+
+static void report(const char *what, unsigned prepares, unsigned copies, unsigned erases, uint64_t us)
+{
+	printf("%-16s %6u %8u %6u %6u %9.1f\n", what, prepares + copies + erases, prepares, copies, erases, us / 1000.0);
+}
+
+static unsigned sectors(long length)
+{
+	return sector_of(USER_FLASH_START + length - 1) + 1 - USER_START_SECTOR;
+}
+
+// what the old write_flash() would have done with the same image
+static void report_old(long length)
+{
+	unsigned blocks = (length + BLOCK - 1) / BLOCK;
+	unsigned n = sectors(length);
+
+	report("512 byte copies", blocks + n, blocks, n,
+		(uint64_t) n * FLASH_ERASE_MS * 1000 + (uint64_t) blocks * (BLOCK / 256) * IAP_PROG_US +
+		(uint64_t) (blocks * 2 + n * 2) * iap_call_us);
+}
+
+// 4k pages, but every sector erased and every page programmed
+static void report_all(long length)
+{
+	unsigned pages = (length + FLASH_BUF_SIZE - 1) / FLASH_BUF_SIZE;
+	unsigned n = sectors(length);
+
+	report("no skipping", pages + n, pages, n,
+		(uint64_t) n * FLASH_ERASE_MS * 1000 + (uint64_t) pages * (FLASH_BUF_SIZE / 256) * IAP_PROG_US +
+		(uint64_t) (pages * 2 + n * 2) * iap_call_us);
+}
+
+// write an image the way DFU does, and check it arrived
+static int flash(const char *name, const uint8_t *data, long length)
+{
+	long i, n;
+	unsigned r = CMD_SUCCESS;
+
+	iap_reset_counts();
+	flash_sectors_written = flash_sectors_skipped = 0;
+
+	for (i = 0; (i < length) && (r == CMD_SUCCESS); i += n)
+	{
+		n = (length - i > BLOCK)?BLOCK:(length - i);
+		r = write_flash((unsigned *) (uintptr_t) (USER_FLASH_START + i), (char *) &data[i], n);
+	}
+	if (r == CMD_SUCCESS)
+		r = flush_flash();
+	if (r != CMD_SUCCESS)
+	{
+		fprintf(stderr, "%s: IAP error %u near 0x%lx\n", name, r, USER_FLASH_START + i);
+		return 1;
+	}
+	if (memcmp(&iap_flash[USER_FLASH_START], data, length))
+	{
+		fprintf(stderr, "%s: flash doesn't match\n", name);
+		return 1;
+	}
+
+	printf("%s: %ld bytes, %u sectors written, %u skipped\n", name, length, flash_sectors_written, flash_sectors_skipped);
+	printf("%-16s %6s %8s %6s %6s %9s\n", "", "calls", "prepare", "copy", "erase", "ms");
+	report("4k pages", iap_prepares, iap_copies, iap_erases, iap_us);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	long length[2];
+	int i = 1;
+
+	if ((argc > 2) && (strcmp(argv[1], "-o") == 0))
+	{
+		iap_call_us = atoi(argv[2]);
+		i += 2;
+	}
+	if ((argc != i + 1) && (argc != i + 2))
+	{
+		fprintf(stderr, "usage: %s [-o us] firmware.bin | [-o us] old.bin new.bin\n", argv[0]);
+		return 1;
+	}
+
+	iap_blank();
+	length[0] = load(argv[i], image[0]);
+	if (flash(argv[i], image[0], length[0]))
+		return 1;
+	if (argc == i + 1)
+	{
+		report_old(length[0]);
+		return 0;
+	}
+
+	length[1] = load(argv[i + 1], image[1]);
+	printf("\n");
+	if (flash(argv[i + 1], image[1], length[1]))
+		return 1;
+	report_all(length[1]);
+	report_old(length[1]);
+	return 0;
+}
+
+#endif /* ifndef __LPC17XX__ */
@@ -0,0 +1,215 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+/*
+ * Host stand-in for the LPC17xx IAP ROM, for tools that want to run the
+ * real sbl_iap.c on Linux. Include this file instead of sbl_iap.c.
+ *
+ * Flash is an array. PREPARE, ERASE, COPY_RAM_TO_FLASH and BLANK_CHECK
+ * check their arguments like the ROM does, copies can only clear bits, and
+ * every call is counted. Time is modelled from the datasheet worst cases:
+ * FLASH_ERASE_MS per sector erased and 1.05ms per 256 bytes programmed,
+ * plus iap_call_us for every call. The datasheet has no figure for the
+ * cost of the call itself, so that is 0 unless a tool sets it.
+ *
+ * IAP is handed RAM addresses as 32 bit numbers, so tools that include
+ * this must be linked with -no-pie to keep their buffers below 4G.
+ */
+
+#ifndef __LPC17XX__
+
+#include <stdint.h>
+#include <string.h>
+
+#include "sbl_config.h"
+
+// the bits of LPC17xx.h that sbl_iap.c uses
+#define __LPC17xx_H__
+#define __disable_irq()		do {} while (0)
+#define __enable_irq()		do {} while (0)
+
+static uint32_t SystemCoreClock = 100000000;
+static struct { uint32_t VTOR; } iap_scb;
+#define SCB					(&iap_scb)
+
+// the ROM's status codes
+#define INVALID_COMMAND			1
+#define SRC_ADDR_ERROR			2
+#define DST_ADDR_ERROR			3
+#define COUNT_ERROR				6
+#define INVALID_SECTOR			7
+#define SECTOR_NOT_BLANK		8
+#define SECTOR_NOT_PREPARED		9
+
+// datasheet worst case for 256 bytes, in us
+#define IAP_PROG_US				1050
+
+static uint8_t iap_flash[SECTOR_END(MAX_USER_SECTOR) + 1] __attribute__ ((aligned(4)));
+
+#define FLASH_MAP(address)	((void *) &iap_flash[(uintptr_t) (address)])
+
+#include "sbl_iap.h"
+
+static uint8_t iap_prepared[MAX_FLASH_SECTOR];
+
+unsigned iap_prepares;
+unsigned iap_copies;
+unsigned iap_erases;			// calls
+unsigned iap_sectors_erased;
+unsigned iap_pages_programmed;	// 256 bytes each
+unsigned iap_call_us;
+uint64_t iap_us;
+
+static int iap_sectors(unsigned start, unsigned end)
+{
+	return (start <= end) && (end < MAX_FLASH_SECTOR);
+}
+
+static unsigned iap_sector_of(unsigned address)
+{
+	unsigned i;
+
+	for (i = 0; i < MAX_FLASH_SECTOR - 1; i++)
+	{
+		if (address <= SECTOR_END(i))
+			return i;
+	}
+	return MAX_FLASH_SECTOR - 1;
+}
+
+static void iap_sim(unsigned param[], unsigned result[])
+{
+	unsigned i, sector;
+	uint8_t *src;
+
+	iap_us += iap_call_us;
+
+	switch (param[0])
+	{
+		case PREPARE_SECTOR_FOR_WRITE:
+			iap_prepares++;
+			if (!iap_sectors(param[1], param[2]))
+			{
+				result[0] = INVALID_SECTOR;
+				return;
+			}
+			for (i = param[1]; i <= param[2]; i++)
+				iap_prepared[i] = 1;
+			break;
+		case ERASE_SECTOR:
+			iap_erases++;
+			if (!iap_sectors(param[1], param[2]))
+			{
+				result[0] = INVALID_SECTOR;
+				return;
+			}
+			for (i = param[1]; i <= param[2]; i++)
+			{
+				if (!iap_prepared[i])
+				{
+					result[0] = SECTOR_NOT_PREPARED;
+					return;
+				}
+			}
+			for (i = param[1]; i <= param[2]; i++)
+			{
+				memset(&iap_flash[SECTOR_START(i)], 0xFF, SECTOR_END(i) + 1 - SECTOR_START(i));
+				iap_prepared[i] = 0;
+				iap_sectors_erased++;
+				iap_us += FLASH_ERASE_MS * 1000;
+			}
+			break;
+		case COPY_RAM_TO_FLASH:
+			iap_copies++;
+			if ((param[1] & 0xFF) || (param[1] + param[3] > sizeof(iap_flash)))
+			{
+				result[0] = DST_ADDR_ERROR;
+				return;
+			}
+			if (param[2] & 3)
+			{
+				result[0] = SRC_ADDR_ERROR;
+				return;
+			}
+			if ((param[3] != 256) && (param[3] != 512) && (param[3] != 1024) && (param[3] != 4096))
+			{
+				result[0] = COUNT_ERROR;
+				return;
+			}
+			sector = iap_sector_of(param[1]);
+			if (!iap_prepared[sector])
+			{
+				result[0] = SECTOR_NOT_PREPARED;
+				return;
+			}
+			iap_prepared[sector] = 0;
+			src = (uint8_t *) (uintptr_t) param[2];
+			for (i = 0; i < param[3]; i++)
+				iap_flash[param[1] + i] &= src[i];
+			iap_pages_programmed += param[3] / 256;
+			iap_us += (param[3] / 256) * IAP_PROG_US;
+			break;
+		case BLANK_CHECK_SECTOR:
+			if (!iap_sectors(param[1], param[2]))
+			{
+				result[0] = INVALID_SECTOR;
+				return;
+			}
+			for (i = SECTOR_START(param[1]); i <= SECTOR_END(param[2]); i++)
+			{
+				if (iap_flash[i] != 0xFF)
+				{
+					result[0] = SECTOR_NOT_BLANK;
+					return;
+				}
+			}
+			break;
+		default:
+			result[0] = INVALID_COMMAND;
+			return;
+	}
+	result[0] = CMD_SUCCESS;
+}
+
+// flash as it comes from the factory
+static void iap_blank()
+{
+	memset(iap_flash, 0xFF, sizeof(iap_flash));
+}
+
+// not every tool that includes this counts in phases
+static void __attribute__ ((unused)) iap_reset_counts()
+{
+	iap_prepares = iap_copies = iap_erases = 0;
+	iap_sectors_erased = iap_pages_programmed = 0;
+	iap_us = 0;
+}
+
+#undef IAP_ADDRESS
+#define IAP_ADDRESS			((uintptr_t) iap_sim)
+
+#include "sbl_iap.c"
+
+#endif /* ifndef __LPC17XX__ */
@@ -0,0 +1,328 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+#include "image.h"
+#ifdef IMAGE
+#include "delta.h"
+
+#include <string.h>
+#endif
+
+#include "crc32.h"
+
+#include "sbl_iap.h"
+#include "sbl_config.h"
+
+static unsigned error;
+static uint32_t address;		// where the next byte goes in flash
+
+#ifdef IMAGE
+
+enum
+{
+	IMAGE_S_HEADER,
+	IMAGE_S_RAW,
+	IMAGE_S_TOKEN,
+	IMAGE_S_LITERAL_LENGTH,
+	IMAGE_S_LITERALS,
+	IMAGE_S_OFFSET_LOW,
+	IMAGE_S_OFFSET_HIGH,
+	IMAGE_S_MATCH_LENGTH,
+	IMAGE_S_DONE,
+};
+
+static IMAGE_header header;
+static IMAGE_delta delta;		// straight after the header, for a patch
+static uint8_t header_fill;
+static uint8_t state;
+
+// the last IMAGE_WINDOW bytes unpacked, for matches to copy from
+static uint8_t window[IMAGE_WINDOW] __attribute__ ((aligned(4)));
+static uint32_t out;			// bytes unpacked so far
+static uint32_t flushed;		// bytes of those passed on to the flash
+static uint32_t taken;			// packed bytes they came from, roughly
+static uint32_t crc;			// of the flushed bytes
+
+static uint32_t literals;
+static uint32_t match_length;
+static uint32_t offset;
+
+#endif /* IMAGE */
+
+void IMAGE_start()
+{
+	// whatever an abandoned download left staged isn't part of this one
+	flash_discard();
+	error = CMD_SUCCESS;
+	address = USER_FLASH_START;
+#ifdef IMAGE
+	header_fill = 0;
+	state = IMAGE_S_HEADER;
+	out = flushed = taken = 0;
+	crc = 0;
+#endif
+}
+
+static unsigned IMAGE_flash(const uint8_t *data, uint32_t length)
+{
+	unsigned r;
+
+	if (length == 0)
+		return CMD_SUCCESS;
+	if (address + length > USER_FLASH_END + 1)
+		return IMAGE_ERR_ADDRESS;
+	r = write_flash((unsigned *) (uintptr_t) address, (char *) data, length);
+	address += length;
+	return r;
+}
+
+#ifdef IMAGE
+
+// everything unpacked since the last flush. That's never more than
+// IMAGE_CHUNK bytes, and never wraps round the window
+static unsigned IMAGE_flush()
+{
+	const uint8_t *p = &window[flushed & (IMAGE_WINDOW - 1)];
+	uint32_t n = out - flushed;
+
+	crc = crc32(crc, p, n);
+	flushed = out;
+	if (header.type == IMAGE_TYPE_DELTA)
+		return DELTA_write(p, n);
+	return IMAGE_flash(p, n);
+}
+
+static unsigned IMAGE_put(uint8_t c)
+{
+	window[out & (IMAGE_WINDOW - 1)] = c;
+	out++;
+	if ((out & (IMAGE_CHUNK - 1)) == 0)
+		return IMAGE_flush();
+	return CMD_SUCCESS;
+}
+
+// the header is complete, check we can unpack what follows
+static unsigned IMAGE_begin()
+{
+	unsigned r;
+
+	if (((header.type != IMAGE_TYPE_LZ4) && (header.type != IMAGE_TYPE_DELTA)) || (header.window_bits > IMAGE_WINDOW_BITS))
+		return IMAGE_ERR_FORMAT;
+	if (header.type == IMAGE_TYPE_DELTA)
+	{
+		if ((r = DELTA_start(&delta)) != CMD_SUCCESS)
+			return r;
+	}
+	else if (header.length > USER_FLASH_SIZE)
+		return IMAGE_ERR_ADDRESS;
+	state = header.length?IMAGE_S_TOKEN:IMAGE_S_DONE;
+	return CMD_SUCCESS;
+}
+
+// one LZ4 sequence is a token byte (literal count and match length, 4
+// bits each, 15 meaning more length bytes follow), the literals, a 16 bit
+// offset and the match. The last sequence stops after its literals
+static unsigned IMAGE_unpack(const uint8_t *data, uint32_t length)
+{
+	unsigned r;
+
+	while (length)
+	{
+		uint8_t c = *data++;
+		length--;
+
+		switch (state)
+		{
+			case IMAGE_S_TOKEN:
+				literals = c >> 4;
+				match_length = c & 15;
+				if (literals == 15)
+					state = IMAGE_S_LITERAL_LENGTH;
+				else if (literals)
+					state = IMAGE_S_LITERALS;
+				else
+					state = IMAGE_S_OFFSET_LOW;
+				break;
+			case IMAGE_S_LITERAL_LENGTH:
+				literals += c;
+				if (c != 255)
+					state = IMAGE_S_LITERALS;
+				break;
+			case IMAGE_S_LITERALS:
+				if (out + literals > header.length)
+					return IMAGE_ERR_FORMAT;
+				// this byte, and as many more as we have
+				data--;
+				length++;
+				while (literals && length)
+				{
+					if ((r = IMAGE_put(*data++)) != CMD_SUCCESS)
+						return r;
+					literals--;
+					length--;
+				}
+				if (literals == 0)
+					state = (out == header.length)?IMAGE_S_DONE:IMAGE_S_OFFSET_LOW;
+				break;
+			case IMAGE_S_OFFSET_LOW:
+				offset = c;
+				state = IMAGE_S_OFFSET_HIGH;
+				break;
+			case IMAGE_S_OFFSET_HIGH:
+				offset |= c << 8;
+				if ((offset == 0) || (offset > out) || (offset > (1UL << header.window_bits)))
+					return IMAGE_ERR_FORMAT;
+				if (match_length == 15)
+				{
+					state = IMAGE_S_MATCH_LENGTH;
+					break;
+				}
+				// fall through
+			case IMAGE_S_MATCH_LENGTH:
+				if (state == IMAGE_S_MATCH_LENGTH)
+				{
+					match_length += c;
+					if (c == 255)
+						break;
+				}
+				match_length += 4;
+				if (out + match_length > header.length)
+					return IMAGE_ERR_FORMAT;
+				// a match can overlap what it's producing
+				while (match_length--)
+				{
+					if ((r = IMAGE_put(window[(out - offset) & (IMAGE_WINDOW - 1)])) != CMD_SUCCESS)
+						return r;
+				}
+				state = (out == header.length)?IMAGE_S_DONE:IMAGE_S_TOKEN;
+				break;
+			case IMAGE_S_DONE:
+				// anything after the image, like a DFU suffix, is ignored
+				return CMD_SUCCESS;
+		}
+	}
+	return CMD_SUCCESS;
+}
+
+#endif /* IMAGE */
+
+// the next length bytes of the image, as received. Returns CMD_SUCCESS, an
+// IAP status or an IMAGE_ERR_, and once it fails, fails from then on
+unsigned IMAGE_write(const uint8_t *data, uint32_t length)
+{
+	if (error != CMD_SUCCESS)
+		return error;
+
+#ifdef IMAGE
+	// the magic decides what we have, until then the header is held back
+	while ((state == IMAGE_S_HEADER) && length)
+	{
+		if (header_fill < sizeof(header))
+			((uint8_t *) &header)[header_fill] = *data;
+		else
+			((uint8_t *) &delta)[header_fill - sizeof(header)] = *data;
+		header_fill++;
+		data++;
+		length--;
+
+		if ((header_fill == sizeof(header.magic)) && (header.magic != IMAGE_MAGIC))
+		{
+			state = IMAGE_S_RAW;
+			if ((error = IMAGE_flash((uint8_t *) &header, header_fill)) != CMD_SUCCESS)
+				return error;
+		}
+		else if (((header_fill == sizeof(header)) && (header.type != IMAGE_TYPE_DELTA)) || (header_fill == sizeof(header) + sizeof(delta)))
+		{
+			if ((error = IMAGE_begin()) != CMD_SUCCESS)
+				return error;
+		}
+	}
+
+	if (state != IMAGE_S_RAW)
+	{
+		taken += length;
+		error = IMAGE_unpack(data, length);
+		return error;
+	}
+#endif
+
+	error = IMAGE_flash(data, length);
+	return error;
+}
+
+// the image is all here: program the rest of it, and check it
+unsigned IMAGE_finish()
+{
+	if (error != CMD_SUCCESS)
+		return error;
+
+#ifdef IMAGE
+	// past the magic, it's a header that got cut short
+	if (state == IMAGE_S_HEADER)
+		error = (header_fill < sizeof(header.magic))?IMAGE_flash((uint8_t *) &header, header_fill):IMAGE_ERR_LENGTH;
+	else if (state != IMAGE_S_RAW)
+	{
+		if ((error = IMAGE_flush()) != CMD_SUCCESS)
+			return error;
+		if (state != IMAGE_S_DONE)
+			error = IMAGE_ERR_LENGTH;
+		else if (crc != header.crc)
+			error = IMAGE_ERR_CRC;
+		else if (header.type == IMAGE_TYPE_DELTA)
+			error = DELTA_finish();
+	}
+	if (error != CMD_SUCCESS)
+		return error;
+#endif
+
+	error = flush_flash();
+	return error;
+}
+
+// milliseconds of flash work IMAGE_write(data, length) may do, for data
+// meant for address at in a plain image
+unsigned IMAGE_cost(uint32_t at, const uint8_t *data, uint32_t length)
+{
+#ifdef IMAGE
+	// can't know how much it unpacks to without unpacking it, so go by how
+	// it's unpacked so far, and count the erase of every sector the output
+	// gets to
+	uint32_t expansion = (taken && (out / taken > IMAGE_EXPANSION))?(out / taken):IMAGE_EXPANSION;
+	uint32_t n = (out - flushed) + length * expansion;
+	uint32_t magic = IMAGE_MAGIC;
+
+	if ((state == IMAGE_S_HEADER) && (header_fill == 0) && (length >= sizeof(magic)) && (memcmp(data, &magic, sizeof(magic)) == 0))
+		return write_flash_cost((unsigned *) (uintptr_t) address, 0, n);
+	if ((state != IMAGE_S_HEADER) && (state != IMAGE_S_RAW))
+	{
+		if (header.type == IMAGE_TYPE_DELTA)
+			return DELTA_cost(n);
+		if (n > header.length - flushed)
+			n = header.length - flushed;
+		return write_flash_cost((unsigned *) (uintptr_t) address, 0, n);
+	}
+#endif
+	return write_flash_cost((unsigned *) (uintptr_t) at, (char *) data, length);
+}
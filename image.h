@@ -0,0 +1,98 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+#ifndef _IMAGE_H
+#define _IMAGE_H
+
+#include <stdint.h>
+
+/*
+ * Firmware images as the DFU and SD card update paths receive them. A
+ * plain .bin is flashed as it arrives. One that starts with an
+ * IMAGE_header is unpacked on the way to the flash instead, so fewer
+ * bytes have to cross USB or come off the card.
+ *
+ * Packed images are LZ4 block format (one block, no frame) with matches
+ * reaching back at most IMAGE_WINDOW bytes, which is all the RAM the
+ * unpacker needs. imagepack.c makes them on the host.
+ *
+ * A patch (IMAGE_TYPE_DELTA) is followed by an IMAGE_delta, and its LZ4
+ * data unpacks to a patch stream for delta.c instead of an image.
+ *
+ * A plain image starts with its initial stack pointer, which can never
+ * read as IMAGE_MAGIC.
+ *
+ * Unpacking needs IMAGE in CDEFS. Without it every image is written as
+ * it arrives, so a packed one is flashed as garbage, the way it always
+ * was.
+ */
+
+#define IMAGE_MAGIC			0x474D4953	// "SIMG"
+
+#define IMAGE_TYPE_LZ4		1
+#define IMAGE_TYPE_DELTA	2
+
+#define IMAGE_WINDOW_BITS	11
+#define IMAGE_WINDOW		(1 << IMAGE_WINDOW_BITS)
+// unpacked data goes to the flash in pieces this size
+#define IMAGE_CHUNK			512
+// typical unpacked size over packed size, to guess at flash time until
+// some has been unpacked
+#define IMAGE_EXPANSION		3
+
+// errors, apart from the IAP status codes
+#define IMAGE_ERR_FORMAT	0x100		// not a stream we can unpack
+#define IMAGE_ERR_ADDRESS	0x101		// bigger than user flash
+#define IMAGE_ERR_LENGTH	0x102		// ended early
+#define IMAGE_ERR_CRC		0x103		// unpacked to the wrong thing
+#define IMAGE_ERR_SOURCE	0x104		// patch is for some other firmware
+
+typedef struct
+__attribute__ ((packed))
+{
+	uint32_t	magic;			// IMAGE_MAGIC
+	uint8_t		type;			// IMAGE_TYPE_
+	uint8_t		window_bits;	// matches reach back at most 1 << window_bits bytes
+	uint16_t	reserved;
+	uint32_t	length;			// bytes of image (or patch stream) it unpacks to
+	uint32_t	crc;			// crc32 of those bytes
+} IMAGE_header;
+
+typedef struct
+__attribute__ ((packed))
+{
+	uint32_t	old_length;		// bytes of the firmware in flash the patch applies to
+	uint32_t	old_crc;		// crc32 of them
+	uint32_t	new_length;		// bytes of firmware the patch makes
+	uint32_t	new_crc;		// crc32 of them
+	uint32_t	scratch;		// bit n set: sector n is rebuilt in FLASH_SCRATCH_SECTOR first
+} IMAGE_delta;
+
+void     IMAGE_start(void);
+unsigned IMAGE_write(const uint8_t *data, uint32_t length);
+unsigned IMAGE_finish(void);
+unsigned IMAGE_cost(uint32_t at, const uint8_t *data, uint32_t length);
+
+#endif /* _IMAGE_H */
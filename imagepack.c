@@ -0,0 +1,703 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+/*
+ * Host side of packed firmware images and patches, see image.h and
+ * delta.h for the formats.
+ *
+ * Unpacking runs the bootloader's own image.c, delta.c and sbl_iap.c
+ * against iapsim.c's flash, so -d and -b check exactly what DFU or the SD
+ * card would leave in flash.
+ *
+ * Run with:
+ * gcc -std=gnu99 -O2 -no-pie -ICMSISv2p00_LPC17xx/inc -o imagepack imagepack.c && ./imagepack firmware.bin firmware.img
+ * ./imagepack -p old.bin new.bin patch.img				patch from old to new
+ * ./imagepack -d firmware.img firmware.bin [old.bin]	unpack, or apply to old
+ * ./imagepack -b firmware.bin							pack, unpack and time it
+ * ./imagepack -b old.bin new.bin						patch, apply and time it
+ */
+
+#ifndef __LPC17XX__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+// sbl_iap.c itself, on a simulated flash. A patch that reads old
+// firmware after its sector was erased gets 0xFF, and fails its crc
+#include "iapsim.c"
+
+#define IMAGE
+
+#include "crc32.c"
+#include "image.c"
+#include "delta.c"
+
+#define MIN_MATCH		4
+#define MAX_CHAIN		256
+#define HASH_BITS		14
+
+// LZ4 wants the last 5 bytes as literals, and no match starting in the last 12
+#define LAST_LITERALS	5
+#define MATCH_LIMIT		12
+
+static uint32_t hash(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static uint8_t *put_length(uint8_t *o, uint32_t n)
+{
+	while (n >= 255)
+	{
+		*o++ = 255;
+		n -= 255;
+	}
+	*o++ = n;
+	return o;
+}
+
+static uint8_t *put_sequence(uint8_t *o, const uint8_t *literals, uint32_t nliterals, uint32_t offset, uint32_t match)
+{
+	uint8_t *token = o++;
+	*token = ((nliterals < 15)?nliterals:15) << 4;
+	if (nliterals >= 15)
+		o = put_length(o, nliterals - 15);
+	memcpy(o, literals, nliterals);
+	o += nliterals;
+
+	if (match == 0)
+		return o;
+
+	*o++ = offset & 0xFF;
+	*o++ = offset >> 8;
+	match -= MIN_MATCH;
+	*token |= (match < 15)?match:15;
+	if (match >= 15)
+		o = put_length(o, match - 15);
+	return o;
+}
+
+// greedy LZ4 with hash chains, matches no further back than the window
+static uint32_t lz4(const uint8_t *in, uint32_t length, uint8_t *out)
+{
+	static int32_t head[1 << HASH_BITS];
+	int32_t *chain = malloc(length * sizeof(*chain));
+	uint8_t *o = out;
+	uint32_t anchor = 0, i = 0;
+
+	memset(head, 0xFF, sizeof(head));
+
+	while ((length >= MATCH_LIMIT) && (i + MATCH_LIMIT <= length))
+	{
+		uint32_t limit = length - LAST_LITERALS;
+		uint32_t best = 0, best_offset = 0;
+		uint32_t h4 = hash(&in[i]);
+		int32_t c = head[h4];
+		int n = MAX_CHAIN;
+
+		while ((c >= 0) && (i - c <= IMAGE_WINDOW) && n--)
+		{
+			uint32_t l = 0;
+			while ((i + l < limit) && (in[c + l] == in[i + l]))
+				l++;
+			if (l > best)
+			{
+				best = l;
+				best_offset = i - c;
+			}
+			c = chain[c];
+		}
+		chain[i] = head[h4];
+		head[h4] = i;
+
+		if (best < MIN_MATCH)
+		{
+			i++;
+			continue;
+		}
+
+		o = put_sequence(o, &in[anchor], i - anchor, best_offset, best);
+
+		// the matched bytes still go in the chains for later matches
+		uint32_t end = i + best;
+		for (i++; i < end; i++)
+		{
+			if (i + 4 <= length)
+			{
+				h4 = hash(&in[i]);
+				chain[i] = head[h4];
+				head[h4] = i;
+			}
+		}
+		anchor = i;
+	}
+
+	o = put_sequence(o, &in[anchor], length - anchor, 0, 0);
+	free(chain);
+	return o - out;
+}
+
+static uint32_t pack(const uint8_t *in, uint32_t length, uint8_t *out)
+{
+	IMAGE_header h;
+
+	h.magic = IMAGE_MAGIC;
+	h.type = IMAGE_TYPE_LZ4;
+	h.window_bits = IMAGE_WINDOW_BITS;
+	h.reserved = 0;
+	h.length = length;
+	h.crc = crc32(0, in, length);
+	memcpy(out, &h, sizeof(h));
+	return sizeof(h) + lz4(in, length, out + sizeof(h));
+}
+
+#define DIFF_MIN		8
+#define DIFF_CHAIN		64
+#define DIFF_HASH_BITS	16
+
+static const uint8_t *old_fw;
+static const uint8_t *new_fw;
+static uint32_t old_size;
+static uint32_t new_size;
+
+static int32_t diff_head[1 << DIFF_HASH_BITS];
+static int32_t *diff_chain;
+
+// old firmware below the sector being rebuilt is gone by the time a patch
+// could read it. These are offsets into the firmware, not addresses
+static uint32_t lowest(uint32_t n)
+{
+	return SECTOR_START(sector_of(USER_FLASH_START + n)) - USER_FLASH_START;
+}
+
+static uint32_t next_sector(uint32_t n)
+{
+	return SECTOR_END(sector_of(USER_FLASH_START + n)) + 1 - USER_FLASH_START;
+}
+
+// whether new byte n may be made from old byte o
+static int usable(int64_t n, int64_t o)
+{
+	return (o >= 0) && (o < old_size) && (o >= lowest(n));
+}
+
+static uint32_t hash8(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return (v * 0x9E3779B97F4A7C15ULL) >> (64 - DIFF_HASH_BITS);
+}
+
+// chains run from the end of the old firmware backwards
+static void diff_index()
+{
+	uint32_t i;
+
+	diff_chain = malloc((old_size + 1) * sizeof(*diff_chain));
+	memset(diff_head, 0xFF, sizeof(diff_head));
+	for (i = 0; i + DIFF_MIN <= old_size; i++)
+	{
+		uint32_t h = hash8(&old_fw[i]);
+		diff_chain[i] = diff_head[h];
+		diff_head[h] = i;
+	}
+}
+
+// longest run of old firmware that new firmware from n matches exactly
+static uint32_t search(uint32_t n, uint32_t *pos)
+{
+	uint32_t best = 0, floor = lowest(n), end = next_sector(n);
+	int chain = DIFF_CHAIN;
+	int32_t c;
+
+	if (n + DIFF_MIN > new_size)
+		return 0;
+
+	for (c = diff_head[hash8(&new_fw[n])]; (c >= 0) && ((uint32_t) c >= floor) && chain--; c = diff_chain[c])
+	{
+		uint32_t max = new_size - n, l = 0;
+		if (old_size - c < max)
+			max = old_size - c;
+		// behind the new firmware, it can't follow it into the next sector
+		if (((uint32_t) c < n) && (end - n < max))
+			max = end - n;
+		while ((l < max) && (old_fw[c + l] == new_fw[n + l]))
+			l++;
+		if (l > best)
+		{
+			best = l;
+			*pos = c;
+		}
+	}
+	return best;
+}
+
+static uint8_t *put_varint(uint8_t *o, uint32_t v)
+{
+	while (v >= 0x80)
+	{
+		*o++ = v | 0x80;
+		v >>= 7;
+	}
+	*o++ = v;
+	return o;
+}
+
+// bsdiff's approach: exact matches, grown forwards and backwards into
+// approximate ones while at least half their bytes agree. The differences
+// go in the diff bytes, which are mostly zero and pack well. last_read
+// gets, for each sector, the end of the new firmware in it that reads its
+// own old firmware
+static uint32_t diff(uint8_t *out, uint32_t *last_read)
+{
+	uint8_t *o = out;
+	uint32_t scan = 0, len = 0, pos = 0;
+	uint32_t lastscan = 0, lastpos = 0;
+	int64_t lastoffset = 0;
+	int64_t i;
+
+	diff_index();
+
+	while (scan < new_size)
+	{
+		int64_t oldscore = 0;
+		uint32_t scsc;
+
+		for (scsc = scan += len; scan < new_size; scan++)
+		{
+			len = search(scan, &pos);
+			for (; scsc < scan + len; scsc++)
+			{
+				if (usable(scsc, scsc + lastoffset) && (old_fw[scsc + lastoffset] == new_fw[scsc]))
+					oldscore++;
+			}
+			if (((len == oldscore) && (len != 0)) || (len > oldscore + 8))
+				break;
+			if (usable(scan, scan + lastoffset) && (old_fw[scan + lastoffset] == new_fw[scan]))
+				oldscore--;
+		}
+
+		if ((len == oldscore) && (scan != new_size))
+			continue;
+
+		int64_t s = 0, best = 0, lenf = 0, lenb = 0;
+		for (i = 0; (lastscan + i < scan) && usable(lastscan + i, lastpos + i);)
+		{
+			if (old_fw[lastpos + i] == new_fw[lastscan + i])
+				s++;
+			i++;
+			if (s * 2 - i > best * 2 - lenf)
+			{
+				best = s;
+				lenf = i;
+			}
+		}
+
+		if (scan < new_size)
+		{
+			s = best = 0;
+			for (i = 1; (scan >= lastscan + i) && (pos >= i) && usable(scan - i, pos - i); i++)
+			{
+				if (old_fw[pos - i] == new_fw[scan - i])
+					s++;
+				if (s * 2 - i > best * 2 - lenb)
+				{
+					best = s;
+					lenb = i;
+				}
+			}
+		}
+
+		// split where they overlap so each side keeps what it matches best
+		if (lastscan + lenf > scan - lenb)
+		{
+			int64_t overlap = (lastscan + lenf) - (scan - lenb), lens = 0;
+			s = best = 0;
+			for (i = 0; i < overlap; i++)
+			{
+				if (new_fw[lastscan + lenf - overlap + i] == old_fw[lastpos + lenf - overlap + i])
+					s++;
+				if (new_fw[scan - lenb + i] == old_fw[pos - lenb + i])
+					s--;
+				if (s > best)
+				{
+					best = s;
+					lens = i + 1;
+				}
+			}
+			lenf += lens - overlap;
+			lenb -= lens;
+		}
+
+		uint32_t extra = (scan - lenb) - (lastscan + lenf);
+		int32_t seek = (int64_t) (pos - lenb) - (lastpos + lenf);
+
+		o = put_varint(o, lenf);
+		o = put_varint(o, extra);
+		o = put_varint(o, ((uint32_t) seek << 1) ^ (seek >> 31));
+		for (i = 0; i < lenf; i++)
+		{
+			uint32_t n = lastscan + i, k = sector_of(USER_FLASH_START + n);
+			*o++ = new_fw[n] - old_fw[lastpos + i];
+			if (sector_of(USER_FLASH_START + lastpos + i) == k)
+				last_read[k] = n + 1;
+		}
+		memcpy(o, &new_fw[lastscan + lenf], extra);
+		o += extra;
+
+		lastscan = scan - lenb;
+		lastpos = pos - lenb;
+		lastoffset = (int64_t) pos - scan;
+	}
+
+	free(diff_chain);
+	return o - out;
+}
+
+// whether sbl_iap.c would skip this page of new firmware, because the old
+// firmware already has it. Flash past the old firmware could hold anything
+static int page_unchanged(uint32_t n)
+{
+	uint32_t i;
+
+	for (i = n; i < n + FLASH_BUF_SIZE; i++)
+	{
+		if ((i >= old_size) || (old_fw[i] != ((i < new_size)?new_fw[i]:0xFF)))
+			return 0;
+	}
+	return 1;
+}
+
+// the sectors that read their own old firmware after their first changed
+// page, which is when sbl_iap.c erases them
+static uint32_t scratch_sectors(const uint32_t *last_read)
+{
+	uint32_t scratch = 0, n;
+	unsigned k;
+
+	for (k = USER_START_SECTOR; k < MAX_USER_SECTOR; k++)
+	{
+		uint32_t start = SECTOR_START(k) - USER_FLASH_START;
+		uint32_t end = SECTOR_END(k) + 1 - USER_FLASH_START;
+
+		if ((last_read[k] == 0) || (start >= new_size))
+			continue;
+		for (n = start; (n < end) && (n < new_size) && page_unchanged(n); n += FLASH_BUF_SIZE)
+			;
+		if ((n < end) && (n < new_size) && (last_read[k] > n + FLASH_BUF_SIZE))
+			scratch |= 1UL << k;
+	}
+	return scratch;
+}
+
+// a patch that turns old firmware into new, packed like an image
+static uint32_t make_patch(const uint8_t *old, uint32_t old_length, const uint8_t *new, uint32_t new_length, uint8_t *out)
+{
+	uint32_t last_read[MAX_USER_SECTOR + 1] = { 0 };
+	uint8_t *stream = malloc(new_length * 2 + 64);
+	IMAGE_header h;
+	IMAGE_delta d;
+	uint32_t n;
+
+	old_fw = old;
+	old_size = old_length;
+	new_fw = new;
+	new_size = new_length;
+	n = diff(stream, last_read);
+
+	d.old_length = old_length;
+	d.old_crc = crc32(0, old, old_length);
+	d.new_length = new_length;
+	d.new_crc = crc32(0, new, new_length);
+	d.scratch = scratch_sectors(last_read);
+
+
+	h.magic = IMAGE_MAGIC;
+	h.type = IMAGE_TYPE_DELTA;
+	h.window_bits = IMAGE_WINDOW_BITS;
+	h.reserved = 0;
+	h.length = n;
+	h.crc = crc32(0, stream, n);
+	memcpy(out, &h, sizeof(h));
+	memcpy(out + sizeof(h), &d, sizeof(d));
+	n = sizeof(h) + sizeof(d) + lz4(stream, n, out + sizeof(h) + sizeof(d));
+
+	free(stream);
+	return n;
+}
+
+// feed an image or patch to image.c in pieces of chunk bytes, with old
+// firmware in flash to start with
+static unsigned unpack(const uint8_t *in, uint32_t length, uint32_t chunk, const uint8_t *old, uint32_t old_length)
+{
+	uint32_t i;
+	unsigned r;
+
+	iap_blank();
+	memcpy(&iap_flash[USER_FLASH_START], old, old_length);
+	iap_reset_counts();
+	flash_discard();
+
+	IMAGE_start();
+	for (i = 0; i < length; i += chunk)
+	{
+		if ((r = IMAGE_write(&in[i], (length - i < chunk)?(length - i):chunk)) != CMD_SUCCESS)
+			return r;
+	}
+	return IMAGE_finish();
+}
+
+// bytes of firmware an image or patch makes
+static uint32_t unpacked_length(const uint8_t *in, uint32_t length)
+{
+	IMAGE_header h;
+	IMAGE_delta d;
+
+	if (length < sizeof(h))
+		return length;
+	memcpy(&h, in, sizeof(h));
+	if (h.magic != IMAGE_MAGIC)
+		return length;
+	if ((h.type == IMAGE_TYPE_DELTA) && (length >= sizeof(h) + sizeof(d)))
+	{
+		memcpy(&d, in + sizeof(h), sizeof(d));
+		return d.new_length;
+	}
+	return h.length;
+}
+
+static uint8_t *load(const char *name, uint32_t *length)
+{
+	FILE *f = fopen(name, "rb");
+	uint8_t *data;
+
+	if (f == NULL)
+	{
+		perror(name);
+		exit(1);
+	}
+	fseek(f, 0, SEEK_END);
+	*length = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	data = malloc(*length + 1);
+	if (fread(data, 1, *length, f) != *length)
+	{
+		perror(name);
+		exit(1);
+	}
+	fclose(f);
+	if (*length > USER_FLASH_SIZE)
+	{
+		fprintf(stderr, "%s: %u bytes won't fit in %u of user flash\n", name, *length, USER_FLASH_SIZE);
+		exit(1);
+	}
+	return data;
+}
+
+static void save(const char *name, const uint8_t *data, uint32_t length)
+{
+	FILE *f = fopen(name, "wb");
+
+	if ((f == NULL) || (fwrite(data, 1, length, f) != length))
+	{
+		perror(name);
+		exit(1);
+	}
+	fclose(f);
+}
+
+static double now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// unpack in pieces of each size, checking flash ends up holding new
+static int check(const uint8_t *packed, uint32_t n, const uint8_t *old, uint32_t old_length, const uint8_t *new, uint32_t length)
+{
+	static const uint32_t chunks[] = { 1, 512, 4096 };
+	uint32_t i;
+	unsigned r;
+	double t;
+
+	for (i = 0; i < sizeof(chunks) / sizeof(*chunks); i++)
+	{
+		int runs = 0;
+		t = now();
+		do
+		{
+			r = unpack(packed, n, chunks[i], old, old_length);
+			runs++;
+		} while ((r == CMD_SUCCESS) && (now() - t < 0.2));
+		t = (now() - t) / runs;
+
+		if (r != CMD_SUCCESS)
+		{
+			printf("%u byte pieces: unpack failed, 0x%x\n", chunks[i], r);
+			return 1;
+		}
+		if (memcmp(&iap_flash[USER_FLASH_START], new, length))
+		{
+			printf("%u byte pieces: unpacked image differs\n", chunks[i]);
+			return 1;
+		}
+		printf("%u byte pieces: bit exact, unpacked in %.2fms (%.0f MB/s), %u erases, %u pages programmed\n", chunks[i], t * 1e3, length / t / 1e6, iap_sectors_erased, iap_copies);
+	}
+	return 0;
+}
+
+static int benchmark(const uint8_t *in, uint32_t length)
+{
+	uint8_t *packed = malloc(length + length / 255 + 64);
+	uint32_t n;
+	double t;
+
+	t = now();
+	n = pack(in, length, packed);
+	t = now() - t;
+	printf("%u -> %u bytes (%u%%), packed in %.1fms\n", length, n, (unsigned) (n * 100ULL / (length?length:1)), t * 1e3);
+
+	if (check(packed, n, NULL, 0, in, length))
+		return 1;
+
+	// a plain image has to go through untouched too
+	if ((unpack(in, length, 512, NULL, 0) != CMD_SUCCESS) || memcmp(&iap_flash[USER_FLASH_START], in, length))
+	{
+		printf("plain image: differs\n");
+		return 1;
+	}
+	printf("plain image: bit exact\n");
+
+	free(packed);
+	return 0;
+}
+
+static int benchmark_patch(const uint8_t *old, uint32_t old_length, const uint8_t *new, uint32_t length)
+{
+	uint8_t *packed = malloc(length * 2 + 128);
+	IMAGE_delta d;
+	uint32_t n;
+	unsigned r;
+	double t;
+
+	n = pack(new, length, packed);
+	printf("%u byte image packs to %u bytes\n", length, n);
+
+	t = now();
+	n = make_patch(old, old_length, new, length, packed);
+	t = now() - t;
+	memcpy(&d, packed + sizeof(IMAGE_header), sizeof(d));
+	printf("patch from %u bytes is %u bytes, made in %.1fms, scratch sectors %08x\n", old_length, n, t * 1e3, d.scratch);
+
+	if (check(packed, n, old, old_length, new, length))
+		return 1;
+
+	// anything but the old firmware in flash has to be turned away untouched
+	if ((old_length == 0) || (d.old_crc == d.new_crc))
+		;
+	else if ((r = unpack(packed, n, 512, new, length)) != IMAGE_ERR_SOURCE)
+	{
+		printf("patch against the wrong firmware: 0x%x\n", r);
+		return 1;
+	}
+	else
+		printf("patch against the wrong firmware: refused\n");
+
+	// and the simulation has to catch a patch reading erased flash
+	if (d.scratch)
+	{
+		uint8_t *p = malloc(n);
+		memcpy(p, packed, n);
+		((IMAGE_delta *) (p + sizeof(IMAGE_header)))->scratch = 0;
+		r = unpack(p, n, 512, old, old_length);
+		printf("without scratch sectors: %s\n", (r == CMD_SUCCESS)?"worked anyway":"fails, as it should");
+		free(p);
+	}
+
+	free(packed);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	uint8_t *in, *old = NULL;
+	uint32_t length, old_length = 0, n;
+	unsigned r;
+
+	if ((argc == 3) && (strcmp(argv[1], "-b") == 0))
+	{
+		in = load(argv[2], &length);
+		return benchmark(in, length);
+	}
+	if ((argc == 4) && (strcmp(argv[1], "-b") == 0))
+	{
+		old = load(argv[2], &old_length);
+		in = load(argv[3], &length);
+		return benchmark_patch(old, old_length, in, length);
+	}
+	if (((argc == 4) || (argc == 5)) && (strcmp(argv[1], "-d") == 0))
+	{
+		in = load(argv[2], &length);
+		if (argc == 5)
+			old = load(argv[4], &old_length);
+		if ((r = unpack(in, length, 512, old, old_length)) != CMD_SUCCESS)
+		{
+			fprintf(stderr, "%s: bad image, 0x%x\n", argv[2], r);
+			return 1;
+		}
+		save(argv[3], &iap_flash[USER_FLASH_START], unpacked_length(in, length));
+		return 0;
+	}
+	if ((argc == 5) && (strcmp(argv[1], "-p") == 0))
+	{
+		old = load(argv[2], &old_length);
+		in = load(argv[3], &length);
+		uint8_t *packed = malloc(length * 2 + 128);
+		n = make_patch(old, old_length, in, length, packed);
+		save(argv[4], packed, n);
+		printf("%u -> %u bytes\n", length, n);
+		return 0;
+	}
+	if (argc == 3)
+	{
+		in = load(argv[1], &length);
+		uint8_t *packed = malloc(length + length / 255 + 64);
+		n = pack(in, length, packed);
+		save(argv[2], packed, n);
+		printf("%u -> %u bytes\n", length, n);
+		return 0;
+	}
+
+	fprintf(stderr, "usage: %s in.bin out.img | -p old.bin new.bin out.img | -d in.img out.bin [old.bin] | -b in.bin | -b old.bin new.bin\n", argv[0]);
+	return 1;
+}
+
+#endif /* ifndef __LPC17XX__ */
@@ -57,6 +57,25 @@ extern "C"
 #define NDDR				(1UL<<1)
 #define ERR					(1UL<<2)
 
+// DMA descriptor control word
+#define DD_MODE_NORMAL		(0UL<<0)
+#define DD_NEXT_VALID		(1UL<<2)
+#define DD_ISOCHRONOUS		(1UL<<4)
+#define DD_MAX_PACKET(a)	(((a) & 0x7FFUL)<<5)
+#define DD_BUFFER_LENGTH(a)	(((a) & 0xFFFFUL)<<16)
+
+// DMA descriptor status word
+#define DD_RETIRED			(1UL<<0)
+#define DD_STATUS_MASK		(15UL<<1)
+#define DD_STATUS_NOT_SERVICED	(0UL<<1)
+#define DD_STATUS_BEING_SERVICED	(1UL<<1)
+#define DD_STATUS_NORMAL	(2UL<<1)
+#define DD_STATUS_UNDERRUN	(3UL<<1)
+#define DD_STATUS_OVERRUN	(8UL<<1)
+#define DD_STATUS_SYSTEM_ERROR	(9UL<<1)
+#define DD_PACKET_VALID		(1UL<<5)
+#define DD_DMA_COUNT(a)		(((a)>>16) & 0xFFFFUL)
+
 // USBCmdCode
 #define CMD_PHASE_WRITE		(1UL<<8)
 #define CMD_PHASE_READ		(2UL<<8)
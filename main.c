@@ -35,16 +35,50 @@
 #include "sbl_iap.h"
 #include "sbl_config.h"
 
+#include "image.h"
+
 #include "ff.h"
 
 #include "dfu.h"
 
+#ifdef UPLOAD
+#include "upload.h"
+#endif
+
+#ifdef MSC
+#include "msc.h"
+#endif
+
+#ifdef VENDOR
+#include "vendor.h"
+#endif
+
+#ifdef CDC
+#include "cdc.h"
+#endif
+
 #include "min-printf.h"
 
 #include "lpc17xx_wdt.h"
 
+#include "profile.h"
+
+#include "timebase.h"
+
 #define ISP_BTN	P2_12
 
+// the application can leave a request in RTC GPREG0 before resetting.
+// FASTBOOT_MAGIC has a FASTBOOT build check the SD card, UPDATE_MAGIC stays
+// in the bootloader for a DFU or serial upload.
+// Boards with a card detect switch can define SD_DETECT_PIN (low = card in)
+#define FASTBOOT_MAGIC	0x53444355	// "SDCU"
+#define UPDATE_MAGIC	0x55504454	// "UPDT"
+
+// SD cards want 1ms after power reaches 2.2V before the first command
+#define SD_WAKE_DELAY_MS	1
+// lets the host see a USB detach; the old spin loop ran for ~300ms
+#define HANDOFF_DELAY_MS	100
+
 #if !(defined DEBUG)
 #define printf(...) do {} while (0)
 #endif
@@ -69,16 +103,330 @@ int isp_btn_pressed()
 	return GPIO_get(ISP_BTN);
 }
 
+// decide whether an SD update could be pending; probing an absent or idle
+// card costs far more than the rest of the boot
+int sd_probe_needed()
+{
+#ifdef FASTBOOT
+	int probe = 0;
+
+	if (LPC_RTC->GPREG0 == FASTBOOT_MAGIC)
+	{
+		LPC_RTC->GPREG0 = 0;
+		printf("Application requested SD check\n");
+		probe = 1;
+	}
+	else if (isp_btn_pressed() == 0)
+		probe = 1;
+	else if (WDT_ReadTimeOutFlag())
+		probe = 1;
+	else if (user_code_present() == 0)
+		probe = 1;
+
+#ifdef SD_DETECT_PIN
+	GPIO_init(SD_DETECT_PIN); GPIO_input(SD_DETECT_PIN);
+	if (GPIO_get(SD_DETECT_PIN))
+		probe = 0;
+#endif
+
+	return probe;
+#else
+	return 1;
+#endif
+}
+
+// nothing for the update loop to do until an interrupt
+static int update_idle()
+{
+#ifdef MSC
+	if (MSC_idle() == 0)
+		return 0;
+#endif
+#ifdef VENDOR
+	if (VENDOR_idle() == 0)
+		return 0;
+#endif
+#ifdef CDC
+	if (CDC_idle() == 0)
+		return 0;
+#endif
+#ifdef UPLOAD
+	return usb_idle() && DFU_idle() && UPLOAD_idle();
+#else
+	return usb_idle() && DFU_idle();
+#endif
+}
+
 void start_dfu()
 {
 	DFU_init();
+#ifdef UPLOAD
+	UPLOAD_init();
+#endif
+#if defined MSC && !defined MSC_VFAT
+	// a fast boot leaves the card alone
+	if (SDCard_disk_status())
+	{
+		delay_ms(SD_WAKE_DELAY_MS);
+		SDCard_init(P0_9, P0_8, P0_7, P0_6);
+		SDCard_disk_initialize();
+	}
+#endif
+#ifdef MSC
+	MSC_init();
+#endif
+#ifdef VENDOR
+	VENDOR_init();
+#endif
+#ifdef CDC
+	CDC_init();
+#endif
 	usb_init();
 	usb_connect();
 	while (DFU_complete() == 0)
+	{
 		usb_task();
+		DFU_task();
+#ifdef UPLOAD
+		UPLOAD_task();
+		if (UPLOAD_complete())
+			break;
+#endif
+#ifdef MSC
+		MSC_task();
+		if (MSC_complete())
+			break;
+#endif
+#ifdef VENDOR
+		VENDOR_task();
+		if (VENDOR_complete())
+			break;
+#endif
+#ifdef CDC
+		CDC_task();
+		if (CDC_complete())
+			break;
+#endif
+
+		// sleep until an interrupt brings more work. WFI still wakes with
+		// interrupts masked, which closes the race with the checks
+		__disable_irq();
+		if (update_idle())
+			__WFI();
+		__enable_irq();
+	}
 	usb_disconnect();
 }
 
+// FatFs internals, used to find where firmware.bin sits on the card
+DWORD clust2sect(FATFS *, DWORD);
+DWORD get_fat(FATFS *, DWORD);
+
+#define SD_RUNS		16
+#define PAGE_BLOCKS	(FLASH_BUF_SIZE / 512)
+
+// firmware.bin as runs of consecutive card blocks
+static struct {
+	uint32_t block;
+	uint32_t count;
+} runs[SD_RUNS];
+
+// one page is programmed while the card fills the other
+static uint8_t page_buf[2][FLASH_BUF_SIZE] __attribute__ ((section(".ahb_sram_bank0"), aligned(4)));
+
+// card stream state for sd_pump()
+static int run;
+static uint32_t run_done;
+static int streaming;
+static int in_flight;
+static int stream_error;
+static uint8_t *fill;
+static int fill_blocks;
+static int fill_want;
+
+static uint32_t flash_cycles;
+static uint32_t card_cycles;
+
+static int map_firmware(FIL *f)
+{
+	FATFS *fs = f->fs;
+	DWORD clust = f->sclust;
+	DWORD left = (f->fsize + 511) >> 9;
+	int n = 0;
+
+	while (left)
+	{
+		if ((clust < 2) || (clust >= fs->n_fatent))
+			return 0;
+
+		DWORD block = clust2sect(fs, clust);
+		DWORD count = (left < fs->csize)?left:fs->csize;
+
+		if (n && (runs[n - 1].block + runs[n - 1].count == block))
+			runs[n - 1].count += count;
+		else if (n < SD_RUNS)
+		{
+			runs[n].block = block;
+			runs[n].count = count;
+			n++;
+		}
+		else
+			return 0;
+
+		left -= count;
+		if (left)
+			clust = get_fat(fs, clust);
+	}
+	return n;
+}
+
+// keep the card busy: collect the block the DMA was reading, start the next.
+// Runs as the flash hook, so a block arrives during each erase and each page
+// COPY, and finish_page() reads the rest
+static void sd_pump()
+{
+	if (in_flight)
+	{
+		if (SDCard_stream_busy())
+			return;
+		in_flight = 0;
+		if (SDCard_stream_read_finish())
+		{
+			// bad CRC, fetch this block again the careful way
+			SDCard_stream_stop();
+			streaming = 0;
+			if (SDCard_disk_read(fill + (fill_blocks << 9), runs[run].block + run_done))
+			{
+				stream_error = 1;
+				return;
+			}
+		}
+		fill_blocks++;
+		run_done++;
+	}
+
+	if (stream_error || (fill_blocks >= fill_want))
+		return;
+
+	if (run_done == runs[run].count)
+	{
+		if (streaming)
+			SDCard_stream_stop();
+		streaming = 0;
+		run++;
+		run_done = 0;
+	}
+	if (streaming == 0)
+	{
+		if (SDCard_stream_start(runs[run].block + run_done))
+		{
+			stream_error = 1;
+			return;
+		}
+		streaming = 1;
+	}
+	if (SDCard_stream_read_start(fill + (fill_blocks << 9)))
+	{
+		stream_error = 1;
+		return;
+	}
+	in_flight = 1;
+}
+
+static void fill_page(uint8_t *buf, uint32_t *blocks)
+{
+	fill = buf;
+	fill_blocks = 0;
+	fill_want = (*blocks < PAGE_BLOCKS)?*blocks:PAGE_BLOCKS;
+	*blocks -= fill_want;
+}
+
+static void finish_page()
+{
+	uint32_t t = DWT_CYCCNT;
+	while ((stream_error == 0) && (in_flight || (fill_blocks < fill_want)))
+		sd_pump();
+	card_cycles += DWT_CYCCNT - t;
+}
+
+// stream firmware.bin straight off the card, reading the next page during
+// the IAP calls for this one. Both of these pass the file to IMAGE_write,
+// which unpacks packed images on the way to the flash when built with IMAGE
+static uint32_t flash_pipelined()
+{
+	uint32_t size = file.fsize;
+	uint32_t blocks = (size + 511) >> 9;
+	uint32_t address = USER_FLASH_START;
+	int p = 0;
+
+	run = 0;
+	run_done = 0;
+	streaming = 0;
+	in_flight = 0;
+	stream_error = 0;
+
+	fill_page(page_buf[0], &blocks);
+	finish_page();
+
+	IMAGE_start();
+	flash_set_hook(sd_pump);
+	while (size && (stream_error == 0))
+	{
+		uint32_t len = (size < FLASH_BUF_SIZE)?size:FLASH_BUF_SIZE;
+		uint32_t t;
+
+		setleds((address - USER_FLASH_START) >> 15);
+		printf("\t0x%lx\n", address);
+
+		fill_page(page_buf[p ^ 1], &blocks);
+
+		t = DWT_CYCCNT;
+		if (IMAGE_write(page_buf[p], len) != 0)
+			stream_error = 1;
+		flash_cycles += DWT_CYCCNT - t;
+
+		finish_page();
+
+		address += len;
+		size -= len;
+		p ^= 1;
+	}
+	flash_set_hook(0);
+
+	if (streaming)
+		SDCard_stream_stop();
+
+	if (stream_error)
+		return 0;
+	return address;
+}
+
+// fragmented file: let FatFs do the reading, a page at a time
+static uint32_t flash_sequential()
+{
+	unsigned int r = FLASH_BUF_SIZE;
+	uint32_t address = USER_FLASH_START;
+
+	IMAGE_start();
+	while (r == FLASH_BUF_SIZE)
+	{
+		uint32_t t = DWT_CYCCNT;
+		if (f_read(&file, page_buf[0], FLASH_BUF_SIZE, &r) != FR_OK)
+			return 0;
+		card_cycles += DWT_CYCCNT - t;
+
+		setleds((address - USER_FLASH_START) >> 15);
+		printf("\t0x%lx\n", address);
+
+		t = DWT_CYCCNT;
+		if (IMAGE_write(page_buf[0], r) != 0)
+			return 0;
+		flash_cycles += DWT_CYCCNT - t;
+		address += r;
+	}
+	return address;
+}
+
 void check_sd_firmware()
 {
 	int r;
@@ -87,28 +435,33 @@ void check_sd_firmware()
 	if ((r = f_open(&file, firmware_file, FA_READ)) == FR_OK)
 	{
 		printf("Flashing firmware...\n");
-		uint8_t buf[512];
-		unsigned int r = sizeof(buf);
-		uint32_t address = USER_FLASH_START;
-		while (r == sizeof(buf))
-		{
-			if (f_read(&file, buf, sizeof(buf), &r) != FR_OK)
-			{
-				f_close(&file);
-				return;
-			}
+		profile_mark("f_open");
 
-			setleds((address - USER_FLASH_START) >> 15);
+		flash_cycles = 0;
+		card_cycles = 0;
 
-			printf("\t0x%lx\n", address);
+		int n = map_firmware(&file);
+		uint32_t address = n?flash_pipelined():flash_sequential();
 
-			write_flash((void *) address, (char *)buf, sizeof(buf));
-			address += r;
+		uint32_t t = DWT_CYCCNT;
+		if ((address == 0) || (IMAGE_finish() != 0))
+		{
+			printf("Update failed\n");
+			f_close(&file);
+			return;
 		}
+		flash_cycles += DWT_CYCCNT - t;
+
+#ifdef DEBUG
+		uint32_t ms = SystemCoreClock / 1000;
+		printf("%lu bytes from %d runs: flash %lums, waiting for card %lums\n", file.fsize, n, flash_cycles / ms, card_cycles / ms);
+#endif
+		profile_mark("sd update");
+
 		f_close(&file);
 		if (address > USER_FLASH_START)
 		{
-			printf("Complete!\n");
+			printf("Complete! %u sectors written, %u unchanged\n", flash_sectors_written, flash_sectors_skipped);
 			r = f_unlink(firmware_old);
 			r = f_rename(firmware_file, firmware_old);
 		}
@@ -128,20 +481,11 @@ static void boot(uint32_t a)
 	// never returns
 }
 
-static uint32_t delay_loop(uint32_t count)
-{
-	volatile uint32_t j, del;
-	for(j=0; j<count; ++j){
-		del=j; // volatiles, so the compiler will not optimize the loop
-	}
-	return del;
-}
-
 static void new_execute_user_code(void)
 {
 	uint32_t addr=(uint32_t)USER_FLASH_START;
-	// delay
-	delay_loop(3000000);
+	// let USB detach and the UART drain before the clocks go
+	delay_ms(HANDOFF_DELAY_MS);
 	// relocate vector table
 	SCB->VTOR = (addr & 0x1FFFFF80);
 	// switch to RC generator
@@ -158,7 +502,11 @@ static void new_execute_user_code(void)
 	LPC_SC->CCLKCFG = 0x0;     //  Select the IRC as clk
 	LPC_SC->CLKSRCSEL = 0x00;
 	LPC_SC->SCS = 0x00;		    // not using XTAL anymore
-	delay_loop(1000);
+	timebase_calibrate();
+	delay_ms(2);
+	timebase_deinit();
+	// not printed any more, but there for a debugger to see
+	profile_mark("handoff");
 	// reset pipeline, sync bus and memory access
 	__asm (
 		   "dmb\n"
@@ -170,6 +518,9 @@ static void new_execute_user_code(void)
 
 int main()
 {
+	profile_init();
+	timebase_init();
+
 	WDT_Feed();
 
 	GPIO_init(ISP_BTN); GPIO_input(ISP_BTN);
@@ -190,13 +541,26 @@ int main()
 
 	UART_init(UART_RX, UART_TX, 2000000);
 	printf("Bootloader Start\n");
+	profile_mark("init");
 
-	// give SD card time to wake up
-	for (volatile int i = (1UL<<12); i; i--);
-
-	SDCard_init(P0_9, P0_8, P0_7, P0_6);
-	if (SDCard_disk_initialize() == 0)
-		check_sd_firmware();
+	if (sd_probe_needed())
+	{
+		// give SD card time to wake up
+		delay_ms(SD_WAKE_DELAY_MS);
+		profile_mark("sd wake");
+
+		SDCard_init(P0_9, P0_8, P0_7, P0_6);
+		int sd = SDCard_disk_initialize();
+		profile_mark("sd init");
+		if (sd == 0)
+			check_sd_firmware();
+		profile_mark("sd check");
+	}
+	else
+	{
+		printf("Fast boot, skipping SD card\n");
+		profile_mark("fast boot");
+	}
 
 	int dfu = 0;
 	if (isp_btn_pressed() == 0)
@@ -209,9 +573,22 @@ int main()
 		printf("WATCHDOG reset, entering DFU mode\n");
 		dfu = 1;
 	}
+	else if (LPC_RTC->GPREG0 == UPDATE_MAGIC) {
+		LPC_RTC->GPREG0 = 0;
+		printf("Update requested, entering DFU mode\n");
+		dfu = 1;
+	}
 
 	if (dfu)
+	{
 		start_dfu();
+		profile_mark("dfu");
+#if defined MSC && !defined MSC_VFAT
+		// the host ejected the card, flash whatever it left there
+		if (MSC_complete())
+			check_sd_firmware();
+#endif
+	}
 
 #ifdef WATCHDOG
 	WDT_Init(WDT_CLKSRC_IRC, WDT_MODE_RESET);
@@ -224,6 +601,10 @@ int main()
 	printf("Jumping to 0x%x\n", *p);
 #endif
 
+#ifdef DEBUG
+	profile_print(0);
+#endif
+
 	while (UART_busy());
 	printf("Jump!\n");
 	while (UART_busy());
@@ -237,7 +618,8 @@ int main()
 
 	while (UART_busy());
 
-	for (volatile int i = (1<<18);i;i--);
+	timebase_init();
+	delay_ms(10);
 
 	NVIC_SystemReset();
 }
@@ -264,11 +646,19 @@ uint32_t get_fattime()
 
 int _write(int fd, const char *buf, int buflen)
 {
+	// never wait for the UART, whatever doesn't fit in the ring is dropped
 	if (fd < 3)
 	{
-		while (UART_cansend() < buflen);
-		return UART_send((const uint8_t *)buf, buflen);
+		int n = UART_cansend();
+		if (n > buflen)
+			n = buflen;
+		UART_send((const uint8_t *)buf, n);
 	}
+#ifdef CDC
+	// stdout is mirrored to the serial port, which is kept until it's opened
+	if ((fd < 3) || (fd == CDC_FD))
+		CDC_send((const uint8_t *)buf, buflen);
+#endif
 	return buflen;
 }
 
@@ -0,0 +1,556 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+#include "msc.h"
+
+#include "descriptor_msc.h"
+#include "usbhw.h"
+
+#include "SDCard.h"
+
+#include <string.h>
+
+#include "min-printf.h"
+
+#if !(defined DEBUG)
+#define printf(...) do {} while (0)
+#endif
+
+// sense keys
+#define SENSE_NOT_READY			0x02
+#define SENSE_MEDIUM_ERROR		0x03
+#define SENSE_ILLEGAL_REQUEST	0x05
+
+// additional sense codes
+#define ASC_WRITE_ERROR			0x0C
+#define ASC_READ_ERROR			0x11
+#define ASC_INVALID_COMMAND		0x20
+#define ASC_LBA_OUT_OF_RANGE	0x21
+#define ASC_INVALID_FIELD		0x24
+#define ASC_MEDIUM_NOT_PRESENT	0x3A
+
+// bmFlags direction bit, set for device to host
+#define CBW_DIRECTION_IN		0x80
+
+static const uint8_t inquiry[36] =
+{
+	0x00,						// direct access block device
+	0x80,						// removable medium
+	0x02,						// SCSI-2
+	0x02,						// response data format
+	sizeof(inquiry) - 5,		// additional length
+	0x00, 0x00, 0x00,
+	'S', 'm', 'o', 'o', 't', 'h', 'i', 'e',
+#ifdef MSC_VFAT
+	'F', 'i', 'r', 'm', 'w', 'a', 'r', 'e', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ',
+#else
+	'S', 'D', ' ', 'C', 'a', 'r', 'd', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ',
+#endif
+	'1', '.', '0', ' ',
+};
+
+static MSC_CBW cbw;
+static MSC_CSW csw;
+
+// in AHB SRAM so READ10 data can go out through the USB DMA engine
+static uint8_t buffer[MSC_BUFFER_BLOCKS][MSC_BLOCK_SIZE] USB_DMA_BUFFER;
+
+// WRITE10 data lands in each half of buffer in turn, so the host can
+// send one half while the other is written to the disk
+static usb_ring ring = { buffer[0], MSC_BUFFER_BLOCKS / 2 * MSC_BLOCK_SIZE, 2 };
+
+static uint8_t stage;
+static uint8_t *data;			// next byte of the data stage in buffer
+static uint32_t data_length;	// bytes left before buffer must be refilled or flushed
+static uint32_t block;			// next block to read or write
+static uint32_t blocks;			// blocks of the command not yet in buffer
+static uint8_t dma;				// buffer is with the DMA engine
+
+static uint8_t sense_key;
+static uint8_t sense_asc;
+static uint8_t ejected;
+
+// set from the USB interrupt
+static volatile uint8_t event;
+static volatile uint8_t reset;
+static volatile uint8_t unstalled;
+static volatile int dma_length;	// what the last DMA transfer sent, -1 if it failed
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+void MSC_init()
+{
+	stage = MSC_BS_CBW;
+	sense_key = sense_asc = 0;
+	ejected = 0;
+}
+
+static void MSC_wake()
+{
+	event = 1;
+}
+
+static void MSC_dma_done(uint8_t bEP, int length)
+{
+	dma_length = length;
+	event = 1;
+}
+
+// SET_CONFIGURATION, from the USB interrupt
+void MSC_configure()
+{
+	usb_realise_endpoint(MSC_EP_OUT, MSC_PACKET_SIZE);
+	usb_realise_endpoint(MSC_EP_IN, MSC_PACKET_SIZE);
+	usb_ep_unstall(MSC_EP_OUT);
+	usb_ep_unstall(MSC_EP_IN);
+	usb_set_callback(MSC_EP_OUT, MSC_wake);
+	usb_set_callback(MSC_EP_IN, MSC_wake);
+	reset = 1;
+	event = 1;
+}
+
+void MSC_controlTransfer(CONTROL_TRANSFER *control)
+{
+	switch (control->setup.bRequest)
+	{
+		case MSC_REQUEST_RESET:
+			// the host clears both endpoint halts next
+			printf("MSC:RESET\n");
+			reset = 1;
+			event = 1;
+			break;
+		case MSC_REQUEST_GET_MAX_LUN:
+			((uint8_t *) control->buffer)[0] = 0;
+			control->bufferlen = 1;
+			break;
+		default:
+			usb_ep0_stall();
+			break;
+	}
+}
+
+// CLEAR_FEATURE(ENDPOINT_HALT), from the USB interrupt
+void MSC_clearHalt(uint8_t bEP)
+{
+	// after an invalid CBW only a reset may clear the halts
+	if ((stage == MSC_BS_ERROR) && (reset == 0))
+		usb_ep_stall(bEP);
+	else if (bEP == MSC_EP_IN)
+	{
+		unstalled = 1;
+		event = 1;
+	}
+}
+
+// end the data stage. If the host expected more, halt the endpoint it is
+// waiting on; an IN halt holds the CSW back until the host clears it
+static void MSC_finish()
+{
+	if (csw.dDataResidue && (cbw.bmFlags & CBW_DIRECTION_IN))
+		stage = MSC_BS_DATA_IN_LAST;
+	else
+	{
+		if (csw.dDataResidue)
+			usb_ep_stall(MSC_EP_OUT);
+		stage = MSC_BS_CSW;
+	}
+}
+
+static void MSC_fail(uint8_t key, uint8_t asc)
+{
+	sense_key = key;
+	sense_asc = asc;
+	csw.bStatus = CSW_CMD_FAILED;
+	MSC_finish();
+}
+
+static void MSC_phase_error()
+{
+	csw.bStatus = CSW_PHASE_ERROR;
+	MSC_finish();
+}
+
+static int MSC_ready()
+{
+	if (MSC_disk_ready())
+		return 1;
+	MSC_fail(SENSE_NOT_READY, ASC_MEDIUM_NOT_PRESENT);
+	return 0;
+}
+
+// send length bytes from the start of buffer, or as many as the host wants
+static void MSC_reply(uint32_t length)
+{
+	if (cbw.dDataLength && ((cbw.bmFlags & CBW_DIRECTION_IN) == 0))
+	{
+		MSC_phase_error();
+		return;
+	}
+	if (length > cbw.dDataLength)
+		length = cbw.dDataLength;
+	data = buffer[0];
+	data_length = length;
+	blocks = 0;
+	stage = MSC_BS_DATA_IN;
+}
+
+// READ10 and WRITE10
+static void MSC_transfer(uint8_t in)
+{
+	uint32_t lba = get_be32(&cbw.CB[2]);
+	uint32_t count = (cbw.CB[7] << 8) | cbw.CB[8];
+
+	if (MSC_ready() == 0)
+		return;
+
+	if ((lba + count < lba) || (lba + count > MSC_disk_blocks()))
+	{
+		MSC_fail(SENSE_ILLEGAL_REQUEST, ASC_LBA_OUT_OF_RANGE);
+		return;
+	}
+
+	// the host must expect exactly this much data, in this direction
+	if ((cbw.dDataLength != count * MSC_BLOCK_SIZE) || (((cbw.bmFlags & CBW_DIRECTION_IN) != 0) != in))
+	{
+		MSC_phase_error();
+		return;
+	}
+
+	block = lba;
+	blocks = count;
+	data = buffer[0];
+	data_length = 0;
+	stage = in?MSC_BS_DATA_IN:MSC_BS_DATA_OUT;
+	if (in == 0)
+		usb_ring_start(MSC_EP_OUT, &ring, count * MSC_BLOCK_SIZE);
+}
+
+static void MSC_command()
+{
+	uint8_t *r = buffer[0];
+
+	if ((cbw.bLUN != 0) || (cbw.bCBLength < 1) || (cbw.bCBLength > 16))
+	{
+		MSC_fail(SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD);
+		return;
+	}
+
+	printf("MSC:%x\n", cbw.CB[0]);
+
+	switch (cbw.CB[0])
+	{
+		case SCSI_TEST_UNIT_READY:
+			if (MSC_ready())
+				MSC_finish();
+			break;
+		case SCSI_REQUEST_SENSE:
+			memset(r, 0, 18);
+			r[0] = 0x70;				// current error, fixed format
+			r[2] = sense_key;
+			r[7] = 10;					// additional length
+			r[12] = sense_asc;
+			sense_key = sense_asc = 0;
+			MSC_reply(18);
+			break;
+		case SCSI_INQUIRY:
+			memcpy(r, inquiry, sizeof(inquiry));
+			MSC_reply(sizeof(inquiry));
+			break;
+		case SCSI_MODE_SENSE6:
+			memset(r, 0, 4);
+			r[0] = 3;					// mode data length, no pages
+			MSC_reply(4);
+			break;
+		case SCSI_MODE_SENSE10:
+			memset(r, 0, 8);
+			r[1] = 6;
+			MSC_reply(8);
+			break;
+		case SCSI_START_STOP_UNIT:
+			// LoEj set and Start clear is an eject
+			if ((cbw.CB[4] & 3) == 2)
+			{
+				ejected = 1;
+				MSC_disk_sync();
+			}
+			MSC_finish();
+			break;
+		case SCSI_SYNCHRONIZE_CACHE10:
+			if (MSC_disk_sync())
+				MSC_fail(SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR);
+			else
+				MSC_finish();
+			break;
+		case SCSI_MEDIA_REMOVAL:
+		case SCSI_VERIFY10:
+			MSC_finish();
+			break;
+		case SCSI_READ_FORMAT_CAPACITIES:
+			if (MSC_ready() == 0)
+				break;
+			memset(r, 0, 12);
+			r[3] = 8;					// capacity list length
+			put_be32(&r[4], MSC_disk_blocks());
+			put_be32(&r[8], MSC_BLOCK_SIZE);
+			r[8] = 0x02;				// formatted media
+			MSC_reply(12);
+			break;
+		case SCSI_READ_CAPACITY:
+			if (MSC_ready() == 0)
+				break;
+			put_be32(&r[0], MSC_disk_blocks() - 1);
+			put_be32(&r[4], MSC_BLOCK_SIZE);
+			MSC_reply(8);
+			break;
+		case SCSI_READ10:
+			MSC_transfer(1);
+			break;
+		case SCSI_WRITE10:
+			MSC_transfer(0);
+			break;
+		default:
+			MSC_fail(SENSE_ILLEGAL_REQUEST, ASC_INVALID_COMMAND);
+			break;
+	}
+}
+
+static int MSC_get_CBW()
+{
+	if (usb_can_read(MSC_EP_OUT) == 0)
+		return 0;
+
+	// buffer is free between commands, and takes a packet of any length
+	int l = usb_read_packet(MSC_EP_OUT, buffer[0], MSC_PACKET_SIZE);
+	memcpy(&cbw, buffer[0], sizeof(cbw));
+
+	if ((l != sizeof(cbw)) || (cbw.dSignature != MSC_CBW_Signature))
+	{
+		// not a CBW, halt both endpoints until the host resets us
+		stage = MSC_BS_ERROR;
+		usb_ep_stall(MSC_EP_IN);
+		usb_ep_stall(MSC_EP_OUT);
+		return 1;
+	}
+
+	csw.dSignature = MSC_CSW_Signature;
+	csw.dTag = cbw.dTag;
+	csw.dDataResidue = cbw.dDataLength;
+	csw.bStatus = CSW_CMD_PASSED;
+	MSC_command();
+	return 1;
+}
+
+static int MSC_data_in()
+{
+	if (dma)
+	{
+		if (usb_dma_busy(MSC_EP_IN))
+			return 0;
+		dma = 0;
+		if (dma_length < 0)
+		{
+			MSC_fail(SENSE_MEDIUM_ERROR, ASC_READ_ERROR);
+			return 1;
+		}
+		csw.dDataResidue -= dma_length;
+		data_length = 0;
+	}
+
+	if (data_length == 0)
+	{
+		if (blocks == 0)
+		{
+			MSC_finish();
+			return 1;
+		}
+		uint32_t n = (blocks < MSC_BUFFER_BLOCKS)?blocks:MSC_BUFFER_BLOCKS;
+		if (MSC_disk_read(buffer[0], block, n))
+		{
+			MSC_fail(SENSE_MEDIUM_ERROR, ASC_READ_ERROR);
+			return 1;
+		}
+		block += n;
+		blocks -= n;
+		data = buffer[0];
+		data_length = n * MSC_BLOCK_SIZE;
+
+		// the whole read in one go if the DMA engine takes it, otherwise
+		// a packet at a time from here
+		if (usb_dma_queue(MSC_EP_IN, data, data_length, MSC_dma_done))
+		{
+			dma = 1;
+			return 0;
+		}
+	}
+
+	if (usb_can_write(MSC_EP_IN) == 0)
+		return 0;
+
+	uint32_t l = (data_length < MSC_PACKET_SIZE)?data_length:MSC_PACKET_SIZE;
+	usb_write_packet(MSC_EP_IN, data, l);
+	data += l;
+	data_length -= l;
+	csw.dDataResidue -= l;
+	return 1;
+}
+
+static int MSC_data_out()
+{
+	uint8_t *p;
+	int l = usb_ring_read(MSC_EP_OUT, &p);
+	int n = l / MSC_BLOCK_SIZE;
+
+	if (l == 0)
+	{
+		if (usb_ring_busy(MSC_EP_OUT))
+			return 0;
+		// everything has been written, or the host stopped short
+		usb_ring_stop(MSC_EP_OUT);
+		if (blocks)
+			MSC_phase_error();
+		else
+			MSC_finish();
+		return 1;
+	}
+
+	// a short slot only comes before a phase error, its partial block is dropped
+	csw.dDataResidue -= l;
+	if (n && MSC_disk_write(p, block, n))
+	{
+		usb_ring_stop(MSC_EP_OUT);
+		MSC_fail(SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR);
+		return 1;
+	}
+	block += n;
+	blocks -= n;
+	usb_ring_release(MSC_EP_OUT);
+	return 1;
+}
+
+static int MSC_step()
+{
+	if (reset)
+	{
+		reset = 0;
+		usb_ring_stop(MSC_EP_OUT);
+		usb_dma_cancel(MSC_EP_IN);
+		dma = 0;
+		stage = MSC_BS_CBW;
+	}
+
+	switch (stage)
+	{
+		case MSC_BS_CBW:
+			return MSC_get_CBW();
+		case MSC_BS_DATA_IN:
+			return MSC_data_in();
+		case MSC_BS_DATA_OUT:
+			return MSC_data_out();
+		case MSC_BS_DATA_IN_LAST:
+			// a halt would keep back data still queued on the endpoint
+			if (usb_write_pending(MSC_EP_IN))
+				return 0;
+			unstalled = 0;
+			stage = MSC_BS_DATA_IN_LAST_STALL;
+			usb_ep_stall(MSC_EP_IN);
+			return 1;
+		case MSC_BS_DATA_IN_LAST_STALL:
+			if (unstalled == 0)
+				return 0;
+			stage = MSC_BS_CSW;
+			return 1;
+		case MSC_BS_CSW:
+			if (usb_can_write(MSC_EP_IN) == 0)
+				return 0;
+			usb_write_packet(MSC_EP_IN, &csw, sizeof(csw));
+			stage = MSC_BS_CBW;
+			return 1;
+	}
+	return 0;
+}
+
+void MSC_task()
+{
+	event = 0;
+	while (MSC_step());
+}
+
+int MSC_idle()
+{
+	return (event == 0);
+}
+
+// the host has ejected us, or the disk is done, and the last CSW has gone
+int MSC_complete()
+{
+	return (ejected || MSC_disk_complete()) && (stage == MSC_BS_CBW) && (usb_write_pending(MSC_EP_IN) == 0);
+}
+
+#ifndef MSC_VFAT
+/*
+ * the SD card as our disk
+ */
+
+int MSC_disk_ready()
+{
+	return (SDCard_disk_status() == 0);
+}
+
+uint32_t MSC_disk_blocks()
+{
+	return SDCard_disk_sectors();
+}
+
+int MSC_disk_read(uint8_t *buf, uint32_t block_number, int count)
+{
+	return SDCard_disk_read_multi(buf, block_number, count);
+}
+
+int MSC_disk_write(const uint8_t *buf, uint32_t block_number, int count)
+{
+	return SDCard_disk_write_multi(buf, block_number, count);
+}
+
+int MSC_disk_sync()
+{
+	return SDCard_disk_sync();
+}
+
+int MSC_disk_complete()
+{
+	return 0;
+}
+#endif /* MSC_VFAT */
@@ -0,0 +1,77 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+#ifndef _MSC_H
+#define _MSC_H
+
+#include <stdint.h>
+
+#include "usbcore.h"
+
+/*
+ * USB mass storage (bulk-only transport, SCSI transparent command set),
+ * added to the DFU configuration when built with MSC defined.
+ *
+ * The SCSI layer in msc.c runs from MSC_task() in the main loop, the USB
+ * interrupt only wakes it. It serves one LUN of 512 byte blocks from the
+ * MSC_disk_ functions below, and reads up to MSC_BUFFER_BLOCKS of them per
+ * disk access. READ10 data goes out through the USB DMA engine. Writes go
+ * half that at a time, the interrupt receiving into one half of the buffer
+ * while the other is written.
+ *
+ * The disk is the SD card, or with MSC_VFAT also defined, a FAT volume
+ * made up around user flash (see vfat.c).
+ *
+ * Ejecting the drive ends the session. For the SD card the host copies
+ * firmware.bin over and ejects it to have it flashed; the flash volume
+ * also ends the session by itself once a new image has been written.
+ */
+
+#define MSC_INTERFACE		1
+
+#define MSC_EP_OUT			0x02
+#define MSC_EP_IN			0x82
+#define MSC_PACKET_SIZE		64
+
+#define MSC_BLOCK_SIZE		512
+#define MSC_BUFFER_BLOCKS	4
+
+void MSC_init(void);
+void MSC_configure(void);
+void MSC_controlTransfer(CONTROL_TRANSFER *);
+void MSC_clearHalt(uint8_t bEP);
+void MSC_task(void);
+int  MSC_idle(void);
+int  MSC_complete(void);
+
+// the block device behind the SCSI layer
+int      MSC_disk_ready(void);
+uint32_t MSC_disk_blocks(void);
+int      MSC_disk_read(uint8_t *buffer, uint32_t block, int count);
+int      MSC_disk_write(const uint8_t *buffer, uint32_t block, int count);
+int      MSC_disk_sync(void);
+int      MSC_disk_complete(void);
+
+#endif /* _MSC_H */
@@ -0,0 +1,555 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+/*
+ * Replays SCSI commands into the real msc.c, the way a host drives the
+ * bulk-only transport, to see what throughput the drive gives without a
+ * board. The disk behind it is the real SDCard.c talking to sdcardsim.c's
+ * card, so SD time is the driver's own at its SPI clock.
+ *
+ * The USB side is a full speed bus moving at most 19 bulk packets a frame.
+ * IN data goes out through DMA the way msc.c queues it, or with -p packet
+ * by packet as it does when DMA is refused. OUT data only comes in while
+ * the ring has a free slot. The bus and the card run at the same time, so
+ * time spent waiting on either shows. READ10 data is checked against the
+ * card, and WRITE10 data is checked once the command has passed.
+ *
+ * The script has one command a line: inquiry, ready, sense, capacity,
+ * sync, eject, "read lba count" and "write lba count". Without one,
+ * the replay is a copy like a host makes: it writes -s kbytes (256 by
+ * default) at block 2048 in 64k WRITE10s, then reads them back and ejects.
+ *
+ * Run with:
+ * gcc -std=gnu99 -O2 -I. -ICMSISv2p00_LPC17xx/inc -o mscsim mscsim.c && ./mscsim card.img
+ * ./mscsim -s 1024 card.img
+ * ./mscsim -p card.img						without USB DMA
+ * ./mscsim card.img commands.txt
+ */
+
+#ifndef __LPC17XX__
+
+#include "sdcardsim.c"
+
+// and the host has its own printf
+#define _MIN_PRINTF_H
+#include "msc.c"
+
+#undef printf
+
+// full speed bulk, at most 19 packets of 64 bytes in a 1ms frame
+#define PACKET_NS		(1000000 / 19)
+
+// longest transfer a script may ask for, in blocks
+#define HOST_MAX_BLOCKS	256
+
+static uint64_t bus_free_ns;		// when the bus has sent everything queued
+
+// IN: what the device has sent, and its CSW once that has come
+static uint8_t host_in[HOST_MAX_BLOCKS * MSC_BLOCK_SIZE + MSC_PACKET_SIZE];
+static uint32_t host_in_length;
+static uint8_t host_csw_seen;
+static MSC_CSW host_csw;
+static uint8_t in_halted;
+
+static usb_dma_callback_pointer in_dma_callback;
+static int in_dma_length;
+static uint64_t in_dma_done_ns;
+
+// OUT: the CBW, then any data, landing a packet at a time
+static MSC_CBW host_cbw;
+static uint8_t host_cbw_pending;
+static uint64_t host_cbw_ns;
+static uint8_t host_out[HOST_MAX_BLOCKS * MSC_BLOCK_SIZE];
+static uint32_t host_out_sent;
+static uint8_t out_halted;
+
+static usb_ring *out_ring;
+static uint64_t out_packet_ns;		// when the next OUT packet lands, 0 if none is on its way
+
+static uint64_t disk_ns;			// spent in MSC_task(), which is all SD card
+static uint8_t no_dma;				// -p, READ10 data a packet at a time
+
+// packets onto the bus after whatever is queued, returns when they've gone
+static uint64_t bus_send(int packets)
+{
+	if (bus_free_ns < spisim_ns)
+		bus_free_ns = spisim_ns;
+	bus_free_ns += (uint64_t) packets * PACKET_NS;
+	return bus_free_ns;
+}
+
+static void host_receive(const void *data, int length)
+{
+	memcpy(&host_in[host_in_length], data, length);
+	host_in_length += length;
+}
+
+static void in_dma_poll()
+{
+	usb_dma_callback_pointer callback = in_dma_callback;
+
+	if (callback && (spisim_ns >= in_dma_done_ns))
+	{
+		in_dma_callback = NULL;
+		callback(MSC_EP_IN, in_dma_length);
+	}
+}
+
+// the host sends the next packet once the ring has room for it
+static void out_ring_fill()
+{
+	usb_ring *ring = out_ring;
+
+	while (ring && ring->remaining && ((uint8_t) (ring->head - ring->tail) < ring->slots))
+	{
+		uint8_t *slot = ring->buffer + (ring->head % ring->slots) * ring->slot_size;
+		uint32_t l = ring->slot_size - ring->fill;
+
+		if (out_packet_ns == 0)
+			out_packet_ns = bus_send(1);
+		if (spisim_ns < out_packet_ns)
+			return;
+		out_packet_ns = 0;
+
+		if (l > ring->remaining)
+			l = ring->remaining;
+		if (l > MSC_PACKET_SIZE)
+			l = MSC_PACKET_SIZE;
+		memcpy(slot + ring->fill, &host_out[host_out_sent], l);
+		host_out_sent += l;
+		ring->fill += l;
+		ring->remaining -= l;
+
+		if ((ring->fill == ring->slot_size) || (ring->remaining == 0))
+		{
+			ring->length[ring->head % ring->slots] = ring->fill;
+			ring->fill = 0;
+			ring->head++;
+		}
+	}
+}
+
+// usbhw.c, as far as msc.c goes
+
+void usb_realise_endpoint(uint8_t bEP, uint16_t packet_size) {}
+void usb_set_callback(uint8_t bEP, usb_callback_pointer callback) {}
+void usb_ep0_stall() {}
+
+void usb_ep_stall(uint8_t bEP)
+{
+	if (bEP == MSC_EP_IN)
+		in_halted = 1;
+	else
+		out_halted = 1;
+}
+
+void usb_ep_unstall(uint8_t bEP)
+{
+	if (bEP == MSC_EP_IN)
+		in_halted = 0;
+	else
+		out_halted = 0;
+}
+
+// the endpoint is double buffered, so there's room while a packet is on the bus
+int usb_can_write(uint8_t bEP)
+{
+	return !in_halted && (in_dma_callback == NULL) && (bus_free_ns <= spisim_ns + PACKET_NS);
+}
+
+int usb_write_pending(uint8_t bEP)
+{
+	return (bus_free_ns > spisim_ns);
+}
+
+int usb_write_packet(uint8_t bEP, void *data, int packetlen)
+{
+	bus_send(1);
+	host_receive(data, packetlen);
+	if ((packetlen == sizeof(MSC_CSW)) && (((MSC_CSW *) data)->dSignature == MSC_CSW_Signature))
+	{
+		memcpy(&host_csw, data, sizeof(host_csw));
+		host_csw_seen = 1;
+	}
+	return packetlen;
+}
+
+int usb_can_read(uint8_t bEP)
+{
+	return !out_halted && host_cbw_pending && (spisim_ns >= host_cbw_ns);
+}
+
+int usb_read_packet(uint8_t bEP, void *buffer, int buffersize)
+{
+	host_cbw_pending = 0;
+	memcpy(buffer, &host_cbw, sizeof(host_cbw));
+	return sizeof(host_cbw);
+}
+
+void usb_ring_start(uint8_t bEP, usb_ring *ring, uint32_t length)
+{
+	ring->short_packet = 0;
+	ring->fill = 0;
+	ring->remaining = length;
+	ring->head = ring->tail = 0;
+	out_ring = ring;
+	out_ring_fill();
+}
+
+int usb_ring_read(uint8_t bEP, uint8_t **data)
+{
+	if ((out_ring == NULL) || (out_ring->head == out_ring->tail))
+		return 0;
+	*data = out_ring->buffer + (out_ring->tail % out_ring->slots) * out_ring->slot_size;
+	return out_ring->length[out_ring->tail % out_ring->slots];
+}
+
+void usb_ring_release(uint8_t bEP)
+{
+	if ((out_ring == NULL) || (out_ring->head == out_ring->tail))
+		return;
+	out_ring->tail++;
+	out_ring_fill();
+}
+
+int usb_ring_busy(uint8_t bEP)
+{
+	return out_ring && (out_ring->remaining || (out_ring->head != out_ring->tail));
+}
+
+void usb_ring_stop(uint8_t bEP)
+{
+	out_ring = NULL;
+	out_packet_ns = 0;
+}
+
+int usb_dma_queue(uint8_t bEP, void *buffer, uint16_t length, usb_dma_callback_pointer callback)
+{
+	if (no_dma || in_dma_callback || in_halted || (length == 0))
+		return 0;
+	in_dma_done_ns = bus_send((length + MSC_PACKET_SIZE - 1) / MSC_PACKET_SIZE);
+	in_dma_length = length;
+	in_dma_callback = callback;
+	host_receive(buffer, length);
+	return 1;
+}
+
+int usb_dma_busy(uint8_t bEP)
+{
+	in_dma_poll();
+	return (in_dma_callback != NULL);
+}
+
+void usb_dma_cancel(uint8_t bEP)
+{
+	in_dma_callback = NULL;
+}
+
+// the next time anything happens on the bus, 0 if nothing will
+static uint64_t bus_next()
+{
+	uint64_t next = 0;
+	uint64_t t[4];
+	int i;
+
+	t[0] = host_cbw_pending?host_cbw_ns:0;
+	t[1] = out_packet_ns;
+	t[2] = in_dma_callback?in_dma_done_ns:0;
+	t[3] = (bus_free_ns > spisim_ns + PACKET_NS)?(bus_free_ns - PACKET_NS):bus_free_ns;
+	for (i = 0; i < 4; i++)
+		if ((t[i] > spisim_ns) && ((next == 0) || (t[i] < next)))
+			next = t[i];
+	return next;
+}
+
+// one command through the transport, returns the CSW status or -1
+static int host_command(const uint8_t *cb, int cb_length, uint32_t length, uint8_t in)
+{
+	static uint32_t tag;
+	uint64_t t, next;
+
+	memset(&host_cbw, 0, sizeof(host_cbw));
+	host_cbw.dSignature = MSC_CBW_Signature;
+	host_cbw.dTag = ++tag;
+	host_cbw.dDataLength = length;
+	host_cbw.bmFlags = in?CBW_DIRECTION_IN:0;
+	host_cbw.bCBLength = cb_length;
+	memcpy(host_cbw.CB, cb, cb_length);
+
+	host_in_length = 0;
+	host_csw_seen = 0;
+	host_out_sent = 0;
+	host_cbw_ns = bus_send(1);
+	host_cbw_pending = 1;
+
+	for (;;)
+	{
+		t = spisim_ns;
+		MSC_task();
+		disk_ns += spisim_ns - t;
+
+		// the CSW is in once the bus has delivered it
+		if (host_csw_seen && (bus_free_ns <= spisim_ns))
+			break;
+
+		// the host clears a halt a frame after it sees it
+		if (in_halted || out_halted)
+		{
+			spisim_ns += 1000000;
+			if (in_halted)
+			{
+				usb_ep_unstall(MSC_EP_IN);
+				MSC_clearHalt(MSC_EP_IN);
+			}
+			if (out_halted)
+			{
+				usb_ep_unstall(MSC_EP_OUT);
+				MSC_clearHalt(MSC_EP_OUT);
+			}
+			continue;
+		}
+
+		next = bus_next();
+		if (next == 0)
+		{
+			fprintf(stderr, "command %02x: stuck in stage %d\n", cb[0], stage);
+			return -1;
+		}
+		// on to it, with whatever has landed by then
+		spisim_ns = next;
+		in_dma_poll();
+		out_ring_fill();
+	}
+
+	if ((host_csw.dTag != host_cbw.dTag) || (host_in_length != (in?(length - host_csw.dDataResidue):0) + sizeof(MSC_CSW)))
+	{
+		fprintf(stderr, "command %02x: bad CSW\n", cb[0]);
+		return -1;
+	}
+	return host_csw.bStatus;
+}
+
+// time and bytes for each kind of command
+typedef struct
+{
+	const char *name;
+	unsigned commands;
+	uint64_t bytes;
+	uint64_t ns;
+	uint64_t disk_ns;
+} replay_stats;
+
+static replay_stats stats[] =
+{
+	{ "read" }, { "write" }, { "other" },
+};
+
+static int replay(const char *line)
+{
+	uint8_t cb[16];
+	char op[16];
+	unsigned lba = 0, count = 0;
+	uint32_t length = 0;
+	uint8_t in = 1;
+	replay_stats *s = &stats[2];
+	uint64_t t = spisim_ns, d = disk_ns;
+	uint32_t i;
+	int r;
+
+	if ((sscanf(line, "%15s %u %u", op, &lba, &count) < 1) || (op[0] == '#'))
+		return 0;
+
+	memset(cb, 0, sizeof(cb));
+	if ((strcmp(op, "read") == 0) || (strcmp(op, "write") == 0))
+	{
+		if ((count == 0) || (count > HOST_MAX_BLOCKS))
+		{
+			fprintf(stderr, "%s: 1 to %d blocks\n", line, HOST_MAX_BLOCKS);
+			return 1;
+		}
+		in = (op[0] == 'r');
+		s = &stats[in?0:1];
+		cb[0] = in?SCSI_READ10:SCSI_WRITE10;
+		put_be32(&cb[2], lba);
+		cb[7] = count >> 8;
+		cb[8] = count;
+		length = count * MSC_BLOCK_SIZE;
+		if (in == 0)
+			for (i = 0; i < length; i++)
+				host_out[i] = rand();
+	}
+	else if (strcmp(op, "inquiry") == 0)
+	{
+		cb[0] = SCSI_INQUIRY;
+		cb[4] = length = 36;
+	}
+	else if (strcmp(op, "ready") == 0)
+		cb[0] = SCSI_TEST_UNIT_READY;
+	else if (strcmp(op, "sense") == 0)
+	{
+		cb[0] = SCSI_REQUEST_SENSE;
+		cb[4] = length = 18;
+	}
+	else if (strcmp(op, "capacity") == 0)
+	{
+		cb[0] = SCSI_READ_CAPACITY;
+		length = 8;
+	}
+	else if (strcmp(op, "sync") == 0)
+		cb[0] = SCSI_SYNCHRONIZE_CACHE10;
+	else if (strcmp(op, "eject") == 0)
+	{
+		cb[0] = SCSI_START_STOP_UNIT;
+		cb[4] = 2;
+	}
+	else
+	{
+		fprintf(stderr, "%s: unknown command\n", line);
+		return 1;
+	}
+
+	// a failed command is worth replaying on from, a broken transport isn't
+	r = host_command(cb, (cb[0] < 0x20)?6:10, length, in);
+	if (r < 0)
+		return 1;
+	if (r)
+	{
+		printf("%s: %s\n", line, (r == CSW_PHASE_ERROR)?"phase error":"failed");
+		return 0;
+	}
+
+	if ((cb[0] == SCSI_READ10) && memcmp(host_in, &card[lba * MSC_BLOCK_SIZE], length))
+	{
+		fprintf(stderr, "read %u %u: data differs from the card\n", lba, count);
+		return 1;
+	}
+	if ((cb[0] == SCSI_WRITE10) && memcmp(host_out, &card[lba * MSC_BLOCK_SIZE], length))
+	{
+		fprintf(stderr, "write %u %u: card differs from the data\n", lba, count);
+		return 1;
+	}
+	if (cb[0] == SCSI_READ_CAPACITY)
+		printf("capacity: %u blocks\n", get_be32(host_in) + 1);
+	if (cb[0] == SCSI_REQUEST_SENSE)
+		printf("sense: key %x asc %02x\n", host_in[2], host_in[12]);
+
+	s->commands++;
+	s->bytes += length;
+	s->ns += spisim_ns - t;
+	s->disk_ns += disk_ns - d;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *name = NULL;
+	const char *script = NULL;
+	unsigned kbytes = 256;
+	char line[80];
+	unsigned i;
+
+	for (i = 1; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "-s") == 0) && (i + 1 < argc))
+			kbytes = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-p") == 0)
+			no_dma = 1;
+		else if (name == NULL)
+			name = argv[i];
+		else
+			script = argv[i];
+	}
+	if (name == NULL)
+	{
+		fprintf(stderr, "usage: %s [-p] [-s kbytes] card.img [script]\n", argv[0]);
+		return 1;
+	}
+
+	if (card_load(name))
+		return 1;
+	SDCard_init(P0_9, P0_8, P0_7, P0_6);
+	if (SDCard_disk_initialize())
+	{
+		fprintf(stderr, "card didn't come up\n");
+		return 1;
+	}
+
+	MSC_init();
+	MSC_configure();
+
+	if (script)
+	{
+		FILE *f = fopen(script, "r");
+
+		if (f == NULL)
+		{
+			perror(script);
+			return 1;
+		}
+		while (fgets(line, sizeof(line), f))
+		{
+			line[strcspn(line, "\r\n")] = 0;
+			if (replay(line))
+				return 1;
+		}
+		fclose(f);
+	}
+	else
+	{
+		const char *start[] = { "inquiry", "ready", "capacity", "read 0 8" };
+		unsigned blocks = kbytes * 2;
+
+		for (i = 0; i < sizeof(start) / sizeof(start[0]); i++)
+			if (replay(start[i]))
+				return 1;
+		for (i = 0; i < blocks; i += 128)
+		{
+			snprintf(line, sizeof(line), "write %u %u", 2048 + i, (blocks - i < 128)?(blocks - i):128);
+			if (replay(line))
+				return 1;
+		}
+		if (replay("sync"))
+			return 1;
+		for (i = 0; i < blocks; i += 128)
+		{
+			snprintf(line, sizeof(line), "read %u %u", 2048 + i, (blocks - i < 128)?(blocks - i):128);
+			if (replay(line))
+				return 1;
+		}
+		if (replay("eject"))
+			return 1;
+	}
+
+	printf("%-8s %8s %9s %9s %9s %8s\n", "", "commands", "bytes", "ms", "disk ms", "kB/s");
+	for (i = 0; i < sizeof(stats) / sizeof(stats[0]); i++)
+		if (stats[i].commands)
+			printf("%-8s %8u %9llu %9.1f %9.1f %8.0f\n", stats[i].name, stats[i].commands,
+				(unsigned long long) stats[i].bytes, stats[i].ns / 1e6, stats[i].disk_ns / 1e6,
+				stats[i].bytes * 1e6 / stats[i].ns);
+	printf("%s\n", MSC_complete()?"ejected":"still mounted");
+	return 0;
+}
+
+#endif /* ifndef __LPC17XX__ */
@@ -0,0 +1,91 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+#include "profile.h"
+
+#include "LPC17xx.h"
+
+#include "min-printf.h"
+
+/// cycle count at the end of each boot phase, read over the debug UART or DFU
+profile_table_t boot_profile;
+
+#ifdef PROFILE_USB
+profile_count_t profile_usb_read;
+profile_count_t profile_usb_write;
+
+static void profile_print_count(int fd, const char *name, profile_count_t *c)
+{
+	if (c->packets)
+		fprintf(fd, "\t%s: %lu cycles per 64 byte packet, over %lu packets\r\n", name, c->cycles / c->packets, c->packets);
+}
+#endif
+
+void profile_init()
+{
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT_CYCCNT = 0;
+	DWT_CTRL |= 1;
+
+	boot_profile.core_clock = SystemCoreClock;
+	boot_profile.count = 0;
+	profile_mark("start");
+}
+
+void profile_mark(const char *name)
+{
+	uint32_t now = DWT_CYCCNT;
+	int i;
+
+	if (boot_profile.count >= PROFILE_MARKS)
+		return;
+
+	profile_mark_t *m = &boot_profile.mark[boot_profile.count++];
+	m->cycles = now;
+	for (i = 0; (i < PROFILE_NAME_LENGTH - 1) && name[i]; i++)
+		m->name[i] = name[i];
+	for (; i < PROFILE_NAME_LENGTH; i++)
+		m->name[i] = 0;
+}
+
+// to the debug UART (fd 0, like printf) or the CDC console. Cycles are
+// converted at the clock they were counted at
+void profile_print(int fd)
+{
+	uint32_t mhz = boot_profile.core_clock / 1000000;
+	uint32_t i;
+
+	fprintf(fd, "Boot profile:\r\n");
+	for (i = 1; i < boot_profile.count; i++)
+	{
+		fprintf(fd, "\t%s: %luus, done at %luus\r\n", boot_profile.mark[i].name,
+			(boot_profile.mark[i].cycles - boot_profile.mark[i - 1].cycles) / mhz,
+			boot_profile.mark[i].cycles / mhz);
+	}
+#ifdef PROFILE_USB
+	profile_print_count(fd, "usb read", &profile_usb_read);
+	profile_print_count(fd, "usb write", &profile_usb_write);
+#endif
+}
@@ -0,0 +1,52 @@
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+#include <stdint.h>
+
+// DWT cycle counter, which this CMSIS version doesn't describe
+#define DWT_CTRL	(*(volatile uint32_t *) 0xE0001000)
+#define DWT_CYCCNT	(*(volatile uint32_t *) 0xE0001004)
+
+#define PROFILE_MARKS		16
+#define PROFILE_NAME_LENGTH	12
+
+typedef struct
+__attribute__ ((packed))
+{
+	uint32_t	cycles;		// DWT_CYCCNT at the end of the phase
+	char		name[PROFILE_NAME_LENGTH];
+} profile_mark_t;
+
+typedef struct
+__attribute__ ((packed))
+{
+	uint32_t	core_clock;	// to turn cycles into time
+	uint32_t	count;
+	profile_mark_t	mark[PROFILE_MARKS];
+} profile_table_t;
+
+extern profile_table_t boot_profile;
+
+#ifdef PROFILE_USB
+// DWT cycles spent copying 64 byte packets through the USB FIFOs
+typedef struct
+{
+	uint32_t	packets;
+	uint32_t	cycles;
+} profile_count_t;
+
+extern profile_count_t profile_usb_read;
+extern profile_count_t profile_usb_write;
+
+static inline void profile_count(profile_count_t *c, uint32_t start)
+{
+	c->cycles += DWT_CYCCNT - start;
+	c->packets++;
+}
+#endif
+
+void profile_init(void);
+void profile_mark(const char *name);
+void profile_print(int fd);
+
+#endif /* _PROFILE_H */
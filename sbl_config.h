@@ -64,14 +64,32 @@
 /*
  * CodeRed - change FLASH_BUF_SIZE from 256 to 512 to match buffer
  * size used by SCSI layer of LPCUSB
+ *
+ * Now 4096, the largest block COPY_RAM_TO_FLASH accepts. Every sector is a
+ * multiple of this, so a page never straddles a sector boundary.
  */
 
 #define SECTOR_START(sector)	((sector < 16)?( sector * 0x1000)         :( (sector - 14) * 0x8000)          )
 #define SECTOR_END(sector)		((sector < 16)?((sector * 0x1000) + 0xFFF):(((sector - 14) * 0x8000) + 0x7FFF))
 
-#define FLASH_BUF_SIZE 512
+#define FLASH_BUF_SIZE 4096
+#define FLASH_SECTOR_PAGES (0x8000 / FLASH_BUF_SIZE)
+
+/*
+ * sbl_iap.c parks unchanged pages here while it erases the sector they are
+ * in, and delta.c builds sectors here. Firmware can't live in it, so user
+ * flash stops in front of it (userom in the linker scripts too).
+ */
+#define FLASH_SCRATCH_SECTOR MAX_USER_SECTOR
+
+/*
+ * Worst case IAP timings from the LPC17xx datasheet, used to tell a DFU host
+ * how long to wait. Programming is specified per 256 bytes.
+ */
+#define FLASH_ERASE_MS		105
+#define FLASH_PROG_MS		(((FLASH_BUF_SIZE / 256) * 105 + 99) / 100)
 #define USER_FLASH_START SECTOR_START(USER_START_SECTOR)
-#define USER_FLASH_END	 SECTOR_END(MAX_USER_SECTOR)
+#define USER_FLASH_END	 (SECTOR_START(FLASH_SCRATCH_SECTOR) - 1)
 #define USER_FLASH_SIZE  ((USER_FLASH_END - USER_FLASH_START) + 1)
 #define MAX_FLASH_SECTOR 30
 
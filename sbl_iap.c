@@ -18,6 +18,9 @@
  * *********************************************************************/
 
 // #include "type.h"
+#include <stdint.h>
+#include <string.h>
+
 #include "sbl_iap.h"
 #include "sbl_config.h"
 #include "LPC17xx.h"
@@ -50,71 +53,345 @@ SECTOR_27_END,SECTOR_28_END,SECTOR_29_END										 };
 unsigned param_table[5];
 unsigned result_table[5];
 
-char flash_buf[FLASH_BUF_SIZE];
+// pages in front of a sector's first difference that fit in flash_keep.
+// More than that go to the scratch sector while the sector is erased
+#define FLASH_KEEP_PAGES 4
+
+// the page being staged, and the pages being kept. None of it is in local
+// RAM, and most of AHB bank 0 is left for DMA buffers
+static char flash_page[FLASH_BUF_SIZE] __attribute__ ((section(".ahb_sram_bank0"), aligned(4)));
+static char flash_keep[FLASH_KEEP_PAGES][FLASH_BUF_SIZE] __attribute__ ((section(".ahb_sram_bank1"), aligned(4)));
 
 unsigned * flash_address = 0;
 unsigned byte_ctr = 0;
 
+// sector the last page went to, and whether we have erased it yet. A sector
+// is left alone until one of its pages turns out to differ from flash
+static unsigned sector_number = 0;
+static unsigned sector_erased = 0;
+static unsigned last_page = 0;
+
+unsigned flash_sectors_written = 0;
+unsigned flash_sectors_skipped = 0;
+
+// called before each IAP erase or program call, so the caller can start DMA
+// that runs while the CPU is tied up in IAP
+static void (*flash_hook)(void) = 0;
+
 
 void write_data(unsigned cclk,unsigned flash_address,unsigned * flash_data_buf, unsigned count);
-void find_erase_prepare_sector(unsigned cclk, unsigned flash_address);
 void erase_sector(unsigned start_sector,unsigned end_sector,unsigned cclk);
 void prepare_sector(unsigned start_sector,unsigned end_sector,unsigned cclk);
 void iap_entry(unsigned param_tab[],unsigned result_tab[]);
 
-unsigned write_flash(unsigned * dst, char * src, unsigned no_of_bytes)
+unsigned sector_of(unsigned address)
 {
 	unsigned i;
 
-	if (flash_address == 0)
+	for(i=USER_START_SECTOR;i<=MAX_USER_SECTOR;i++)
 	{
-		/* Store flash start address */
-		flash_address = (unsigned *)dst;
+		if (address <= SECTOR_END(i))
+			return i;
 	}
+	return MAX_USER_SECTOR;
+}
 
-	for( i = 0;i<no_of_bytes;i++ )
+// word compare against flash, which is memory mapped
+static int flash_matches(unsigned address, char * data, unsigned count)
+{
+	unsigned *f = FLASH_MAP(address);
+	unsigned *d = (unsigned *) data;
+
+	for (count /= 4; count; count--)
 	{
-		flash_buf[(byte_ctr+i)] = *(src+i);
+		if (*f++ != *d++)
+			return 0;
 	}
-	byte_ctr = byte_ctr + no_of_bytes;
+	return 1;
+}
+
+void flash_set_hook(void (*hook)(void))
+{
+	flash_hook = hook;
+}
+
+// one PREPARE and one COPY_RAM_TO_FLASH for the whole page. The hook goes
+// first, so whatever DMA it starts runs while the copy has the CPU
+static unsigned program_page(unsigned sector, unsigned page, char * data)
+{
+	if (flash_hook)
+		flash_hook();
+
+	__disable_irq();
+	prepare_sector(sector,sector,SystemCoreClock/1000);
+	__enable_irq();
+	if(result_table[0] != CMD_SUCCESS)
+		return result_table[0];
+
+	write_data(SystemCoreClock/1000,page,(unsigned *)data,FLASH_BUF_SIZE);
+	return result_table[0];
+}
 
-	if( byte_ctr == FLASH_BUF_SIZE)
+// like program_page, the hook goes first so its DMA runs during the erase
+static unsigned clear_sector(unsigned sector)
+{
+	if (flash_hook)
+		flash_hook();
+
+	__disable_irq();
+	prepare_sector(sector,sector,SystemCoreClock/1000);
+	erase_sector(sector,sector,SystemCoreClock/1000);
+	__enable_irq();
+	return result_table[0];
+}
+
+// too many pages to keep in RAM: copy them to the scratch sector, unless
+// it has them already because delta.c built this sector there
+static unsigned spill(unsigned sector, unsigned count)
+{
+	unsigned i, r;
+
+	if (flash_matches(SECTOR_START(sector), FLASH_MAP(SECTOR_START(FLASH_SCRATCH_SECTOR)), count * FLASH_BUF_SIZE))
+		return(CMD_SUCCESS);
+
+	if ((r = clear_sector(FLASH_SCRATCH_SECTOR)) != CMD_SUCCESS)
+		return r;
+
+	for (i = 0; i < count; i++)
 	{
-		/* We have accumulated enough bytes to trigger a flash write */
-		find_erase_prepare_sector(SystemCoreClock/1000, (unsigned)flash_address);
-		if(result_table[0] != CMD_SUCCESS)
-			return result_table[0];
-
-		write_data(SystemCoreClock/1000,(unsigned)flash_address,(unsigned *)flash_buf,FLASH_BUF_SIZE);
-		if(result_table[0] != CMD_SUCCESS)
-			return result_table[0];
-
-		/* Reset byte counter and flash address */
-		byte_ctr = 0;
-		flash_address = 0;
+		memcpy(flash_keep[0], FLASH_MAP(SECTOR_START(sector) + i * FLASH_BUF_SIZE), FLASH_BUF_SIZE);
+		if ((r = program_page(FLASH_SCRATCH_SECTOR, SECTOR_START(FLASH_SCRATCH_SECTOR) + i * FLASH_BUF_SIZE, flash_keep[0])) != CMD_SUCCESS)
+			return r;
 	}
 	return(CMD_SUCCESS);
 }
 
-void find_erase_prepare_sector(unsigned cclk, unsigned flash_address)
+static unsigned write_page(int last)
 {
-    unsigned i;
+	unsigned page = (uintptr_t) flash_address;
+	unsigned sector = sector_of(page);
+	unsigned keep = (page - SECTOR_START(sector)) / FLASH_BUF_SIZE;
+	unsigned i, r;
+	char * buf;
+
+	/* Reset byte counter and flash address */
+	byte_ctr = 0;
+	flash_address = 0;
+
+	// a new sector, or the host started over
+	if ((sector != sector_number) || (page <= last_page))
+	{
+		sector_number = sector;
+		sector_erased = 0;
+	}
+	last_page = page;
 
-    __disable_irq();
-    for(i=USER_START_SECTOR;i<=MAX_USER_SECTOR;i++)
-    {
-        if(flash_address < SECTOR_END(i))
-        {
-            if( flash_address == SECTOR_START(i))
-            {
-                prepare_sector(i,i,cclk);
-                erase_sector(i,i,cclk);
-            }
-            prepare_sector(i,i,cclk);
-            break;
-        }
-    }
-    __enable_irq();
+	if (sector_erased == 0)
+	{
+		// the scratch sector is erased the first time it's written, so
+		// nothing in it is ever kept or compared
+		if (sector == FLASH_SCRATCH_SECTOR)
+			keep = 0;
+		else if (flash_matches(page, flash_page, FLASH_BUF_SIZE))
+		{
+			if (last || (page + FLASH_BUF_SIZE > SECTOR_END(sector)))
+				flash_sectors_skipped++;
+			return(CMD_SUCCESS);
+		}
+
+		// first difference. The pages in front of this one are already right
+		// in flash, so copy them out to put them back after the erase
+		if (keep > FLASH_KEEP_PAGES)
+		{
+			if ((r = spill(sector, keep)) != CMD_SUCCESS)
+				return r;
+		}
+		else
+		{
+			for (i = 0; i < keep; i++)
+				memcpy(flash_keep[i], FLASH_MAP(SECTOR_START(sector) + i * FLASH_BUF_SIZE), FLASH_BUF_SIZE);
+		}
+
+		if ((r = clear_sector(sector)) != CMD_SUCCESS)
+			return r;
+
+		sector_erased = 1;
+		flash_sectors_written++;
+
+		for (i = 0; i < keep; i++)
+		{
+			buf = flash_keep[i];
+			if (keep > FLASH_KEEP_PAGES)
+			{
+				buf = flash_keep[0];
+				memcpy(buf, FLASH_MAP(SECTOR_START(FLASH_SCRATCH_SECTOR) + i * FLASH_BUF_SIZE), FLASH_BUF_SIZE);
+			}
+			if ((r = program_page(sector, SECTOR_START(sector) + i * FLASH_BUF_SIZE, buf)) != CMD_SUCCESS)
+				return r;
+		}
+	}
+
+	return program_page(sector, page, flash_page);
+}
+
+/*
+ * Collect data into whole FLASH_BUF_SIZE pages so every page costs exactly one
+ * PREPARE and one COPY_RAM_TO_FLASH call. Data must arrive in ascending
+ * address order; a write outside the page being staged flushes it first.
+ *
+ * Pages identical to what is already in flash are not written, and a sector
+ * is only erased once a page in it differs, so reflashing a mostly unchanged
+ * image only touches the sectors that changed.
+ */
+unsigned write_flash(unsigned * dst, char * src, unsigned no_of_bytes)
+{
+	unsigned i, r;
+	char * buf;
+
+	// user flash, or the scratch sector behind it for delta.c
+	if (no_of_bytes && (((uintptr_t) dst < USER_FLASH_START) || ((uintptr_t) dst > SECTOR_END(FLASH_SCRATCH_SECTOR)) || (no_of_bytes > SECTOR_END(FLASH_SCRATCH_SECTOR) + 1 - (uintptr_t) dst)))
+		return(DST_ADDR_ERROR);
+
+	while (no_of_bytes)
+	{
+		unsigned page = ((uintptr_t) dst) & ~(FLASH_BUF_SIZE - 1);
+		unsigned offset = ((uintptr_t) dst) - page;
+		unsigned n = FLASH_BUF_SIZE - offset;
+
+		if ((flash_address != 0) && ((uintptr_t) flash_address != page))
+		{
+			if ((r = flush_flash()) != CMD_SUCCESS)
+				return r;
+		}
+
+		buf = flash_page;
+
+		if (flash_address == 0)
+		{
+			/* Store page start address, unwritten bytes stay erased */
+			flash_address = (unsigned *) (uintptr_t) page;
+			for( i = 0;i<FLASH_BUF_SIZE;i++ )
+				buf[i] = 0xFF;
+		}
+
+		if (n > no_of_bytes)
+			n = no_of_bytes;
+
+		for( i = 0;i<n;i++ )
+		{
+			buf[(offset+i)] = *(src+i);
+		}
+		byte_ctr = offset + n;
+
+		src += n;
+		dst = (unsigned *) (((uintptr_t) dst) + n);
+		no_of_bytes -= n;
+
+		if( byte_ctr == FLASH_BUF_SIZE)
+		{
+			/* We have accumulated a whole page, trigger a flash write */
+			if ((r = write_page(0)) != CMD_SUCCESS)
+				return r;
+		}
+	}
+	return(CMD_SUCCESS);
+}
+
+/* Program whatever is left in a partially filled page, padded with 0xFF */
+unsigned flush_flash(void)
+{
+	if (flash_address == 0)
+		return(CMD_SUCCESS);
+
+	return write_page(1);
+}
+
+/* Drop a partially filled page without programming it, and forget what was
+   erased, for a download that starts over after one was abandoned */
+void flash_discard(void)
+{
+	flash_address = 0;
+	byte_ctr = 0;
+	sector_number = 0;
+	sector_erased = 0;
+	last_page = 0;
+}
+
+// guess at the IAP time for a page, given some of the data going into it.
+// If that data is already in flash the page will most likely be skipped.
+// With no data, assume the page changes
+static unsigned page_cost(unsigned page, unsigned offset, char * data, unsigned count)
+{
+	unsigned sector = sector_of(page);
+	unsigned keep;
+
+	if ((sector == sector_number) && sector_erased && (page > last_page))
+		return FLASH_PROG_MS;
+
+	if (sector == FLASH_SCRATCH_SECTOR)
+		return FLASH_ERASE_MS + FLASH_PROG_MS;
+
+	if (data && ((offset | count) & 3) == 0 && flash_matches(page + offset, data, count))
+		return 0;
+
+	keep = (page - SECTOR_START(sector)) / FLASH_BUF_SIZE;
+
+	// assume a spill has to copy the pages to scratch first
+	if (keep > FLASH_KEEP_PAGES)
+		return (2 * FLASH_ERASE_MS) + ((2 * keep) + 1) * FLASH_PROG_MS;
+
+	return FLASH_ERASE_MS + (keep + 1) * FLASH_PROG_MS;
+}
+
+/* Milliseconds of IAP work that write_flash(dst, src, no_of_bytes) will do.
+   src may be 0 for data that isn't known yet */
+unsigned write_flash_cost(unsigned * dst, char * src, unsigned no_of_bytes)
+{
+	unsigned ms = 0;
+	unsigned erased = ~0;	// sector this estimate has already erased
+	unsigned page = ((uintptr_t) dst) & ~(FLASH_BUF_SIZE - 1);
+	unsigned offset = ((uintptr_t) dst) - page;
+	unsigned end = ((uintptr_t) dst) + no_of_bytes;
+
+	if (no_of_bytes == 0)
+		return 0;
+
+	if ((flash_address != 0) && ((uintptr_t) flash_address != page))
+		ms += flush_flash_cost();
+
+	for (; (page + FLASH_BUF_SIZE) <= end; page += FLASH_BUF_SIZE)
+	{
+		unsigned n = FLASH_BUF_SIZE - offset;
+		if (n > no_of_bytes)
+			n = no_of_bytes;
+		// once erased, the rest of its pages only need programming
+		if (sector_of(page) == erased)
+			ms += FLASH_PROG_MS;
+		else
+		{
+			unsigned c = page_cost(page, offset, src, n);
+			if (c >= FLASH_ERASE_MS)
+				erased = sector_of(page);
+			ms += c;
+		}
+		if (src)
+			src += n;
+		no_of_bytes -= n;
+		offset = 0;
+	}
+
+	return ms;
+}
+
+/* Milliseconds of IAP work that flush_flash() will do */
+unsigned flush_flash_cost(void)
+{
+	unsigned page = (uintptr_t) flash_address;
+
+	if (flash_address == 0)
+		return 0;
+
+	return page_cost(page, 0, flash_page, FLASH_BUF_SIZE);
 }
 
 void write_data(unsigned cclk,unsigned flash_address,unsigned * flash_data_buf, unsigned count)
@@ -122,7 +399,7 @@ void write_data(unsigned cclk,unsigned flash_address,unsigned * flash_data_buf,
 	__disable_irq();
     param_table[0] = COPY_RAM_TO_FLASH;
     param_table[1] = flash_address;
-    param_table[2] = (unsigned)flash_data_buf;
+    param_table[2] = (uintptr_t)flash_data_buf;
     param_table[3] = count;
     param_table[4] = cclk;
     iap_entry(param_table,result_table);
@@ -169,11 +446,11 @@ void execute_user_code(void)
 
 	// Load contents of second word of user flash - the reset handler address
 	// in the applications vector table
-	p = (unsigned *)(USER_FLASH_START +4);
+	p = FLASH_MAP(USER_FLASH_START +4);
 
 	// Set user_code_entry to be the address contained in that second word
 	// of user flash
-	user_code_entry = (void *) *p;
+	user_code_entry = (void *) (uintptr_t) *p;
 
 	// Display message to RDB1768 LCD
 // 	LCD_PrintString2Terminal ("Running user\napp from flash.\n", LCD_TERMINAL_NoNL,COLOR_BLUE, COLOR_YELLOW);
@@ -210,7 +487,7 @@ int user_code_present(void)
  * then the contents is deemed a 'valid' image.
  */
 	checksum = 0;
-	pmem = (unsigned *)USER_FLASH_START;
+	pmem = FLASH_MAP(USER_FLASH_START);
 	for (i = 0; i <= 7; i++) {
 		checksum += *pmem;
 		pmem++;
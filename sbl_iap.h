@@ -17,8 +17,17 @@
 extern const unsigned sector_start_map[];
 extern const unsigned sector_end_map[];
 
+extern unsigned flash_sectors_written;
+extern unsigned flash_sectors_skipped;
+
 
 unsigned write_flash(unsigned * dst, char * src, unsigned no_of_bytes);
+unsigned flush_flash(void);
+void flash_discard(void);
+unsigned write_flash_cost(unsigned * dst, char * src, unsigned no_of_bytes);
+unsigned flush_flash_cost(void);
+unsigned sector_of(unsigned address);
+void flash_set_hook(void (*hook)(void));
 void execute_user_code(void);
 int user_code_present(void);
 void erase_user_flash(void);
@@ -38,6 +47,12 @@ typedef enum
 }IAP_Command_Code;
 
 #define CMD_SUCCESS 0
+#define DST_ADDR_ERROR 3
 #define IAP_ADDRESS 0x1FFF1FF1
 
+// flash as the CPU reads it. iapsim.c points this at its simulated flash
+#ifndef FLASH_MAP
+#define FLASH_MAP(address)	((void *) (address))
+#endif
+
 #endif /* _SBL_IAP_H */
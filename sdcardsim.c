@@ -0,0 +1,338 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+/*
+ * An SD card in SPI mode, backed by an image file, for tools that run the
+ * real SDCard.c on Linux. It answers the driver through spisim.c, as an
+ * SDHC card with a 25MHz TRAN_SPEED, to CMD0, 8, 55, ACMD41, 58, 9, 16,
+ * 17, 18, 12, 24 and 25. The image is held in memory, writes don't go back
+ * to the file.
+ *
+ * Each read command waits card_access_us before its first data token, and
+ * blocks of a CMD18 then follow each other with a byte of gap. Each block
+ * written keeps the card busy for card_write_us, and the end of a write
+ * command, a CMD24 block or CMD25's stop token, for card_program_us more.
+ * The defaults are in the range cards take.
+ *
+ * Include it, it has no main():
+ * #include "sdcardsim.c"
+ * card_load("card.img");
+ */
+
+#ifndef __LPC17XX__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spisim.c"
+#include "SDCard.c"
+
+#undef fprintf
+
+static uint8_t *card;
+static uint32_t card_blocks;
+
+static unsigned card_access_us = 100;
+static unsigned card_write_us = 50;
+static unsigned card_program_us = 1000;
+
+unsigned card_commands;
+
+static uint8_t card_selected;
+static uint8_t card_idle = 1;
+static uint8_t card_app;			// last command was CMD55
+static unsigned card_op_conds;		// ACMD41s seen
+
+static uint8_t card_cmd[6];
+static int card_cmd_length;
+
+// bytes queued for MISO
+static uint8_t card_out[1 + 1 + 512 + 2 + 8];
+static int card_out_length, card_out_next;
+
+// read in progress: next block, how many to go (-1 for CMD18), and when the
+// card has it ready
+static uint32_t card_read_block;
+static int card_read_count;
+static uint64_t card_read_ready_ns;
+
+// write in progress: SDCMD_WRITE_BLOCK or _MULTIPLE_BLOCK, next block, and
+// bytes of the data block so far, -1 between blocks
+static uint8_t card_write;
+static uint32_t card_write_block;
+static int card_write_fill = -1;
+static uint8_t card_write_data[512];
+
+static uint64_t card_busy_ns;
+
+static void card_queue(uint8_t b)
+{
+	card_out[card_out_length++] = b;
+}
+
+// a data block with its start token and CRC
+static void card_queue_data(const uint8_t *data, int length)
+{
+	uint16_t crc = SDCard__crc16(data, length);
+
+	card_queue(0xFE);
+	memcpy(&card_out[card_out_length], data, length);
+	card_out_length += length;
+	card_queue(crc >> 8);
+	card_queue(crc);
+}
+
+static void card_set_bits(uint8_t *data, int msb, int lsb, uint32_t value)
+{
+	int i;
+
+	for (i = 0; i <= msb - lsb; i++)
+	{
+		int position = lsb + i;
+		uint8_t *byte = &data[15 - (position >> 3)];
+
+		*byte &= ~(1 << (position & 7));
+		*byte |= ((value >> i) & 1) << (position & 7);
+	}
+}
+
+static void card_command()
+{
+	uint8_t cmd = card_cmd[0] & 0x3F;
+	uint32_t arg = (card_cmd[1] << 24) | (card_cmd[2] << 16) | (card_cmd[3] << 8) | card_cmd[4];
+	uint8_t r1 = card_idle?R1_IDLE_STATE:0;
+	uint8_t csd[16];
+	int acmd = card_app;
+
+	card_commands++;
+	card_app = 0;
+	card_out_length = card_out_next = 0;
+	// NCR, a byte before the response
+	card_queue(0xFF);
+
+	switch (cmd)
+	{
+		case SDCMD_GO_IDLE_STATE:
+			card_idle = 1;
+			card_read_count = 0;
+			card_write = 0;
+			card_queue(R1_IDLE_STATE);
+			return;
+		case SDCMD_SEND_IF_COND:
+			card_queue(r1);
+			card_queue(0);
+			card_queue(0);
+			card_queue(card_cmd[3] & 0x0F);
+			card_queue(card_cmd[4]);
+			return;
+		case SDCMD_APP_CMD:
+			card_app = 1;
+			card_queue(r1);
+			return;
+		case SD_ACMD_SD_SEND_OP_COND:
+			if (!acmd)
+				break;
+			// cards take a few goes to power up
+			if (++card_op_conds >= 3)
+				card_idle = 0;
+			card_queue(card_idle?R1_IDLE_STATE:0);
+			return;
+		case 58:
+			// OCR: powered up, high capacity, 2.7-3.6V
+			card_queue(r1);
+			card_queue(card_idle?0x40:0xC0);
+			card_queue(0xFF);
+			card_queue(0x80);
+			card_queue(0x00);
+			return;
+		case SDCMD_SEND_CSD:
+			memset(csd, 0, sizeof(csd));
+			card_set_bits(csd, 127, 126, 1);
+			card_set_bits(csd, 103, 96, 0x32);
+			card_set_bits(csd, 83, 80, 9);
+			card_set_bits(csd, 69, 48, (card_blocks >= 1024)?(card_blocks / 1024 - 1):0);
+			card_queue(r1);
+			card_queue(0xFF);
+			card_queue_data(csd, sizeof(csd));
+			return;
+		case SDCMD_SET_BLOCKLEN:
+			card_queue(r1 | ((arg == 512)?0:R1_PARAMETER_ERROR));
+			return;
+		case SDCMD_READ_SINGLE_BLOCK:
+		case SDCMD_READ_MULTIPLE_BLOCK:
+		case SDCMD_WRITE_BLOCK:
+		case SDCMD_WRITE_MULTIPLE_BLOCK:
+			if (card_idle || (arg >= card_blocks))
+			{
+				card_queue(r1 | R1_ADDRESS_ERROR);
+				return;
+			}
+			card_queue(r1);
+			if ((cmd == SDCMD_WRITE_BLOCK) || (cmd == SDCMD_WRITE_MULTIPLE_BLOCK))
+			{
+				card_write = cmd;
+				card_write_block = arg;
+				card_write_fill = -1;
+				return;
+			}
+			card_read_block = arg;
+			card_read_count = (cmd == SDCMD_READ_SINGLE_BLOCK)?1:-1;
+			card_read_ready_ns = spisim_ns + card_access_us * 1000ULL;
+			return;
+		case SDCMD_STOP_TRANSMISSION:
+			// a stuff byte, then R1b
+			card_read_count = 0;
+			card_write = 0;
+			card_queue(0xFF);
+			card_queue(r1);
+			card_queue(0x00);
+			card_queue(0x00);
+			return;
+	}
+	card_queue(r1 | R1_ILLEGAL_COMMAND);
+}
+
+// a data block has come in, answer it with a data response token
+static void card_written()
+{
+	uint64_t busy = card_write_us;
+
+	card_out_length = card_out_next = 0;
+	if (card_write_block >= card_blocks)
+	{
+		// write error
+		card_queue(0x0D);
+		card_write = 0;
+		return;
+	}
+	memcpy(&card[card_write_block * 512], card_write_data, 512);
+	card_write_block++;
+	card_queue(0x05);
+	if (card_write == SDCMD_WRITE_BLOCK)
+	{
+		busy += card_program_us;
+		card_write = 0;
+	}
+	card_busy_ns = spisim_ns + busy * 1000;
+}
+
+static uint8_t card_byte(uint8_t mosi)
+{
+	uint8_t miso = 0xFF;
+
+	if (!card_selected)
+		return 0xFF;
+
+	if (card_out_next < card_out_length)
+		miso = card_out[card_out_next++];
+	else if (spisim_ns < card_busy_ns)
+		miso = 0x00;
+	else if (card_read_count && (spisim_ns >= card_read_ready_ns))
+	{
+		// the next block is ready, starting after this byte
+		card_out_length = card_out_next = 0;
+		card_queue_data(&card[card_read_block * 512], 512);
+		card_read_block++;
+		if ((card_read_count > 0) || (card_read_block >= card_blocks))
+			card_read_count = 0;
+	}
+
+	// data block coming in, with its CRC
+	if (card_write_fill >= 0)
+	{
+		if (card_write_fill < 512)
+			card_write_data[card_write_fill] = mosi;
+		if (++card_write_fill == 512 + 2)
+		{
+			card_write_fill = -1;
+			card_written();
+		}
+		return miso;
+	}
+
+	// tokens between blocks of a write, never mistaken for a command
+	if (card_write && (card_cmd_length == 0))
+	{
+		if (mosi == ((card_write == SDCMD_WRITE_BLOCK)?0xFE:0xFC))
+		{
+			card_write_fill = 0;
+			return miso;
+		}
+		if ((mosi == 0xFD) && (card_write == SDCMD_WRITE_MULTIPLE_BLOCK))
+		{
+			card_write = 0;
+			card_busy_ns = spisim_ns + card_program_us * 1000ULL;
+			return miso;
+		}
+	}
+
+	// commands come in whatever we are sending
+	if ((card_cmd_length == 0) && ((mosi & 0xC0) != 0x40))
+		return miso;
+	card_cmd[card_cmd_length++] = mosi;
+	if (card_cmd_length == sizeof(card_cmd))
+	{
+		card_cmd_length = 0;
+		card_command();
+	}
+	return miso;
+}
+
+static void card_pin(PinName pin, uint8_t value)
+{
+	card_selected = (value == 0);
+}
+
+// the image, as the card on the far end of spisim.c
+static int card_load(const char *name)
+{
+	FILE *f = fopen(name, "rb");
+	long size;
+
+	if (f == NULL)
+	{
+		perror(name);
+		return 1;
+	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+	card_blocks = size / 512;
+	card = malloc(size);
+	if ((card_blocks == 0) || (card == NULL) || (fread(card, 1, size, f) != size))
+	{
+		fprintf(stderr, "%s: can't load\n", name);
+		fclose(f);
+		return 1;
+	}
+	fclose(f);
+
+	spisim_device = card_byte;
+	spisim_pin = card_pin;
+	return 0;
+}
+
+#endif /* ifndef __LPC17XX__ */
@@ -0,0 +1,164 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+/*
+ * Measures reading an SD card through the real SDCard.c, against
+ * sdcardsim.c's model of a card holding an image file.
+ *
+ * The image is read through single block reads, then in runs of -n blocks
+ * (8 by default, a 4k cluster) with CMD18, then firmware.bin through FatFs
+ * the way main.c reads it, if the image has one. Everything that isn't the
+ * data asked for counts as overhead: commands, responses, waits, tokens,
+ * CRCs, and what the card sends before CMD12 takes effect. -a sets the
+ * card's access time in us.
+ *
+ * Run with:
+ * gcc -std=gnu99 -O2 -I. -Ifatfs -ICMSISv2p00_LPC17xx/inc -o sdsim sdsim.c && ./sdsim card.img
+ * ./sdsim -n 64 -a 500 card.img			longer runs, slower card
+ */
+
+#ifndef __LPC17XX__
+
+#include "sdcardsim.c"
+#include "fatfs/ff.c"
+#include "fatfs/diskio.c"
+
+// at most this much of the image is read block by block
+#define SD_BENCH_BLOCKS	2048
+
+DWORD get_fattime()
+{
+	return 0;
+}
+
+static void report(const char *what, unsigned reads, unsigned commands, uint32_t payload)
+{
+	unsigned clocked = spisim_bytes + spisim_block_bytes;
+	double ms = (spisim_ns - spisim_start_ns) / 1e6;
+
+	printf("%-16s %7u %7u %9u %9u %8.1f%% %8.1f %8.0f\n", what, reads, commands, clocked, payload,
+		100.0 * (clocked - payload) / clocked, ms, payload / ms);
+}
+
+// the image in runs of n blocks, checked against the file
+static void bench(const char *what, uint32_t blocks, int n)
+{
+	static uint8_t buffer[128 * 512];
+	unsigned reads = 0;
+	uint32_t b;
+	int r;
+
+	spisim_reset_counts();
+	card_commands = 0;
+	for (b = 0; b < blocks; b += n)
+	{
+		if (b + n > blocks)
+			n = blocks - b;
+		r = (n > 1)?SDCard_disk_read_multi(buffer, b, n):SDCard_disk_read(buffer, b);
+		if (r || memcmp(buffer, &card[b * 512], n * 512))
+		{
+			printf("%s: read of %d blocks at %u failed\n", what, n, b);
+			exit(1);
+		}
+		reads++;
+	}
+	report(what, reads, card_commands, blocks * 512);
+}
+
+// firmware.bin in FLASH_BUF_SIZE reads, like main.c
+static void bench_file()
+{
+	static uint8_t buffer[4096];
+	FATFS fat;
+	FIL file;
+	unsigned reads = 0;
+	uint32_t length = 0;
+	UINT r = sizeof(buffer);
+
+	f_mount(0, &fat);
+	spisim_reset_counts();
+	card_commands = 0;
+	if (f_open(&file, "firmware.bin", FA_READ) != FR_OK)
+	{
+		printf("no firmware.bin\n");
+		return;
+	}
+	while (r == sizeof(buffer))
+	{
+		if (f_read(&file, buffer, sizeof(buffer), &r) != FR_OK)
+		{
+			printf("firmware.bin: read failed at %u\n", length);
+			exit(1);
+		}
+		length += r;
+		reads++;
+	}
+	f_close(&file);
+	report("firmware.bin", reads, card_commands, length);
+}
+
+int main(int argc, char **argv)
+{
+	const char *name = NULL;
+	uint32_t blocks;
+	int n = 8;
+	int i;
+
+	for (i = 1; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc))
+			n = atoi(argv[++i]);
+		else if ((strcmp(argv[i], "-a") == 0) && (i + 1 < argc))
+			card_access_us = atoi(argv[++i]);
+		else
+			name = argv[i];
+	}
+	if ((name == NULL) || (n < 1) || (n > 128))
+	{
+		fprintf(stderr, "usage: %s [-n blocks] [-a us] card.img\n", argv[0]);
+		return 1;
+	}
+
+	if (card_load(name))
+		return 1;
+
+	SDCard_init(P0_9, P0_8, P0_7, P0_6);
+	spisim_reset_counts();
+	if (SDCard_disk_initialize())
+	{
+		fprintf(stderr, "card didn't come up\n");
+		return 1;
+	}
+	printf("card up in %.1fms, %u sectors at %uHz\n", (spisim_ns - spisim_start_ns) / 1e6, SDCard_disk_sectors(), spisim_hz);
+
+	blocks = (card_blocks < SD_BENCH_BLOCKS)?card_blocks:SD_BENCH_BLOCKS;
+	printf("%-16s %7s %7s %9s %9s %9s %8s %8s\n", "", "reads", "cmds", "clocked", "payload", "overhead", "ms", "kB/s");
+	bench("CMD17", blocks, 1);
+	bench("CMD18", blocks, n);
+	bench_file();
+	return 0;
+}
+
+#endif /* ifndef __LPC17XX__ */
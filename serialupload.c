@@ -0,0 +1,305 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+/*
+ * Host side of the serial upload, see upload.h for the protocol.
+ * Works on any tty, including a pty for trying things out without a board.
+ *
+ * Run with:
+ * gcc -std=gnu99 -o serialupload serialupload.c && ./serialupload /dev/ttyUSB0 firmware.bin [baud]
+ */
+
+#ifndef __LPC17XX__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/select.h>
+#include <sys/time.h>
+
+#include "upload.h"
+
+// longer than a sector erase and a page program back to back
+#define RESEND_MS	500
+// the last sector can be erased and programmed in one go before the answer
+#define FINISH_MS	3000
+#define RETRIES		10
+
+static int fd;
+
+static const uint32_t crc32_nibble[16] = {
+	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+	0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+	0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+static uint32_t crc32(uint32_t crc, const uint8_t *p, uint32_t length)
+{
+	crc = ~crc;
+	while (length--)
+	{
+		crc = (crc >> 4) ^ crc32_nibble[(crc ^  *p      ) & 15];
+		crc = (crc >> 4) ^ crc32_nibble[(crc ^ (*p >> 4)) & 15];
+		p++;
+	}
+	return ~crc;
+}
+
+static uint64_t now_ms()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void send_frame(uint8_t type, uint8_t seq, uint32_t offset, const uint8_t *payload, uint16_t length)
+{
+	uint8_t f[UPLOAD_HEADER + UPLOAD_PAYLOAD + 4];
+
+	f[0] = UPLOAD_SYNC0;
+	f[1] = UPLOAD_SYNC1;
+	f[2] = type;
+	f[3] = seq;
+	f[4] = length;
+	f[5] = length >> 8;
+	put32(&f[6], offset);
+	if (length)
+		memcpy(&f[UPLOAD_HEADER], payload, length);
+	put32(&f[UPLOAD_HEADER + length], crc32(0, &f[2], UPLOAD_HEADER - 2 + length));
+
+	if (write(fd, f, UPLOAD_HEADER + length + 4) < 0)
+	{
+		perror("write");
+		exit(1);
+	}
+}
+
+// next valid frame from the board, skipping its debug output
+static int read_frame(int timeout_ms, uint8_t *type, uint32_t *offset, uint8_t *payload)
+{
+	static uint8_t buf[4096];
+	static int used;
+	uint64_t until = now_ms() + timeout_ms;
+
+	for (;;)
+	{
+		while (used >= UPLOAD_HEADER)
+		{
+			uint16_t length = buf[4] | (buf[5] << 8);
+			int total = UPLOAD_HEADER + length + 4;
+
+			if ((buf[0] != UPLOAD_SYNC0) || (buf[1] != UPLOAD_SYNC1) || (length > 16))
+			{
+				memmove(buf, buf + 1, --used);
+				continue;
+			}
+			if (used < total)
+				break;
+			if (get32(&buf[total - 4]) != crc32(0, &buf[2], total - 6))
+			{
+				memmove(buf, buf + 1, --used);
+				continue;
+			}
+
+			*type = buf[2];
+			*offset = get32(&buf[6]);
+			*payload = length ? buf[UPLOAD_HEADER] : 0;
+			used -= total;
+			memmove(buf, buf + total, used);
+			return 1;
+		}
+
+		int64_t left = until - now_ms();
+		if (left <= 0)
+			return 0;
+
+		fd_set fds;
+		struct timeval tv = { left / 1000, (left % 1000) * 1000 };
+		FD_ZERO(&fds);
+		FD_SET(fd, &fds);
+		if (select(fd + 1, &fds, NULL, NULL, &tv) <= 0)
+			return 0;
+
+		int r = read(fd, buf + used, sizeof(buf) - used);
+		if (r <= 0)
+		{
+			perror("read");
+			exit(1);
+		}
+		used += r;
+	}
+}
+
+static speed_t speed(int baud)
+{
+	switch (baud)
+	{
+		case 115200:  return B115200;
+		case 230400:  return B230400;
+		case 460800:  return B460800;
+		case 921600:  return B921600;
+		case 1000000: return B1000000;
+		case 2000000: return B2000000;
+	}
+	fprintf(stderr, "unsupported baud rate %d\n", baud);
+	exit(1);
+}
+
+// send a control frame until it gets a reply
+static int control(uint8_t type, uint32_t offset, int timeout_ms, uint32_t *reply_offset, uint8_t *held)
+{
+	uint8_t reply;
+	for (int i = 0; i < RETRIES; i++)
+	{
+		send_frame(type, 0, offset, NULL, 0);
+		if (read_frame(timeout_ms, &reply, reply_offset, held))
+		{
+			if (reply == UPLOAD_NAK)
+			{
+				fprintf(stderr, "board refused the upload, error %d\n", *held);
+				exit(1);
+			}
+			return 1;
+		}
+	}
+	fprintf(stderr, "no answer from the board\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 3)
+	{
+		fprintf(stderr, "usage: %s <tty> <firmware.bin> [baud]\n", argv[0]);
+		return 1;
+	}
+
+	FILE *f = fopen(argv[2], "rb");
+	if (f == NULL)
+	{
+		perror(argv[2]);
+		return 1;
+	}
+	fseek(f, 0, SEEK_END);
+	uint32_t length = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	uint8_t *image = malloc(length);
+	if ((length == 0) || (fread(image, 1, length, f) != length))
+	{
+		fprintf(stderr, "can't read %s\n", argv[2]);
+		return 1;
+	}
+	fclose(f);
+
+	fd = open(argv[1], O_RDWR | O_NOCTTY);
+	if (fd < 0)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	struct termios tio;
+	if (tcgetattr(fd, &tio) == 0)
+	{
+		cfmakeraw(&tio);
+		cfsetspeed(&tio, speed((argc > 3)?atoi(argv[3]):2000000));
+		tcsetattr(fd, TCSANOW, &tio);
+		tcflush(fd, TCIOFLUSH);
+	}
+
+	uint32_t frames = (length + UPLOAD_PAYLOAD - 1) / UPLOAD_PAYLOAD;
+	uint64_t *sent = calloc(frames, sizeof(*sent));
+	uint32_t base = 0, resent = 0, offset = 0;
+	uint8_t held = 0, type;
+	uint64_t start = now_ms();
+
+	control(UPLOAD_START, length, RESEND_MS, &offset, &held);
+
+	while (offset < length)
+	{
+		// everything in the window the board doesn't have and we haven't sent lately
+		for (uint32_t n = base; (n < base + UPLOAD_WINDOW) && (n < frames); n++)
+		{
+			if ((held & (1 << (n - base))) || (sent[n] && (now_ms() - sent[n] < RESEND_MS)))
+				continue;
+			uint32_t o = n * UPLOAD_PAYLOAD;
+			if (sent[n])
+				resent++;
+			send_frame(UPLOAD_DATA, n, o, image + o, ((length - o) < UPLOAD_PAYLOAD)?(length - o):UPLOAD_PAYLOAD);
+			sent[n] = now_ms();
+		}
+
+		if (read_frame(RESEND_MS, &type, &offset, &held) == 0)
+			continue;
+		if (type == UPLOAD_NAK)
+		{
+			fprintf(stderr, "board aborted at %u, error %d\n", offset, held);
+			return 1;
+		}
+		base = offset / UPLOAD_PAYLOAD;
+
+		// the line keeps frames in order, so a hole below a held frame was lost
+		for (int i = UPLOAD_WINDOW - 1; i > 0; i--)
+		{
+			if (held & (1 << i))
+			{
+				for (int j = 0; j < i; j++)
+					if (!(held & (1 << j)) && (base + j < frames))
+						sent[base + j] = 1;
+				break;
+			}
+		}
+
+		fprintf(stderr, "\r%u/%u", offset, length);
+	}
+
+	// the board only answers this once the last page is in flash
+	do
+		control(UPLOAD_FINISH, 0, FINISH_MS, &offset, &held);
+	while (offset < length);
+
+	uint64_t ms = now_ms() - start;
+	fprintf(stderr, "\r%u bytes in %llums (%llu bytes/s), %u frames sent again\n", length, (unsigned long long) ms, (unsigned long long) (ms?(length * 1000ULL / ms):0), resent);
+
+	close(fd);
+	return 0;
+}
+
+#endif /* ifndef __LPC17XX__ */
@@ -29,17 +29,21 @@
 #include "lpc17xx_pinsel.h"
 #include "lpc17xx_ssp.h"
 #include "lpc17xx_gpio.h"
+#include "lpc17xx_gpdma.h"
+
+#include "timebase.h"
 
 #include <stdio.h>
 
 // #define SOFT_SPI
 
-uint32_t delay;
+uint32_t delay;	// soft SPI bit time, in timebase ticks
 Pin_t miso;
 Pin_t mosi;
 Pin_t sclk;
 SPI_REG *sspr;
 
+static void SPI_DMA_init(void);
 
 void SPI_init(PinName mosi, PinName miso, PinName sclk)
 {
@@ -106,47 +110,43 @@ void SPI_init(PinName mosi, PinName miso, PinName sclk)
         sspr->CR1 = SSP_MASTER_MODE;
         SPI_frequency(10000);
         sspr->CR1 |= SSP_CR1_SSP_EN;
+        SPI_DMA_init();
     }
 }
 
-void SPI_frequency(uint32_t f)
+uint32_t SPI_frequency(uint32_t f)
 {
-    // CCLK = 25MHz
+    // f = PCLK / (CPSR . [SCR + 1])
     // CPSR = 2 to 254, even only
     // CR0[8:15] (SCR, 0..255) is a further prescale
+    uint32_t pclk = CLKPWR_GetPCLK((sspr == LPC_SSP0)?CLKPWR_PCLKSEL_SSP0:CLKPWR_PCLKSEL_SSP1);
 
 //     iprintf("SPI: frequency %lu:", f);
-    delay = 25000000 / f;
-    // f = 25MHz / (CPSR . [SCR + 1])
-    // CPSR . (SCR + 1) = 25MHz / f
-    // min freq is 25MHz / (254 * 256)
+    delay = time_tick_rate() / f;
     if (sspr) {
-        if (f < 385) {
-            sspr->CPSR = 254;
-            sspr->CR0 &= 0x00FF;
-            sspr->CR0 |= 255 << 8;
-        }
-        // max freq is 25MHz / (2 * 1)
-        else if (f > 12500000) {
-            sspr->CPSR = 2;
-            sspr->CR0 &= 0x00FF;
-        }
-        else {
-            sspr->CPSR = delay & 0xFE;
-            // CPSR . (SCR + 1) = f;
-            // (SCR + 1) = f / CPSR;
-            // SCR = (f / CPSR) - 1
-            sspr->CR0 &= 0x00FF;
-            sspr->CR0 |= (((delay / sspr->CPSR) - 1) & 0xFF) << 8;
-        }
+        // smallest divider that doesn't go faster than asked
+        uint32_t div = (pclk + f - 1) / f;
+        uint32_t cpsr = 2;
+        uint32_t scr;
+
+        if (div > 254 * 256)
+            div = 254 * 256;
+        while ((cpsr * 256) < div)
+            cpsr += 2;
+        scr = ((div + cpsr - 1) / cpsr) - 1;
+
+        sspr->CPSR = cpsr;
+        sspr->CR0 &= 0x00FF;
+        sspr->CR0 |= scr << 8;
 //         iprintf(" CPSR=%lu, CR0=%lu", sspr->CPSR, sspr->CR0);
+        return pclk / (cpsr * (scr + 1));
     }
 //     iprintf("\n");
+    return f;
 }
 
 void _delay(uint32_t ticks) {
-    for (;ticks;ticks--)
-        asm volatile("nop\n\t");
+    delay_ticks(ticks);
 }
 
 uint8_t SPI_write(uint8_t data)
@@ -203,43 +203,143 @@ uint8_t SPI_write(uint8_t data)
 //        disk.end_multi_write();
 // };
 
-// bool SPI_can_DMA()
-// {
-//     return (sspr != NULL);
-// }
+// GPDMA channels for block transfers. Receive gets the higher priority
+// channel so the SSP receive FIFO can never overflow
+#define SPI_DMA_RX LPC_GPDMACH0
+#define SPI_DMA_TX LPC_GPDMACH1
+#define SPI_DMA_RX_CH 0
+#define SPI_DMA_TX_CH 1
 
-// int SPI::setup_DMA_rx(DMA_REG *dma)
-// {
-//     if (!sspr)
-//         return -1;
-//
-//     dma->DMACCControl = 0;
-//     dma->DMACCConfiguration = 0;
-//     if (sspr == LPC_SSP0)
-//         dma->DMACCConfiguration |= (GPDMA_CONN_SSP0_Rx << 6);
-//     if (sspr == LPC_SSP1)
-//         dma->DMACCConfiguration |= (GPDMA_CONN_SSP1_Rx << 6);
-//
-//     dma->DMACCConfiguration |= GPDMA_TRANSFERTYPE_M2P << 11;
-//     return 0;
-// }
-//
-// int SPI::start_DMA_rx(DMA_REG *dma)
-// {
-//     dma->DMACCConfiguration |=
-// }
+// blocks shorter than this aren't worth setting the DMA up for
+#define SPI_DMA_MIN 16
 
-// int SPI_writeblock(uint8_t *block, int blocklen)
-// {
-//     static DMA *d = new DMA();
-//     d.sourceaddr(block);
-//     d.transferlength(blocklen);
-//     d.destinationperipheral(sspr);
-//     d.start();
-//     while (d.active());
-//     return blocklen;
-//     return 0;
-// }
+// source of idle bytes when only reading, and sink when only writing
+static uint8_t dma_fill = 0xFF;
+static uint8_t dma_sink;
+
+int SPI_can_DMA()
+{
+    return (sspr != (SPI_REG *) 0);
+}
+
+static void SPI_DMA_init()
+{
+    LPC_SC->PCONP |= CLKPWR_PCONP_PCGPDMA;
+    LPC_GPDMA->DMACIntTCClear = GPDMA_DMACIntTCClear_Ch(SPI_DMA_RX_CH) | GPDMA_DMACIntTCClear_Ch(SPI_DMA_TX_CH);
+    LPC_GPDMA->DMACIntErrClr = GPDMA_DMACIntErrClr_Ch(SPI_DMA_RX_CH) | GPDMA_DMACIntErrClr_Ch(SPI_DMA_TX_CH);
+    LPC_GPDMA->DMACConfig = GPDMA_DMACConfig_E;
+    while ((LPC_GPDMA->DMACConfig & GPDMA_DMACConfig_E) == 0);
+}
+
+static void SPI_DMA_start(const uint8_t *tx, uint8_t *rx, int len)
+{
+    uint32_t rx_conn = (sspr == LPC_SSP0)?GPDMA_CONN_SSP0_Rx:GPDMA_CONN_SSP1_Rx;
+    uint32_t tx_conn = (sspr == LPC_SSP0)?GPDMA_CONN_SSP0_Tx:GPDMA_CONN_SSP1_Tx;
+
+    // peripheral -> memory, only stepping through rx if we want the data
+    SPI_DMA_RX->DMACCSrcAddr = (uint32_t) &sspr->DR;
+    SPI_DMA_RX->DMACCDestAddr = (uint32_t) (rx?rx:&dma_sink);
+    SPI_DMA_RX->DMACCLLI = 0;
+    SPI_DMA_RX->DMACCControl = GPDMA_DMACCxControl_TransferSize(len) |
+                               GPDMA_DMACCxControl_SBSize(GPDMA_BSIZE_4) |
+                               GPDMA_DMACCxControl_DBSize(GPDMA_BSIZE_4) |
+                               GPDMA_DMACCxControl_SWidth(GPDMA_WIDTH_BYTE) |
+                               GPDMA_DMACCxControl_DWidth(GPDMA_WIDTH_BYTE) |
+                               (rx?GPDMA_DMACCxControl_DI:0);
+
+    // memory -> peripheral, clocking out 0xFF if there's nothing to send
+    SPI_DMA_TX->DMACCSrcAddr = (uint32_t) (tx?tx:&dma_fill);
+    SPI_DMA_TX->DMACCDestAddr = (uint32_t) &sspr->DR;
+    SPI_DMA_TX->DMACCLLI = 0;
+    SPI_DMA_TX->DMACCControl = GPDMA_DMACCxControl_TransferSize(len) |
+                               GPDMA_DMACCxControl_SBSize(GPDMA_BSIZE_4) |
+                               GPDMA_DMACCxControl_DBSize(GPDMA_BSIZE_4) |
+                               GPDMA_DMACCxControl_SWidth(GPDMA_WIDTH_BYTE) |
+                               GPDMA_DMACCxControl_DWidth(GPDMA_WIDTH_BYTE) |
+                               (tx?GPDMA_DMACCxControl_SI:0);
+
+    SPI_DMA_RX->DMACCConfig = GPDMA_DMACCxConfig_E |
+                              GPDMA_DMACCxConfig_SrcPeripheral(rx_conn) |
+                              GPDMA_DMACCxConfig_TransferType(GPDMA_TRANSFERTYPE_P2M);
+    SPI_DMA_TX->DMACCConfig = GPDMA_DMACCxConfig_E |
+                              GPDMA_DMACCxConfig_DestPeripheral(tx_conn) |
+                              GPDMA_DMACCxConfig_TransferType(GPDMA_TRANSFERTYPE_M2P);
+
+    sspr->DMACR = SSP_DMA_RXDMA_EN | SSP_DMA_TXDMA_EN;
+}
+
+static void SPI_DMA_wait()
+{
+    // the last byte has been clocked in once the receive channel is done
+    while (SPI_DMA_RX->DMACCConfig & GPDMA_DMACCxConfig_E);
+
+    sspr->DMACR = 0;
+    LPC_GPDMA->DMACIntTCClear = GPDMA_DMACIntTCClear_Ch(SPI_DMA_RX_CH) | GPDMA_DMACIntTCClear_Ch(SPI_DMA_TX_CH);
+}
+
+static void SPI_DMA_block(const uint8_t *tx, uint8_t *rx, int len)
+{
+    SPI_DMA_start(tx, rx, len);
+    SPI_DMA_wait();
+}
+
+// full duplex block transfer. tx == NULL sends 0xFF, rx == NULL discards
+int SPI_transfer_block(const uint8_t *tx, uint8_t *rx, int len)
+{
+    int i;
+
+    if (sspr && (len >= SPI_DMA_MIN)) {
+        for (i = 0; i < len; i += 4080) {
+            int n = ((len - i) > 4080)?4080:(len - i);
+            SPI_DMA_block(tx?(tx + i):tx, rx?(rx + i):rx, n);
+        }
+        return len;
+    }
+
+    for (i = 0; i < len; i++) {
+        uint8_t r = SPI_write(tx?tx[i]:0xFF);
+        if (rx)
+            rx[i] = r;
+    }
+    return len;
+}
+
+int SPI_read_block(uint8_t *block, int blocklen)
+{
+    return SPI_transfer_block((const uint8_t *) 0, block, blocklen);
+}
+
+int SPI_writeblock(uint8_t *block, int blocklen)
+{
+    return SPI_transfer_block(block, (uint8_t *) 0, blocklen);
+}
+
+// start reading a block and return while the DMA fills it. Without DMA
+// the block is read before we return
+static int dma_busy;
+
+int SPI_read_block_start(uint8_t *block, int blocklen)
+{
+    if (sspr && (blocklen >= SPI_DMA_MIN) && (blocklen <= 4080)) {
+        SPI_DMA_start((const uint8_t *) 0, block, blocklen);
+        dma_busy = 1;
+        return blocklen;
+    }
+    return SPI_read_block(block, blocklen);
+}
+
+int SPI_block_busy()
+{
+    return dma_busy && (SPI_DMA_RX->DMACCConfig & GPDMA_DMACCxConfig_E);
+}
+
+void SPI_block_wait()
+{
+    if (dma_busy) {
+        SPI_DMA_wait();
+        dma_busy = 0;
+    }
+}
 
 // void SPI_irq()
 // {
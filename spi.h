@@ -10,14 +10,18 @@
 
 void SPI_init(PinName mosi, PinName miso, PinName sclk);
 
-void SPI_frequency(uint32_t);
+uint32_t SPI_frequency(uint32_t);
 uint8_t SPI_write(uint8_t);
 
+int SPI_transfer_block(const uint8_t *tx, uint8_t *rx, int len);
+int SPI_read_block(uint8_t *, int);
 int SPI_writeblock(uint8_t *, int);
 
+int SPI_read_block_start(uint8_t *, int);
+int SPI_block_busy(void);
+void SPI_block_wait(void);
+
 int SPI_can_DMA();
-int setup_DMA_rx(DMA_REG *);
-int setup_DMA_tx(DMA_REG *);
 
 void SPI_irq(void);
 
@@ -1,11 +1,11 @@
 #ifndef _SPI_HAL_H
 #define _SPI_HAL_H
 
-#include "lpc17xx_ssp.h"
-
 #include <stdint.h>
 
 #ifdef __LPC17XX__
+#include "lpc17xx_ssp.h"
+
 // #include <PinNames.h>
     typedef struct {
         uint8_t port;
@@ -15,6 +15,16 @@
     typedef LPC_SSP_TypeDef SPI_REG;
     typedef LPC_GPDMACH_TypeDef DMA_REG;
 
+    #define N_SPI_INTERRUPT_ROUTINES 2
+#else
+// on the host, see spisim.c
+    typedef struct {
+        uint8_t port;
+        uint8_t pin;
+    } Pin_t;
+
+    typedef void SPI_REG;
+
     #define N_SPI_INTERRUPT_ROUTINES 2
 #endif
 
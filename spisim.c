@@ -0,0 +1,219 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+/*
+ * Host stand-in for spi.c, for tools that want to run SDCard.c or anything
+ * else that talks SPI on Linux against a model of the device. Include this
+ * file instead of spi.c, gpio.c and timebase.c, and point spisim_device at
+ * the model before calling the driver.
+ *
+ * Every byte goes to spisim_device, and pin changes to spisim_pin, so the
+ * model sees chip select. The block calls go through the same byte path,
+ * as if the DMA had finished at once, and are counted apart from the byte
+ * loop. The clock follows SPI_frequency() with the SSP's dividers from a
+ * 100MHz PCLK, and time only moves with the bytes clocked, so the driver's
+ * timeouts run out after as many bytes as on the board and a model that
+ * never answers can't hang the tool.
+ */
+
+#ifndef __LPC17XX__
+
+#include <stdint.h>
+
+#include "spi.h"
+#include "gpio.h"
+#include "timebase.h"
+
+#define SPISIM_PCLK		100000000
+
+// the device: answers every byte clocked out with one clocked in
+static uint8_t (*spisim_device)(uint8_t mosi);
+// and sees pin changes, chip select is active low
+static void (*spisim_pin)(PinName pin, uint8_t value);
+
+static uint32_t spisim_hz = 400000;
+static uint64_t spisim_ns;			// never goes back, models keep deadlines in it
+static uint64_t spisim_start_ns;	// at the last spisim_reset_counts()
+
+unsigned spisim_bytes;			// through SPI_write()
+unsigned spisim_block_bytes;	// through the block calls, DMA on the board
+unsigned spisim_blocks;
+
+// not every tool that includes this counts in phases
+static void __attribute__ ((unused)) spisim_reset_counts()
+{
+	spisim_bytes = spisim_block_bytes = spisim_blocks = 0;
+	spisim_start_ns = spisim_ns;
+}
+
+static uint8_t spisim_clock(uint8_t mosi)
+{
+	spisim_ns += 8000000000ULL / spisim_hz;
+	return spisim_device?spisim_device(mosi):0xFF;
+}
+
+void SPI_init(PinName mosi, PinName miso, PinName sclk)
+{
+	SPI_frequency(400000);
+}
+
+// same dividers as spi.c
+uint32_t SPI_frequency(uint32_t f)
+{
+	uint32_t div = (SPISIM_PCLK + f - 1) / f;
+	uint32_t cpsr = 2;
+	uint32_t scr;
+
+	if (div > 254 * 256)
+		div = 254 * 256;
+	while ((cpsr * 256) < div)
+		cpsr += 2;
+	scr = ((div + cpsr - 1) / cpsr) - 1;
+
+	spisim_hz = SPISIM_PCLK / (cpsr * (scr + 1));
+	return spisim_hz;
+}
+
+uint8_t SPI_write(uint8_t data)
+{
+	spisim_bytes++;
+	return spisim_clock(data);
+}
+
+int SPI_transfer_block(const uint8_t *tx, uint8_t *rx, int len)
+{
+	int i;
+
+	spisim_blocks++;
+	spisim_block_bytes += len;
+	for (i = 0; i < len; i++)
+	{
+		uint8_t r = spisim_clock(tx?tx[i]:0xFF);
+		if (rx)
+			rx[i] = r;
+	}
+	return len;
+}
+
+int SPI_read_block(uint8_t *block, int blocklen)
+{
+	return SPI_transfer_block((const uint8_t *) 0, block, blocklen);
+}
+
+int SPI_writeblock(uint8_t *block, int blocklen)
+{
+	return SPI_transfer_block(block, (uint8_t *) 0, blocklen);
+}
+
+int SPI_read_block_start(uint8_t *block, int blocklen)
+{
+	return SPI_read_block(block, blocklen);
+}
+
+int SPI_block_busy()
+{
+	return 0;
+}
+
+void SPI_block_wait() {}
+
+int SPI_can_DMA()
+{
+	return 1;
+}
+
+void GPIO_init(PinName pin) {}
+void GPIO_setup(PinName pin) {}
+void GPIO_set_direction(PinName pin, uint8_t direction) {}
+void GPIO_output(PinName pin) {}
+void GPIO_input(PinName pin) {}
+
+void GPIO_write(PinName pin, uint8_t value)
+{
+	if (spisim_pin)
+		spisim_pin(pin, value);
+}
+
+void GPIO_set(PinName pin)
+{
+	GPIO_write(pin, 1);
+}
+
+void GPIO_clear(PinName pin)
+{
+	GPIO_write(pin, 0);
+}
+
+uint8_t GPIO_get(PinName pin)
+{
+	return 0;
+}
+
+// time in us, as far as the bytes clocked so far go
+void timebase_init() {}
+void timebase_calibrate() {}
+void timebase_deinit() {}
+
+uint32_t time_ticks()
+{
+	return spisim_ns / 1000;
+}
+
+uint32_t time_tick_rate()
+{
+	return 1000000;
+}
+
+uint32_t deadline_us(uint32_t us)
+{
+	return time_ticks() + us;
+}
+
+uint32_t deadline_ms(uint32_t ms)
+{
+	return time_ticks() + ms * 1000;
+}
+
+int deadline_passed(uint32_t deadline)
+{
+	return ((int32_t) (time_ticks() - deadline)) >= 0;
+}
+
+void delay_ticks(uint32_t ticks)
+{
+	spisim_ns += ticks * 1000ULL;
+}
+
+void delay_us(uint32_t us)
+{
+	delay_ticks(us);
+}
+
+void delay_ms(uint32_t ms)
+{
+	delay_ticks(ms * 1000);
+}
+
+#endif /* ifndef __LPC17XX__ */
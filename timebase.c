@@ -0,0 +1,111 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+#include "timebase.h"
+
+#include "LPC17xx.h"
+
+#include "lpc17xx_clkpwr.h"
+#include "lpc17xx_rit.h"
+
+// counter rate, refreshed whenever the core clock changes
+static uint32_t tick_rate;
+static uint32_t ticks_per_us;
+static uint32_t ticks_per_ms;
+
+void timebase_init()
+{
+	LPC_SC->PCONP |= CLKPWR_PCONP_PCRIT;
+
+	// count from zero up through the whole 32 bits, never matching
+	LPC_RIT->RICTRL = 0;
+	LPC_RIT->RICOUNTER = 0;
+	LPC_RIT->RICOMPVAL = 0xFFFFFFFF;
+	LPC_RIT->RIMASK = 0;
+	LPC_RIT->RICTRL = RIT_CTRL_INTEN | RIT_CTRL_ENBR | RIT_CTRL_TEN;
+
+	timebase_calibrate();
+}
+
+void timebase_calibrate()
+{
+	SystemCoreClockUpdate();
+
+	tick_rate = CLKPWR_GetPCLK(CLKPWR_PCLKSEL_RIT);
+	ticks_per_ms = tick_rate / 1000;
+	ticks_per_us = tick_rate / 1000000;
+	if (ticks_per_us == 0)
+		ticks_per_us = 1;
+}
+
+// leave the RIT as reset left it, for the application
+void timebase_deinit()
+{
+	LPC_RIT->RICTRL = RIT_CTRL_INTEN | RIT_CTRL_ENBR | RIT_CTRL_TEN;
+	LPC_RIT->RICOUNTER = 0;
+	LPC_RIT->RICOMPVAL = 0xFFFFFFFF;
+	LPC_SC->PCONP &= ~CLKPWR_PCONP_PCRIT;
+}
+
+uint32_t time_ticks()
+{
+	return LPC_RIT->RICOUNTER;
+}
+
+uint32_t time_tick_rate()
+{
+	return tick_rate;
+}
+
+uint32_t deadline_us(uint32_t us)
+{
+	return time_ticks() + us * ticks_per_us;
+}
+
+uint32_t deadline_ms(uint32_t ms)
+{
+	return time_ticks() + ms * ticks_per_ms;
+}
+
+int deadline_passed(uint32_t deadline)
+{
+	return ((int32_t) (time_ticks() - deadline)) >= 0;
+}
+
+void delay_ticks(uint32_t ticks)
+{
+	uint32_t start = time_ticks();
+	while ((time_ticks() - start) < ticks);
+}
+
+void delay_us(uint32_t us)
+{
+	delay_ticks(us * ticks_per_us);
+}
+
+void delay_ms(uint32_t ms)
+{
+	delay_ticks(ms * ticks_per_ms);
+}
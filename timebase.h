@@ -0,0 +1,49 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+#ifndef _TIMEBASE_H
+#define _TIMEBASE_H
+
+#include <stdint.h>
+
+// monotonic time from the free running RIT counter, no interrupts involved.
+// A deadline is the tick count it expires at, good for about a minute ahead
+
+void timebase_init(void);
+void timebase_calibrate(void);
+void timebase_deinit(void);
+
+uint32_t time_ticks(void);
+uint32_t time_tick_rate(void);
+
+uint32_t deadline_us(uint32_t us);
+uint32_t deadline_ms(uint32_t ms);
+int      deadline_passed(uint32_t deadline);
+
+void delay_ticks(uint32_t ticks);
+void delay_us(uint32_t us);
+void delay_ms(uint32_t ms);
+
+#endif /* _TIMEBASE_H */
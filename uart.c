@@ -29,6 +29,7 @@
 #include "lpc17xx_pinsel.h"
 #include "lpc17xx_gpio.h"
 #include "lpc17xx_clkpwr.h"
+#include "lpc17xx_gpdma.h"
 
 // #include "debug.h"
 
@@ -164,18 +165,30 @@ typedef struct {
 #include <system_LPC17xx.c>
 #define __LPC17XX__
 
-// check if we can use precalculated values
-#if ((defined APPBAUD) && (__CORE_CLK == 120000000) && (APPBAUD == 2000000))
-static inline int baud_space_search(uint32_t target_baud, uart_regs *r)
+// registers for the standard rates (and APPBAUD) at __CORE_CLK, worked out
+// on the host by baudfinder when building, see the Makefile
+#include "baud_lut.h"
+
+#ifdef BAUD_LUT_CORE_CLK
+static int baud_lut_find(uint32_t target_baud, uart_regs *r)
 {
-	r->baud      = 2000000;
-	r->pd        = 0;
-	r->dl        = 3;
-	r->mulval    = 4;
-	r->divaddval = 1;
-	return 0;
+	const uart_regs *l;
+
+	// only valid for the clock it was made for
+	if (SystemCoreClock != BAUD_LUT_CORE_CLK)
+		return -1;
+
+	for (l = baud_lut; l->baud; l++)
+	{
+		if (l->baud == target_baud)
+		{
+			*r = *l;
+			return 0;
+		}
+	}
+	return -1;
 }
-#else
+#endif
 
 /* definition to expand macro then apply to pragma message */
 // #define _STR(x) #x
@@ -256,7 +269,6 @@ static int baud_space_search(uint32_t target_baud, uart_regs *r)
 	}
 	return i;
 }
-#endif
 
 int UART_baud(int baud)
 {
@@ -267,7 +279,10 @@ int UART_baud(int baud)
 
 	uart_regs r = { 0, 0, 0, 0, 0 };
 
-	baud_space_search(baud, &r);
+#ifdef BAUD_LUT_CORE_CLK
+	if (baud_lut_find(baud, &r))
+#endif
+		baud_space_search(baud, &r);
 
 	uint8_t pclkdiv;
 	IRQn_Type c = 255;
@@ -338,6 +353,8 @@ int UART_baud(int baud)
 }
 
 void UART_deinit() {
+	UART_rx_dma_stop();
+
 	switch(port)
 	{
 		case 0:
@@ -389,12 +406,14 @@ uint32_t UART_send(const uint8_t *data, uint32_t buflen) {
 
         if (intr == 0) __disable_irq();
     }
-    if (intr == 0) __enable_irq();
 
+    // kick the transmitter if the interrupt isn't already feeding it
     if (TxIntStat == RESET) {
         UART_tx_isr();
     }
 
+    if (intr == 0) __enable_irq();
+
     return bytes;
 }
 
@@ -431,9 +450,91 @@ int UART_canrecv() {
 }
 
 int UART_busy() {
-	if (u->LSR & UART_LSR_TEMT)
-		return 0;
-	return RB_CANREAD(txbuf);
+	if (RB_CANREAD(txbuf))
+		return 1;
+	return (u->LSR & UART_LSR_TEMT) == 0;
+}
+
+// GPDMA channel for receive. SSP has 0 and 1
+#define UART_DMA_RX LPC_GPDMACH2
+#define UART_DMA_RX_CH 2
+
+// two halves of the receive ring, each linked to the other
+static GPDMA_LLI_Type rx_lli[2];
+static uint8_t *rx_ring;
+static uint32_t rx_ring_size;
+static volatile uint8_t rx_dma;
+
+/* Receive into a circular buffer by DMA. Unlike the RX interrupt it keeps
+ * going while interrupts are off for a flash erase. size must be even and
+ * at most 8190. From here on the RX interrupt only wakes the CPU, see
+ * UART_rx_wake() */
+void UART_rx_dma_start(uint8_t *ring, uint32_t size)
+{
+    uint32_t half = size / 2;
+    uint32_t rx_conn = GPDMA_CONN_UART0_Rx + 2 * port;
+    uint32_t control = GPDMA_DMACCxControl_TransferSize(half) |
+                       GPDMA_DMACCxControl_SBSize(GPDMA_BSIZE_1) |
+                       GPDMA_DMACCxControl_DBSize(GPDMA_BSIZE_1) |
+                       GPDMA_DMACCxControl_SWidth(GPDMA_WIDTH_BYTE) |
+                       GPDMA_DMACCxControl_DWidth(GPDMA_WIDTH_BYTE) |
+                       GPDMA_DMACCxControl_DI;
+
+    for (int i = 0; i < 2; i++) {
+        rx_lli[i].SrcAddr = (uint32_t) &u->RBR;
+        rx_lli[i].DstAddr = (uint32_t) (ring + i * half);
+        rx_lli[i].NextLLI = (uint32_t) &rx_lli[i ^ 1];
+        rx_lli[i].Control = control;
+    }
+    rx_ring = ring;
+    rx_ring_size = size;
+
+    LPC_SC->PCONP |= CLKPWR_PCONP_PCGPDMA;
+    LPC_GPDMA->DMACConfig = GPDMA_DMACConfig_E;
+    while ((LPC_GPDMA->DMACConfig & GPDMA_DMACConfig_E) == 0);
+
+    // request lines 8-15 are shared with the timer matches
+    LPC_SC->DMAREQSEL &= ~(1UL << (rx_conn - 8));
+
+    UART_DMA_RX->DMACCConfig = 0;
+    LPC_GPDMA->DMACIntTCClear = GPDMA_DMACIntTCClear_Ch(UART_DMA_RX_CH);
+    LPC_GPDMA->DMACIntErrClr = GPDMA_DMACIntErrClr_Ch(UART_DMA_RX_CH);
+    UART_DMA_RX->DMACCSrcAddr = rx_lli[0].SrcAddr;
+    UART_DMA_RX->DMACCDestAddr = rx_lli[0].DstAddr;
+    UART_DMA_RX->DMACCLLI = rx_lli[0].NextLLI;
+    UART_DMA_RX->DMACCControl = control;
+
+    // anything already in the FIFO predates the ring
+    u->FCR = UART_FCR_FIFO_EN | UART_FCR_RX_RS | UART_FCR_DMAMODE_SEL | UART_FCR_TRG_LEV0;
+    rx_dma = 1;
+
+    UART_DMA_RX->DMACCConfig = GPDMA_DMACCxConfig_E |
+                               GPDMA_DMACCxConfig_SrcPeripheral(rx_conn) |
+                               GPDMA_DMACCxConfig_TransferType(GPDMA_TRANSFERTYPE_P2M);
+}
+
+void UART_rx_dma_stop()
+{
+    if (rx_dma == 0)
+        return;
+
+    UART_IntConfig(u, UART_INTCFG_RBR, DISABLE);
+    UART_DMA_RX->DMACCConfig = 0;
+    u->FCR = UART_FCR_FIFO_EN | UART_FCR_RX_RS;
+    rx_dma = 0;
+}
+
+// where the DMA will write the next byte, as an offset into the ring
+uint32_t UART_rx_dma_head()
+{
+    return (UART_DMA_RX->DMACCDestAddr - (uint32_t) rx_ring) % rx_ring_size;
+}
+
+// one RX interrupt on the next byte, so a WFI can wait for the DMA.
+// Call with interrupts masked, the ISR changes IER too
+void UART_rx_wake()
+{
+    UART_IntConfig(u, UART_INTCFG_RBR, ENABLE);
 }
 
 void UART_isr()
@@ -460,7 +561,11 @@ void UART_isr()
     // Receive Data Available or Character time-out
     if ((intsrc == UART_IIR_INTID_RDA) || (intsrc == UART_IIR_INTID_CTI))
     {
-        UART_rx_isr();
+        // the DMA owns the data, we were only here to wake someone up
+        if (rx_dma)
+            UART_IntConfig(u, UART_INTCFG_RBR, DISABLE);
+        else
+            UART_rx_isr();
     }
 
     // Transmit Holding Empty
@@ -471,17 +576,12 @@ void UART_isr()
 }
 
 void UART_tx_isr() {
-    // Disable THRE interrupt
-    UART_IntConfig(u, UART_INTCFG_THRE, DISABLE);
-
-    /* Wait for FIFO buffer empty, transfer UART_TX_FIFO_SIZE bytes
-     * of data or break whenever ring buffers are empty */
-    /* Wait until THR empty */
-    while (UART_CheckBusy(u) == SET);
-
-    while (!RB_EMPTY(txbuf))
+    /* THRE means the whole TX FIFO is free, so fill it and leave.
+     * If it isn't empty yet, the THRE interrupt will bring us back */
+    if (u->LSR & UART_LSR_THRE)
     {
-		RB_POP(txbuf, u->THR);
+        for (int i = 0; (i < UART_TX_FIFO_SIZE) && !RB_EMPTY(txbuf); i++)
+            RB_POP(txbuf, u->THR);
     }
 
     /* If there is no more data to send, disable the transmit
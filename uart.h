@@ -32,4 +32,9 @@ void		UART_tx_isr(void);
 void		UART_rx_isr(void);
 void		UART_err_isr(uint8_t);
 
+void		UART_rx_dma_start(uint8_t *ring, uint32_t size);
+void		UART_rx_dma_stop(void);
+uint32_t	UART_rx_dma_head(void);
+void		UART_rx_wake(void);
+
 #endif /* _UART_H */
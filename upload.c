@@ -0,0 +1,289 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+#include "upload.h"
+
+#include "uart.h"
+#include "crc32.h"
+
+#include "sbl_iap.h"
+
+#include <string.h>
+
+#include "min-printf.h"
+
+#if !(defined DEBUG)
+#define printf(...) do {} while (0)
+#endif
+
+extern const uint8_t _user_flash_start;
+extern const uint8_t _user_flash_size;
+
+// DMA receive ring. It must hold everything the host can send while we are
+// stuck in a flash erase, a window of frames, with room to spare
+#define UPLOAD_RING_SIZE 4096
+#define UPLOAD_RING_MASK (UPLOAD_RING_SIZE - 1)
+
+static uint8_t ring[UPLOAD_RING_SIZE] __attribute__ ((aligned(4)));
+static uint32_t ring_tail;		// next byte to parse
+static uint32_t ring_seen;		// DMA position when we last looked
+
+// the frame being checked, unwrapped from the ring
+static uint8_t frame[UPLOAD_HEADER + UPLOAD_PAYLOAD + 4];
+
+// frames that arrived ahead of a lost one, by frame number % window
+static uint8_t slot[UPLOAD_WINDOW][UPLOAD_PAYLOAD];
+static uint16_t slot_length[UPLOAD_WINDOW];
+static uint8_t slot_full;
+
+static uint8_t session;
+static uint8_t complete;
+static uint32_t image_length;
+static uint32_t image_base;		// bytes handed to the flash writer
+
+void UPLOAD_init()
+{
+	ring_tail = ring_seen = 0;
+	session = complete = 0;
+	UART_rx_dma_start(ring, UPLOAD_RING_SIZE);
+}
+
+static uint8_t ring_byte(uint32_t i)
+{
+	return ring[(ring_tail + i) & UPLOAD_RING_MASK];
+}
+
+static void UPLOAD_send(uint8_t type, uint8_t seq, uint8_t payload)
+{
+	uint8_t f[UPLOAD_HEADER + 1 + 4];
+	uint32_t crc;
+
+	f[0] = UPLOAD_SYNC0;
+	f[1] = UPLOAD_SYNC1;
+	f[2] = type;
+	f[3] = seq;
+	f[4] = 1;
+	f[5] = 0;
+	memcpy(&f[6], &image_base, 4);
+	f[10] = payload;
+	crc = crc32(0, &f[2], UPLOAD_HEADER - 2 + 1);
+	memcpy(&f[11], &crc, 4);
+
+	UART_send(f, sizeof(f));
+}
+
+// first frame we don't have yet, the last one may be short
+static uint32_t UPLOAD_base()
+{
+	return (image_base + UPLOAD_PAYLOAD - 1) / UPLOAD_PAYLOAD;
+}
+
+// which of the frames after image_base we already hold
+static uint8_t UPLOAD_held()
+{
+	uint32_t n = UPLOAD_base();
+	uint8_t held = 0;
+	int i;
+
+	for (i = 0; i < UPLOAD_WINDOW; i++)
+		if (slot_full & (1 << ((n + i) % UPLOAD_WINDOW)))
+			held |= 1 << i;
+	return held;
+}
+
+static void UPLOAD_fail(uint8_t seq, uint8_t error)
+{
+	printf("upload failed %d\n", error);
+	session = 0;
+	UPLOAD_send(UPLOAD_NAK, seq, error);
+}
+
+static void UPLOAD_data(uint8_t seq, uint32_t offset, uint16_t length, uint8_t *data)
+{
+	uint32_t n = offset / UPLOAD_PAYLOAD;
+	uint32_t base = UPLOAD_base();
+	uint32_t run;
+
+	if ((offset % UPLOAD_PAYLOAD) || (length == 0) || (seq != (n & 0xFF)) ||
+	    (offset + length > image_length) ||
+	    ((length < UPLOAD_PAYLOAD) && (offset + length != image_length)))
+	{
+		UPLOAD_fail(seq, UPLOAD_ERR_FRAME);
+		return;
+	}
+
+	// anything outside the window is a repeat or too early, the ack says where we are
+	if ((n >= base) && (n < base + UPLOAD_WINDOW))
+	{
+		memcpy(slot[n % UPLOAD_WINDOW], data, length);
+		slot_length[n % UPLOAD_WINDOW] = length;
+		slot_full |= 1 << (n % UPLOAD_WINDOW);
+	}
+
+	// take the frames we can write in order, and ack them before writing
+	// so the host can refill the window while the flash is busy. Their
+	// slots stay untouched until then, nothing else runs in between
+	for (run = 0; (run < UPLOAD_WINDOW) && (slot_full & (1 << ((base + run) % UPLOAD_WINDOW))); run++)
+	{
+		slot_full &= ~(1 << ((base + run) % UPLOAD_WINDOW));
+		image_base += slot_length[(base + run) % UPLOAD_WINDOW];
+	}
+
+	UPLOAD_send(UPLOAD_ACK, seq, UPLOAD_held());
+
+	for (; run; run--, base++)
+	{
+		uint8_t i = base % UPLOAD_WINDOW;
+		int r = write_flash((unsigned *) (&_user_flash_start + base * UPLOAD_PAYLOAD), (char *) slot[i], slot_length[i]);
+		if (r)
+		{
+			printf("write flash error %d\n", r);
+			UPLOAD_fail(seq, UPLOAD_ERR_FLASH);
+			return;
+		}
+	}
+}
+
+static void UPLOAD_frame(uint8_t *f)
+{
+	uint8_t type = f[2];
+	uint8_t seq = f[3];
+	uint16_t length = f[4] | (f[5] << 8);
+	uint32_t offset;
+
+	memcpy(&offset, &f[6], 4);
+
+	switch (type)
+	{
+		case UPLOAD_START:
+			printf("upload %lu bytes\n", offset);
+			slot_full = 0;
+			image_base = 0;
+			if ((offset == 0) || (offset > (uintptr_t) &_user_flash_size))
+			{
+				UPLOAD_fail(seq, UPLOAD_ERR_SIZE);
+				return;
+			}
+			image_length = offset;
+			flash_discard();
+			session = 1;
+			complete = 0;
+			UPLOAD_send(UPLOAD_ACK, seq, 0);
+			return;
+		case UPLOAD_DATA:
+			if (session == 0)
+			{
+				UPLOAD_fail(seq, UPLOAD_ERR_STATE);
+				return;
+			}
+			UPLOAD_data(seq, offset, length, &f[UPLOAD_HEADER]);
+			return;
+		case UPLOAD_FINISH:
+			// our answer crossed with a repeat
+			if (complete)
+			{
+				UPLOAD_send(UPLOAD_ACK, seq, 0);
+				return;
+			}
+			if (session == 0)
+			{
+				UPLOAD_fail(seq, UPLOAD_ERR_STATE);
+				return;
+			}
+			// still missing something, the ack tells the host what
+			if (image_base < image_length)
+			{
+				UPLOAD_send(UPLOAD_ACK, seq, UPLOAD_held());
+				return;
+			}
+			if (flush_flash())
+			{
+				UPLOAD_fail(seq, UPLOAD_ERR_FLASH);
+				return;
+			}
+			printf("%u sectors written, %u unchanged\n", flash_sectors_written, flash_sectors_skipped);
+			session = 0;
+			complete = 1;
+			UPLOAD_send(UPLOAD_ACK, seq, 0);
+			return;
+	}
+}
+
+void UPLOAD_task()
+{
+	uint32_t used, length, total, crc, i;
+
+	for (;;)
+	{
+		ring_seen = UART_rx_dma_head();
+		used = (ring_seen - ring_tail) & UPLOAD_RING_MASK;
+
+		// hunt for a frame start, skipping noise and our own debug output
+		while ((used >= 2) && ((ring_byte(0) != UPLOAD_SYNC0) || (ring_byte(1) != UPLOAD_SYNC1)))
+		{
+			ring_tail = (ring_tail + 1) & UPLOAD_RING_MASK;
+			used--;
+		}
+
+		if (used < UPLOAD_HEADER)
+			return;
+
+		length = ring_byte(4) | (ring_byte(5) << 8);
+		total = UPLOAD_HEADER + length + 4;
+		if (length <= UPLOAD_PAYLOAD)
+		{
+			if (used < total)
+				return;
+
+			for (i = 0; i < total; i++)
+				frame[i] = ring_byte(i);
+			memcpy(&crc, &frame[total - 4], 4);
+
+			if (crc == crc32(0, &frame[2], total - 6))
+			{
+				ring_tail = (ring_tail + total) & UPLOAD_RING_MASK;
+				UPLOAD_frame(frame);
+				continue;
+			}
+		}
+
+		// not a frame after all, look again from the next byte
+		ring_tail = (ring_tail + 1) & UPLOAD_RING_MASK;
+	}
+}
+
+// nothing new has arrived. Call with interrupts masked, before a WFI
+int UPLOAD_idle()
+{
+	if (UART_rx_dma_head() != ring_seen)
+		return 0;
+	UART_rx_wake();
+	return 1;
+}
+
+int UPLOAD_complete()
+{
+	return complete;
+}
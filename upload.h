@@ -0,0 +1,83 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+#ifndef _UPLOAD_H
+#define _UPLOAD_H
+
+#include <stdint.h>
+
+/*
+ * Firmware upload over the debug UART, for boards without USB.
+ *
+ * Every frame, in both directions, is little endian:
+ *
+ *   uint8_t  sync[2]   UPLOAD_SYNC0, UPLOAD_SYNC1
+ *   uint8_t  type
+ *   uint8_t  seq
+ *   uint16_t length    of the payload, at most UPLOAD_PAYLOAD
+ *   uint32_t offset
+ *   uint8_t  payload[length]
+ *   uint32_t crc       CRC32 of type through payload
+ *
+ * The host sends UPLOAD_START with the image length as offset, then the
+ * image as UPLOAD_DATA frames of UPLOAD_PAYLOAD bytes (the last one may be
+ * short) at their byte offset, seq being the frame number. It may run up to
+ * UPLOAD_WINDOW frames ahead of the last acknowledged offset, and finishes
+ * with UPLOAD_FINISH.
+ *
+ * Every frame is answered with UPLOAD_ACK. Its offset says how much of the
+ * image has gone to the flash writer. Its one byte payload has bit n set
+ * if frame (offset / UPLOAD_PAYLOAD) + n is already held. Frames with a
+ * bad CRC are dropped, so a gap in that bitmap means a frame was lost and
+ * should be sent again. An acknowledged UPLOAD_FINISH means the image is in
+ * flash and the bootloader is about to start it.
+ *
+ * UPLOAD_NAK carries an UPLOAD_ERR_ code and ends the session.
+ */
+
+#define UPLOAD_SYNC0	0xA5
+#define UPLOAD_SYNC1	0x5A
+
+#define UPLOAD_HEADER	10
+#define UPLOAD_PAYLOAD	512
+#define UPLOAD_WINDOW	4
+
+#define UPLOAD_START	'S'
+#define UPLOAD_DATA		'D'
+#define UPLOAD_FINISH	'F'
+#define UPLOAD_ACK		'A'
+#define UPLOAD_NAK		'N'
+
+#define UPLOAD_ERR_STATE	1	// no session, send UPLOAD_START first
+#define UPLOAD_ERR_FRAME	2	// frame doesn't fit the image
+#define UPLOAD_ERR_SIZE		3	// image larger than user flash
+#define UPLOAD_ERR_FLASH	4	// flash writer failed
+
+void UPLOAD_init(void);
+void UPLOAD_task(void);
+int  UPLOAD_idle(void);
+int  UPLOAD_complete(void);
+
+#endif /* _UPLOAD_H */
@@ -0,0 +1,177 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+/*
+ * A board for serialupload.c to talk to: the real upload.c on the far end
+ * of a pty, flashing through sbl_iap.c into iapsim.c's flash. The main
+ * loop stalls for as long as IAP would, so the receive ring fills the way
+ * it does on the board. -c flips a bit in about 1 byte in N on the way in,
+ * to exercise the NAKs and resends.
+ *
+ * The flashed image is written to upload.bin, or the file given, once the
+ * host has finished.
+ *
+ * Run with:
+ * gcc -std=gnu99 -O2 -no-pie -ICMSISv2p00_LPC17xx/inc -Wl,--defsym,_user_flash_start=0x4000 -Wl,--defsym,_user_flash_size=0x74000 -o uploadsim uploadsim.c -lpthread
+ * ./uploadsim [-c 5000] [upload.bin]		prints the pty to upload to, then
+ * ./serialupload /dev/pts/N firmware.bin && cmp firmware.bin upload.bin
+ */
+
+#ifndef __LPC17XX__
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <termios.h>
+
+#include "iapsim.c"
+
+// uart.h drags in the peripheral library, we only need the DMA ring
+#define _UART_H
+void		UART_rx_dma_start(uint8_t *ring, uint32_t size);
+uint32_t	UART_rx_dma_head(void);
+void		UART_rx_wake(void);
+uint32_t	UART_send(const uint8_t *buf, uint32_t buflen);
+
+// and the host has its own printf
+#define _MIN_PRINTF_H
+
+#include "crc32.c"
+#include "upload.c"
+
+#undef printf
+
+static int pty;
+static unsigned corrupt;
+
+static uint8_t *rx_ring;
+static uint32_t rx_size;
+static volatile uint32_t rx_head;
+
+void UART_rx_dma_start(uint8_t *ring, uint32_t size)
+{
+	rx_ring = ring;
+	rx_size = size;
+	rx_head = 0;
+}
+
+uint32_t UART_rx_dma_head()
+{
+	return rx_head;
+}
+
+void UART_rx_wake() {}
+
+uint32_t UART_send(const uint8_t *buf, uint32_t buflen)
+{
+	if (write(pty, buf, buflen) < 0)
+		return 0;
+	return buflen;
+}
+
+// the DMA channel, which doesn't care whether the main loop keeps up
+static void *rx(void *arg)
+{
+	uint8_t buf[256];
+	int r, i;
+
+	while ((r = read(pty, buf, sizeof(buf))) > 0)
+	{
+		for (i = 0; i < r; i++)
+		{
+			if (corrupt && ((rand() % corrupt) == 0))
+				buf[i] ^= 1 << (rand() & 7);
+			rx_ring[rx_head] = buf[i];
+			rx_head = (rx_head + 1) % rx_size;
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	const char *out = "upload.bin";
+	struct termios t;
+	pthread_t thread;
+	uint64_t before;
+	FILE *f;
+	int i;
+
+	for (i = 1; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "-c") == 0) && (i + 1 < argc))
+			corrupt = atoi(argv[++i]);
+		else
+			out = argv[i];
+	}
+
+	pty = posix_openpt(O_RDWR | O_NOCTTY);
+	if ((pty < 0) || grantpt(pty) || unlockpt(pty))
+	{
+		perror("pty");
+		return 1;
+	}
+	tcgetattr(pty, &t);
+	cfmakeraw(&t);
+	tcsetattr(pty, TCSANOW, &t);
+	printf("%s\n", ptsname(pty));
+	fflush(stdout);
+
+	iap_blank();
+	UPLOAD_init();
+	pthread_create(&thread, NULL, rx, NULL);
+
+	while (UPLOAD_complete() == 0)
+	{
+		before = iap_us;
+		UPLOAD_task();
+		usleep((iap_us > before)?(iap_us - before):100);
+	}
+	// answer a repeated FINISH if our ack got lost
+	for (i = 0; i < 200; i++)
+	{
+		UPLOAD_task();
+		usleep(1000);
+	}
+
+	printf("%u bytes, %u sectors written, %u unchanged, %u erases, %llu ms in IAP\n",
+		image_length, flash_sectors_written, flash_sectors_skipped, iap_erases,
+		(unsigned long long) (iap_us / 1000));
+
+	f = fopen(out, "wb");
+	if (f == NULL)
+	{
+		perror(out);
+		return 1;
+	}
+	fwrite(&iap_flash[USER_FLASH_START], 1, image_length, f);
+	fclose(f);
+	return 0;
+}
+
+#endif /* ifndef __LPC17XX__ */
@@ -29,6 +29,15 @@
 #include "lpc17xx_usb.h"
 #include "dfu.h"
 #include "descriptor.h"
+#ifdef MSC
+#include "msc.h"
+#endif
+#ifdef VENDOR
+#include "vendor.h"
+#endif
+#ifdef CDC
+#include "cdc.h"
+#endif
 
 #include <stdio.h>
 
@@ -47,67 +56,162 @@ void DFU_EP0out(void);
 
 uint8_t control_buffer[64];
 
-usbdesc_base *descriptors;
+#define USB_MAX_CONFIGURATIONS	2
+#define USB_MAX_STRINGS			12
+
+// what GET_DESCRIPTOR can ask for, found once by usb_provideDescriptors()
+static usbdesc_device *device_descriptor;
+static usbdesc_configuration *configuration_descriptors[USB_MAX_CONFIGURATIONS];
+static uint8_t configurations;
+static usbdesc_base *string_descriptors[USB_MAX_STRINGS];
+static uint8_t strings;
+
+static uint8_t configuration;
+
+// check that a configuration's interfaces and endpoints add up to its
+// wTotalLength, and that it has as many interfaces as it says
+static int usb_validConfiguration(usbdesc_configuration *c)
+{
+	uint8_t *p = (uint8_t *) c;
+	uint8_t *end = p + c->wTotalLength;
+	int interfaces = 0;
+
+	while (p < end)
+	{
+		usbdesc_base *d = (usbdesc_base *) p;
+		if (d->bLength < 2)
+			return 0;
+		if ((d->bDescType == DT_INTERFACE) && (((usbdesc_interface *) d)->bAlternateSetting == 0))
+			interfaces++;
+		p += d->bLength;
+	}
+	return (p == end) && (interfaces == c->bNumInterfaces);
+}
 
-void usb_provideDescriptors(void *d)
+// a zero bLength ends the list. Interface and endpoint descriptors come
+// with their configuration, strings are numbered in the order they appear
+void usb_provideDescriptors(void *descriptors)
 {
-	descriptors = (usbdesc_base *) d;
+	usbdesc_base *d = (usbdesc_base *) descriptors;
+
+	device_descriptor = NULL;
+	configurations = 0;
+	strings = 0;
+
+	while (d->bLength > 0)
+	{
+		uint16_t length = d->bLength;
+
+		switch (d->bDescType)
+		{
+			case DT_DEVICE:
+				device_descriptor = (usbdesc_device *) d;
+				break;
+			case DT_CONFIGURATION:
+				length = ((usbdesc_configuration *) d)->wTotalLength;
+				if (usb_validConfiguration((usbdesc_configuration *) d) == 0)
+					printf("USB: configuration %d is malformed\n", configurations);
+				else if (configurations < USB_MAX_CONFIGURATIONS)
+					configuration_descriptors[configurations++] = (usbdesc_configuration *) d;
+				break;
+			case DT_STRING:
+				if (strings < USB_MAX_STRINGS)
+					string_descriptors[strings++] = d;
+				break;
+			default:
+				printf("USB: stray descriptor type 0x%x\n", d->bDescType);
+				break;
+		}
+
+		d = (usbdesc_base *) (((uint8_t *) d) + length);
+	}
+
+	if (device_descriptor && (device_descriptor->bNumConfigurations != configurations))
+		printf("USB: device has %d configurations, found %d\n", device_descriptor->bNumConfigurations, configurations);
 }
 
 void requestGetStatus()
 {
 	control_buffer[0] = control_buffer[1] = 0;
+	if (control.setup.bmRequestType_Recipient == RECIPIENT_ENDPOINT)
+	{
+		if (SIE_SelectEndpoint(control.setup.wIndex) & SIE_EP_ST)
+			control_buffer[0] = 1;
+	}
 	control.bufferlen = 2;
 }
 
+// ENDPOINT_HALT is the only feature we support
+void requestFeature(uint8_t set)
+{
+	if ((control.setup.bmRequestType_Recipient != RECIPIENT_ENDPOINT) || (control.setup.wValue != FEATURE_ENDPOINT_HALT))
+		return;
+	if ((control.setup.wIndex & 0xF) == 0)
+		return;
+
+	if (set)
+		usb_ep_stall(control.setup.wIndex);
+	else
+	{
+		usb_ep_unstall(control.setup.wIndex);
+#ifdef MSC
+		MSC_clearHalt(control.setup.wIndex);
+#endif
+	}
+}
+
+#ifdef MSC
+static int isMSCrequest()
+{
+	return (control.setup.bmRequestType_Recipient == RECIPIENT_INTERFACE) && (control.setup.wIndex == MSC_INTERFACE);
+}
+#endif
+
+#ifdef CDC
+static int isCDCrequest()
+{
+	return (control.setup.bmRequestType_Recipient == RECIPIENT_INTERFACE) && (control.setup.wIndex == CDC_INTERFACE);
+}
+#endif
+
 void requestGetDescriptor()
 {
 	uint8_t dType = control.setup.wValue >> 8;
 	uint8_t dIndex = control.setup.wValue & 0xFF;
 
-	usbdesc_base *d = descriptors;
+	usbdesc_base *d = NULL;
 
-	int i = 0;
+	switch (dType)
+	{
+		case DT_DEVICE:
+			if (dIndex == 0)
+				d = (usbdesc_base *) device_descriptor;
+			break;
+		case DT_CONFIGURATION:
+			if (dIndex < configurations)
+				d = (usbdesc_base *) configuration_descriptors[dIndex];
+			break;
+		case DT_STRING:
+			if (dIndex < strings)
+				d = string_descriptors[dIndex];
+			break;
+	}
 
-	while (d->bLength > 0)
+	if (d)
 	{
-		if (d->bDescType == dType)
+		control.buffer = d;
+		if (dType == DT_CONFIGURATION)
 		{
-			switch (d->bDescType)
-			{
-				case DT_DEVICE:
-					dIndex = i = 0;
-					break;
-				case DT_CONFIGURATION:
-					dIndex = i = ((usbdesc_configuration *) d)->bConfigurationValue;
-					break;
-				case DT_INTERFACE:
-					i = ((usbdesc_interface *) d)->bInterfaceNumber;
-					break;
-				case DT_ENDPOINT:
-					i = ((usbdesc_endpoint *) d)->bEndpointAddress;
-					break;
-			}
-			if (i == dIndex)
-			{
-				control.buffer = d;
-				if (dType == DT_CONFIGURATION)
-				{
-					control.bufferlen = ((usbdesc_configuration *) d)->wTotalLength;
-				}
-				else
-				{
-					control.bufferlen = d->bLength;
-				}
-				if (control.bufferlen > control.setup.wLength)
-					control.bufferlen = control.setup.wLength;
-// 				printf("FOUND descriptor 0x%x:0x%x with length %d\n", dType, dIndex, control.bufferlen);
-				return;
-			}
-			i++;
+			control.bufferlen = ((usbdesc_configuration *) d)->wTotalLength;
 		}
-
-		d = (usbdesc_base *) (((uint8_t *) d) + d->bLength);
+		else
+		{
+			control.bufferlen = d->bLength;
+		}
+		if (control.bufferlen > control.setup.wLength)
+			control.bufferlen = control.setup.wLength;
+// 		printf("FOUND descriptor 0x%x:0x%x with length %d\n", dType, dIndex, control.bufferlen);
+		return;
 	}
 // 	printf("descriptor 0x%x:0x%x NOT FOUND\n", dType, dIndex);
 	control.bufferlen = 0;
@@ -116,12 +220,40 @@ void requestGetDescriptor()
 
 void requestSetConfiguration()
 {
+	uint8_t value = control.setup.wValue & 0xFF;
+	uint8_t i;
+
+	if (value == 0)
+	{
+		SIE_ConfigureDevice(0);
+		configuration = 0;
+		return;
+	}
+
+	for (i = 0; (i < configurations) && (configuration_descriptors[i]->bConfigurationValue != value); i++);
+	if (i == configurations)
+	{
+		usb_ep0_stall();
+		return;
+	}
+
+	// every function is in every configuration for now
 	SIE_ConfigureDevice(1);
+	configuration = value;
+#ifdef MSC
+	MSC_configure();
+#endif
+#ifdef VENDOR
+	VENDOR_configure();
+#endif
+#ifdef CDC
+	CDC_configure();
+#endif
 }
 
 void requestGetConfiguration()
 {
-	control_buffer[0] = 1;
+	control_buffer[0] = configuration;
 	control.bufferlen = 1;
 }
 
@@ -131,6 +263,16 @@ void EP0Complete()
 	if ((control.setup.bmRequestType & 0x7C) == 0)
 	{
 	}
+#ifdef MSC
+	else if (isMSCrequest())
+	{
+	}
+#endif
+#ifdef CDC
+	else if (isCDCrequest())
+	{
+	}
+#endif
 	else
 	{
 		DFU_transferComplete(&control);
@@ -165,8 +307,10 @@ void EP0setup()
  					requestGetStatus();
 					break;
 				case REQ_CLEAR_FEATURE:
+					requestFeature(0);
 					break;
 				case REQ_SET_FEATURE:
+					requestFeature(1);
 					break;
 				case REQ_SET_ADDRESS:
 					SIE_SetAddress(control.setup.wValue);
@@ -189,6 +333,18 @@ void EP0setup()
 					break;
 			}
 		}
+#ifdef MSC
+		else if (isMSCrequest())
+		{
+			MSC_controlTransfer(&control);
+		}
+#endif
+#ifdef CDC
+		else if (isCDCrequest())
+		{
+			CDC_controlTransfer(&control);
+		}
+#endif
 		else
 		{
 			DFU_controlTransfer(&control);
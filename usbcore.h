@@ -21,6 +21,12 @@ typedef enum
 	REQ_SET_CONFIGURATION		= 9,
 } USB_REQUEST;
 
+#define RECIPIENT_DEVICE	0
+#define RECIPIENT_INTERFACE	1
+#define RECIPIENT_ENDPOINT	2
+
+#define FEATURE_ENDPOINT_HALT	0
+
 #define DATA_DIRECTION_HOST_TO_DEVICE 0
 #define DATA_DIRECTION_DEVICE_TO_HOST 1
 
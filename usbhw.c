@@ -33,13 +33,59 @@
 
 #include <stdio.h>
 
+#ifdef PROFILE_USB
+#include "profile.h"
+#endif
+
 #if !(defined DEBUG)
 #define printf(...) do {} while (0)
 #endif
 
-/// pointers for callbacks to EP1-15 both IN and OUT
+/// pointers for callbacks to EP1-15 both IN and OUT, run from USB_IRQHandler
 usb_callback_pointer EPcallbacks[30];
 
+#define USB_WORK_QUEUE 4
+
+/// work posted from the interrupt handler, run by usb_task() in the main loop
+static usb_callback_pointer usb_work[USB_WORK_QUEUE];
+static volatile uint8_t usb_work_head;
+static volatile uint8_t usb_work_tail;
+
+/// DMA descriptors, one per endpoint, and the table the engine finds them
+/// through. Both must be in AHB SRAM, the UDCA on a 128 byte boundary
+typedef struct
+{
+	uint32_t next;
+	uint32_t control;
+	uint32_t buffer;
+	uint32_t status;
+} usb_dma_descriptor;
+
+static volatile uint32_t usb_udca[32] __attribute__ ((section(".USB_RAM"), aligned(128)));
+static volatile usb_dma_descriptor usb_dd[32] __attribute__ ((section(".USB_RAM"), aligned(4)));
+static usb_dma_callback_pointer usb_dma_callbacks[32];
+static uint16_t usb_packet_size[32];
+
+static void usb_dma_init(void);
+
+/// OUT endpoints currently draining into a ring, by endpoint index
+static usb_ring *usb_rings[16];
+
+// the USB register sequences mustn't be split by the USB interrupt. Keep
+// them short, and leave interrupts off if the caller had them off
+static inline uint32_t usb_lock()
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	return primask;
+}
+
+static inline void usb_unlock(uint32_t primask)
+{
+	if (primask == 0)
+		__enable_irq();
+}
+
 void usb_init()
 {
 	// enable USB hardware
@@ -59,119 +105,444 @@ void usb_init()
 	// configure USB Connect
 	LPC_PINCON->PINSEL4 &= 0xfffcffff;
 	LPC_PINCON->PINSEL4 |= 0x00040000;
+
+	usb_dma_init();
 }
 
 void usb_connect()
 {
 	LPC_USB->USBDevIntEn = DEV_STAT | EP_SLOW;
+	LPC_USB->USBDMAIntEn = EOT | NDDR | ERR;
 	usb_realise_endpoint(EP0IN, 64);
 	usb_realise_endpoint(EP0OUT, 64);
 
 	SIE_Connect();
+
+	NVIC_EnableIRQ(USB_IRQn);
 }
 
 void usb_disconnect()
 {
+	NVIC_DisableIRQ(USB_IRQn);
+
 	SIE_Disconnect();
 }
 
+int usb_defer(usb_callback_pointer work)
+{
+	int r = 0;
+	// the caller may already have interrupts off
+	uint32_t primask = usb_lock();
+	if ((uint8_t) (usb_work_head - usb_work_tail) < USB_WORK_QUEUE)
+	{
+		usb_work[usb_work_head++ % USB_WORK_QUEUE] = work;
+		r = 1;
+	}
+	usb_unlock(primask);
+	return r;
+}
+
+int usb_idle()
+{
+	return (usb_work_head == usb_work_tail);
+}
+
 void usb_set_callback(uint8_t bEP, usb_callback_pointer callback)
 {
-	EPcallbacks[EP(bEP)] = callback;
+	EPcallbacks[EP2IDX(bEP) - 2] = callback;
 }
 
 void usb_realise_endpoint(uint8_t bEP, uint16_t packet_size)
 {
-	__disable_irq();
+	uint32_t primask = usb_lock();
 	LPC_USB->USBDevIntClr = EP_RLZD;
 	LPC_USB->USBReEp |= EP(bEP);
 	LPC_USB->USBEpInd = EP2IDX(bEP);
 	LPC_USB->USBMaxPSize = packet_size;
-	__enable_irq();
+	usb_packet_size[EP2IDX(bEP)] = packet_size;
+	usb_unlock(primask);
 	while (!(LPC_USB->USBDevIntSt & EP_RLZD));
 	LPC_USB->USBDevIntClr = EP_RLZD;
 	LPC_USB->USBEpIntEn |= EP(bEP);
 }
 
+// OUT endpoint has a packet waiting
+int usb_can_read(uint8_t bEP)
+{
+	return (SIE_SelectEndpoint(bEP) & SIE_EP_FE)?1:0;
+}
+
+// IN endpoint has a free buffer
+int usb_can_write(uint8_t bEP)
+{
+	return (SIE_SelectEndpoint(bEP) & SIE_EP_FE)?0:1;
+}
+
+// IN endpoint still holds packets the host hasn't collected
+int usb_write_pending(uint8_t bEP)
+{
+	return (SIE_SelectEndpoint(bEP) & (SIE_EP_B_1_FULL | SIE_EP_B_2_FULL))?1:0;
+}
+
 int usb_read_packet(uint8_t bEP, void *buffer, int buffersize)
 {
-	int i = 0;
-	int l = 0;
-	uint32_t j = 0;
-	__disable_irq();
+	int l;
+	int n;
+	uint32_t j;
+#ifdef PROFILE_USB
+	uint32_t start = DWT_CYCCNT;
+#endif
+	uint32_t primask = usb_lock();
 
 	LPC_USB->USBCtrl = RD_EN | ((bEP & 0xF) << 2);
-	while ((LPC_USB->USBRxPLen & 0x800) != 0x800);
+	while ((LPC_USB->USBRxPLen & PKT_RDY) == 0);
 	l = LPC_USB->USBRxPLen & 0x3FF;
 
 	if (l > buffersize)
 	{
 // 		printf("Not enough room in buffer (got %d need %d), failing to read\n", buffersize, l);
-		__enable_irq();
+		usb_unlock(primask);
 		return l;
 	}
 
-	if (l == 0)
-		j = LPC_USB->USBRxData;
+	// RD_EN drops by itself after the last word, so there's nothing to poll
+	n = l >> 2;
+	if (((uint32_t) buffer & 3) == 0)
+	{
+		uint32_t *w = (uint32_t *) buffer;
+		for (; n >= 4; n -= 4, w += 4)
+		{
+			w[0] = LPC_USB->USBRxData;
+			w[1] = LPC_USB->USBRxData;
+			w[2] = LPC_USB->USBRxData;
+			w[3] = LPC_USB->USBRxData;
+		}
+		for (; n; n--)
+			*w++ = LPC_USB->USBRxData;
+		buffer = w;
+	}
 	else
 	{
-		for (i = 0; i < buffersize; i++)
+		uint8_t *b = (uint8_t *) buffer;
+		for (; n; n--, b += 4)
 		{
-			if ((i & 3) == 0)
-			{
-				j = LPC_USB->USBRxData;
-			}
-
-			((uint8_t *) buffer)[i] = j & 0xFF;
-			j >>= 8;
-
-			if ((i & 3) == 3)
-			{
-				if (!(LPC_USB->USBCtrl & RD_EN))
-				{
-					SIE_SelectEndpoint(bEP);
-					SIE_ClearBuffer();
-					__enable_irq();
-					return l;
-				}
-			}
+			j = LPC_USB->USBRxData;
+			b[0] = j;
+			b[1] = j >> 8;
+			b[2] = j >> 16;
+			b[3] = j >> 24;
 		}
+		buffer = b;
+	}
+
+	// the last few bytes, or the dummy read a ZLP needs
+	if ((l & 3) || (l == 0))
+	{
+		uint8_t *b = (uint8_t *) buffer;
+		j = LPC_USB->USBRxData;
+		for (n = l & 3; n; n--, j >>= 8)
+			*b++ = j;
 	}
 
 	SIE_SelectEndpoint(bEP);
 	SIE_ClearBuffer();
-	__enable_irq();
+	usb_unlock(primask);
+#ifdef PROFILE_USB
+	if (l == 64)
+		profile_count(&profile_usb_read, start);
+#endif
 	return l;
 }
 
 int usb_write_packet(uint8_t bEP, void *data, int packetlen)
 {
-	int i = 0;
-	uint8_t *d = (uint8_t *) data;
-	__disable_irq();
+	int n = packetlen >> 2;
+#ifdef PROFILE_USB
+	uint32_t start = DWT_CYCCNT;
+#endif
+	uint32_t primask = usb_lock();
+
 	LPC_USB->USBCtrl = WR_EN | ((bEP & 0xF) << 2);
 	LPC_USB->USBTxPLen = packetlen;
-	if (packetlen)
+	if (((uint32_t) data & 3) == 0)
 	{
-		for (i = 0;(LPC_USB->USBCtrl & WR_EN) && (i < packetlen);)
+		const uint32_t *w = (const uint32_t *) data;
+		for (; n >= 4; n -= 4, w += 4)
 		{
-			// 		printf("[%x]",d);
-			LPC_USB->USBTxData = ((d[0]) << 0) | ((d[1]) << 8) | ((d[2]) << 16) | ((d[3]) << 24);
-			d += 4;
-			i += 4;
+			LPC_USB->USBTxData = w[0];
+			LPC_USB->USBTxData = w[1];
+			LPC_USB->USBTxData = w[2];
+			LPC_USB->USBTxData = w[3];
 		}
+		for (; n; n--)
+			LPC_USB->USBTxData = *w++;
+		data = (void *) w;
 	}
 	else
 	{
-		LPC_USB->USBTxData = 0;
+		const uint8_t *d = (const uint8_t *) data;
+		for (; n; n--, d += 4)
+			LPC_USB->USBTxData = ((d[0]) << 0) | ((d[1]) << 8) | ((d[2]) << 16) | ((d[3]) << 24);
+		data = (void *) d;
+	}
+
+	// the last few bytes, without reading past the end of data. A ZLP
+	// still takes one write
+	if ((packetlen & 3) || (packetlen == 0))
+	{
+		const uint8_t *d = (const uint8_t *) data;
+		uint32_t j = 0;
+		for (n = (packetlen & 3) - 1; n >= 0; n--)
+			j = (j << 8) | d[n];
+		LPC_USB->USBTxData = j;
 	}
+
 	SIE_SelectEndpoint(bEP);
 	SIE_ValidateBuffer();
 	__ISB();
-	__enable_irq();
-	if (i > packetlen)
-		return packetlen;
-	return i;
+	usb_unlock(primask);
+#ifdef PROFILE_USB
+	if (packetlen == 64)
+		profile_count(&profile_usb_write, start);
+#endif
+	return packetlen;
+}
+
+/*
+ * The bulk endpoints (2, 5, 8, 11, 14) have two packet buffers in
+ * hardware, so the host can send one packet while we read the other.
+ * That's only 128 bytes though; a ring moves each packet out to RAM as
+ * soon as it lands, so the host only sees NAKs once every slot is full.
+ */
+
+// read whatever the endpoint holds into the ring, a slot at a time.
+// A slot is done when full, at the end of the transfer, or at a short
+// packet. Runs in the USB interrupt, or with it masked
+static void usb_ring_fill(uint8_t bEP)
+{
+	usb_ring *ring = usb_rings[EP2IDX(bEP) >> 1];
+	uint16_t packet_size = usb_packet_size[EP2IDX(bEP)];
+
+	while (ring->remaining && ((uint8_t) (ring->head - ring->tail) < ring->slots) && usb_can_read(bEP))
+	{
+		uint8_t *slot = ring->buffer + (ring->head % ring->slots) * ring->slot_size;
+		uint32_t room = ring->slot_size - ring->fill;
+		int l;
+
+		if (room > ring->remaining)
+			room = ring->remaining;
+
+		l = usb_read_packet(bEP, slot + ring->fill, room);
+		if (l > room)
+		{
+			// more than the host said it would send, leave it be
+			ring->short_packet = 1;
+			ring->remaining = 0;
+			l = 0;
+		}
+		else
+		{
+			ring->fill += l;
+			ring->remaining -= l;
+			if ((l < packet_size) && (l < room))
+			{
+				ring->short_packet = 1;
+				ring->remaining = 0;
+			}
+		}
+
+		if ((ring->fill == ring->slot_size) || (ring->remaining == 0))
+		{
+			ring->length[ring->head % ring->slots] = ring->fill;
+			ring->fill = 0;
+			ring->head++;
+		}
+	}
+}
+
+// receive the next length bytes from bEP through ring. Until then the
+// endpoint's callback only wakes the reader, it needn't read anything
+void usb_ring_start(uint8_t bEP, usb_ring *ring, uint32_t length)
+{
+	uint32_t primask = usb_lock();
+
+	ring->short_packet = 0;
+	ring->fill = 0;
+	ring->remaining = length;
+	ring->head = ring->tail = 0;
+	usb_rings[EP2IDX(bEP) >> 1] = ring;
+	usb_ring_fill(bEP);
+
+	usb_unlock(primask);
+}
+
+// the oldest finished slot and its length, or 0 if there isn't one yet
+int usb_ring_read(uint8_t bEP, uint8_t **data)
+{
+	usb_ring *ring = usb_rings[EP2IDX(bEP) >> 1];
+
+	if ((ring == NULL) || (ring->head == ring->tail))
+		return 0;
+	*data = ring->buffer + (ring->tail % ring->slots) * ring->slot_size;
+	return ring->length[ring->tail % ring->slots];
+}
+
+// done with the slot from usb_ring_read(), let the endpoint refill it
+void usb_ring_release(uint8_t bEP)
+{
+	usb_ring *ring = usb_rings[EP2IDX(bEP) >> 1];
+	uint32_t primask;
+
+	if ((ring == NULL) || (ring->head == ring->tail))
+		return;
+
+	primask = usb_lock();
+	ring->tail++;
+	// the endpoint stopped raising interrupts when the ring filled
+	usb_ring_fill(bEP);
+	usb_unlock(primask);
+}
+
+// there's more of the transfer to come, or still to be read
+int usb_ring_busy(uint8_t bEP)
+{
+	usb_ring *ring = usb_rings[EP2IDX(bEP) >> 1];
+
+	return ring && (ring->remaining || (ring->head != ring->tail));
+}
+
+// back to usb_read_packet(), whatever is left
+void usb_ring_stop(uint8_t bEP)
+{
+	usb_rings[EP2IDX(bEP) >> 1] = NULL;
+}
+
+// AHB SRAM isn't cleared at startup
+static void usb_dma_init()
+{
+	int i;
+
+	LPC_USB->USBEpDMADis = 0xFFFFFFFF;
+	for (i = 0; i < 32; i++)
+	{
+		usb_udca[i] = 0;
+		usb_dma_callbacks[i] = NULL;
+	}
+	LPC_USB->USBUDCAH = (uint32_t) usb_udca;
+	LPC_USB->USBEoTIntClr = 0xFFFFFFFF;
+	LPC_USB->USBNDDRIntClr = 0xFFFFFFFF;
+	LPC_USB->USBSysErrIntClr = 0xFFFFFFFF;
+}
+
+// hand a whole transfer to the DMA engine. OUT ends when the buffer is
+// full or at a short packet, IN is sent as full packets then the remainder
+// (no ZLP). The endpoint's slave mode callback is held off until the
+// callback runs, from the USB interrupt. The buffer must be USB_DMA_BUFFER
+int usb_dma_queue(uint8_t bEP, void *buffer, uint16_t length, usb_dma_callback_pointer callback)
+{
+	uint8_t idx = EP2IDX(bEP);
+	volatile usb_dma_descriptor *dd = &usb_dd[idx];
+	uint32_t primask;
+
+	if ((idx < 2) || (length == 0) || ((uint32_t) buffer & 3))
+		return 0;
+	if (((uint32_t) buffer < 0x2007C000) || ((uint32_t) buffer + length > 0x20084000))
+		return 0;
+
+	primask = usb_lock();
+	if (usb_udca[idx])
+	{
+		usb_unlock(primask);
+		return 0;
+	}
+
+	dd->next = 0;
+	dd->control = DD_MODE_NORMAL | DD_MAX_PACKET(usb_packet_size[idx]) | DD_BUFFER_LENGTH(length);
+	dd->buffer = (uint32_t) buffer;
+	dd->status = 0;
+	usb_dma_callbacks[idx] = callback;
+	usb_udca[idx] = (uint32_t) dd;
+
+	LPC_USB->USBEpIntEn &= ~EP(bEP);
+	LPC_USB->USBEpDMAEn = EP(bEP);
+	usb_unlock(primask);
+	return 1;
+}
+
+int usb_dma_busy(uint8_t bEP)
+{
+	return usb_udca[EP2IDX(bEP)]?1:0;
+}
+
+// back to slave mode, in the USB interrupt or with it masked
+static void usb_dma_finish(uint8_t idx)
+{
+	LPC_USB->USBEpDMADis = 1UL << idx;
+	usb_udca[idx] = 0;
+	LPC_USB->USBEpIntEn |= 1UL << idx;
+}
+
+// drop a queued transfer without its callback
+void usb_dma_cancel(uint8_t bEP)
+{
+	uint8_t idx = EP2IDX(bEP);
+	uint32_t primask = usb_lock();
+
+	if (usb_udca[idx])
+		usb_dma_finish(idx);
+	usb_dma_callbacks[idx] = NULL;
+	usb_unlock(primask);
+}
+
+static void usb_dma_service()
+{
+	uint32_t st = LPC_USB->USBDMAIntSt;
+	uint32_t eot = 0;
+	uint32_t err = 0;
+	int i;
+
+	if (st & EOT)
+	{
+		eot = LPC_USB->USBEoTIntSt;
+		LPC_USB->USBEoTIntClr = eot;
+	}
+	if (st & ERR)
+	{
+		err = LPC_USB->USBSysErrIntSt;
+		LPC_USB->USBSysErrIntClr = err;
+	}
+	if (st & NDDR)
+	{
+		// the engine stays off an endpoint until usb_dma_queue() again
+		LPC_USB->USBNDDRIntClr = LPC_USB->USBNDDRIntSt;
+	}
+
+	for (i = 2; i < 32; i++)
+	{
+		if (((eot | err) & (1UL << i)) && usb_udca[i])
+		{
+			usb_dma_callback_pointer callback = usb_dma_callbacks[i];
+			uint32_t status = usb_dd[i].status;
+			int length = -1;
+
+			if ((err & (1UL << i)) == 0)
+			{
+				switch (status & DD_STATUS_MASK)
+				{
+					case DD_STATUS_NORMAL:
+					case DD_STATUS_UNDERRUN:
+						// a short OUT packet ends the transfer early
+						length = DD_DMA_COUNT(status);
+						break;
+				}
+			}
+
+			usb_dma_finish(i);
+			usb_dma_callbacks[i] = NULL;
+			if (callback)
+				callback(IDX2EP(i), length);
+		}
+	}
 }
 
 void usb_ep_stall(uint8_t bEP)
@@ -189,7 +560,18 @@ void usb_ep0_stall()
 	SIE_SetEndpointStatus(EP0OUT, SIE_EPST_CND_ST);
 }
 
+// SIE events are handled in USB_IRQHandler, this runs the work it deferred
 void usb_task()
+{
+	while (usb_work_head != usb_work_tail)
+	{
+		usb_callback_pointer work = usb_work[usb_work_tail % USB_WORK_QUEUE];
+		usb_work_tail++;
+		work();
+	}
+}
+
+static void usb_service()
 {
 	if (LPC_USB->USBDevIntSt & FRAME)
 	{
@@ -210,9 +592,15 @@ void usb_task()
 
 		if (devStat & SIE_DEVSTAT_RST)
 		{
+			int i;
+
 			printf("USB:Bus Reset\n");
 			USBEvent_busReset();
 
+			usb_dma_init();
+			for (i = 0; i < 16; i++)
+				usb_rings[i] = NULL;
+
 			usb_realise_endpoint(EP0IN , 64);
 			usb_realise_endpoint(EP0OUT, 64);
 
@@ -261,8 +649,8 @@ void usb_task()
 		}
 		if (st & ~(3UL))
 		{
-			int i = 3;
-			uint32_t bitmask = 1<<3;
+			int i = 2;
+			uint32_t bitmask = 1<<2;
 			for (;
 				i < 32;
 				i++, bitmask <<= 1
@@ -276,7 +664,10 @@ void usb_task()
 						(((i & 1) == 0) && (st & SIE_EP_FE))    // OUT endpoint and FE = 1 (buffer has data)
 						)
 					{
-						// TODO: check for event receivers
+						if (((i & 1) == 0) && usb_rings[i >> 1])
+							usb_ring_fill(IDX2EP(i));
+						if (EPcallbacks[i - 2])
+							EPcallbacks[i - 2]();
 					}
 				}
 			}
@@ -286,5 +677,7 @@ void usb_task()
 }
 
 __attribute__ ((interrupt)) void USB_IRQHandler() {
-// 	usb_task();
+	if (LPC_SC->USBIntSt & USB_INT_REQ_DMA)
+		usb_dma_service();
+	usb_service();
 }
@@ -13,6 +13,29 @@ extern "C"
 
 typedef void (*usb_callback_pointer)(void);
 
+/// DMA transfer done: bytes moved, or -1 if the transfer failed
+typedef void (*usb_dma_callback_pointer)(uint8_t bEP, int length);
+
+/// the USB DMA engine only reaches AHB SRAM, so buffers for usb_dma_queue() go here
+#define USB_DMA_BUFFER __attribute__ ((section(".USB_RAM"), aligned(4)))
+
+#define USB_RING_SLOTS 4
+
+/// slots the USB interrupt fills from an OUT endpoint, one after another,
+/// so the host can keep sending while the main loop works on earlier ones
+typedef struct
+{
+	uint8_t *buffer;					// slots * slot_size bytes, word aligned
+	uint16_t slot_size;					// a multiple of the packet size
+	uint8_t slots;						// at most USB_RING_SLOTS
+	uint8_t short_packet;				// the host ended the transfer early
+	uint16_t fill;						// bytes in the slot at head
+	uint16_t length[USB_RING_SLOTS];	// bytes in each finished slot
+	volatile uint32_t remaining;		// bytes still to come from the host
+	volatile uint8_t head;				// slot being filled
+	volatile uint8_t tail;				// oldest finished slot
+} usb_ring;
+
 extern usb_callback_pointer EPcallbacks[30];
 
 
@@ -31,17 +54,30 @@ extern void USBEvent_Frame(void);
 void usb_init(void);
 
 void usb_task(void);
+int usb_defer(usb_callback_pointer work);
+int usb_idle(void);
 
 void usb_set_callback(uint8_t bEP, usb_callback_pointer callback);
 
 void usb_realise_endpoint(uint8_t bEP, uint16_t packet_size);
 
 int usb_can_write(uint8_t bEP);
+int usb_write_pending(uint8_t bEP);
 int usb_write_packet(uint8_t bEP, void *data, int packetlen);
 
 int usb_can_read(uint8_t bEP);
 int usb_read_packet(uint8_t bEP, void *buffer, int buffersize);
 
+void usb_ring_start(uint8_t bEP, usb_ring *ring, uint32_t length);
+int usb_ring_read(uint8_t bEP, uint8_t **data);
+void usb_ring_release(uint8_t bEP);
+int usb_ring_busy(uint8_t bEP);
+void usb_ring_stop(uint8_t bEP);
+
+int usb_dma_queue(uint8_t bEP, void *buffer, uint16_t length, usb_dma_callback_pointer callback);
+int usb_dma_busy(uint8_t bEP);
+void usb_dma_cancel(uint8_t bEP);
+
 void usb_connect(void);
 void usb_disconnect(void);
 
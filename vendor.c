@@ -0,0 +1,183 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+#include "vendor.h"
+
+#include "usbhw.h"
+#include "crc32.h"
+
+#include <LPC17xx.h>
+
+#include "sbl_iap.h"
+#include "sbl_config.h"
+
+#include "min-printf.h"
+
+#if !(defined DEBUG)
+#define printf(...) do {} while (0)
+#endif
+
+extern void setleds(int);
+
+// frames are received at head by the USB interrupt, and flashed from tail
+static VENDOR_frame frames[VENDOR_FRAMES] __attribute__ ((aligned(4)));
+static uint8_t frame_bad[VENDOR_FRAMES];
+static uint16_t fill;					// bytes of frames[head] received
+static volatile uint8_t head;
+static volatile uint8_t tail;
+
+#define FRAMES_QUEUED ((uint8_t) (head - tail))
+
+static VENDOR_reply reply;
+static uint32_t written;				// end of the data flashed so far
+static uint8_t complete;
+
+void VENDOR_init()
+{
+	head = tail = 0;
+	fill = 0;
+	written = USER_FLASH_START;
+	complete = 0;
+}
+
+// pull packets off the OUT endpoint while there's a frame to put them in.
+// Runs in the USB interrupt, or with it masked
+static void VENDOR_receive()
+{
+	while ((FRAMES_QUEUED < VENDOR_FRAMES) && usb_can_read(VENDOR_EP_OUT))
+	{
+		uint8_t i = head % VENDOR_FRAMES;
+		uint8_t *f = (uint8_t *) &frames[i];
+		int l;
+
+		if (fill == 0)
+			frame_bad[i] = 0;
+
+		l = usb_read_packet(VENDOR_EP_OUT, f + fill, sizeof(VENDOR_frame) - fill);
+		if (l > sizeof(VENDOR_frame) - fill)
+		{
+			// more than any frame holds, drop it and wait for the end
+			l = usb_read_packet(VENDOR_EP_OUT, f + VENDOR_HEADER, VENDOR_PACKET_SIZE);
+			frame_bad[i] = 1;
+			fill = VENDOR_HEADER;
+		}
+		else if ((l == 0) && (fill == 0))
+			continue;
+		fill += l;
+
+		// a frame ends at its length, or early at a short packet
+		if ((fill >= VENDOR_HEADER) && (fill >= VENDOR_HEADER + frames[i].length))
+		{
+			if (fill != VENDOR_HEADER + frames[i].length)
+				frame_bad[i] = 1;
+		}
+		else if (l == VENDOR_PACKET_SIZE)
+			continue;
+		else
+			frame_bad[i] = 1;
+
+		fill = 0;
+		head++;
+	}
+}
+
+static void VENDOR_in()
+{
+	// VENDOR_task() picks it up from the main loop
+}
+
+// SET_CONFIGURATION, from the USB interrupt
+void VENDOR_configure()
+{
+	usb_realise_endpoint(VENDOR_EP_OUT, VENDOR_PACKET_SIZE);
+	usb_realise_endpoint(VENDOR_EP_IN, VENDOR_PACKET_SIZE);
+	usb_ep_unstall(VENDOR_EP_OUT);
+	usb_ep_unstall(VENDOR_EP_IN);
+	usb_set_callback(VENDOR_EP_OUT, VENDOR_receive);
+	usb_set_callback(VENDOR_EP_IN, VENDOR_in);
+	head = tail = 0;
+	fill = 0;
+	written = USER_FLASH_START;
+}
+
+static uint8_t VENDOR_process(VENDOR_frame *f)
+{
+	switch (f->cmd)
+	{
+		case VENDOR_WRITE:
+			if (crc32(0, f->payload, f->length) != f->crc)
+				return VENDOR_ERR_CRC;
+			// written is never below USER_FLASH_START, and this way round
+			// the end can't wrap
+			if ((f->address < written) || (f->address > USER_FLASH_END + 1 - f->length))
+				return VENDOR_ERR_ADDRESS;
+			setleds((f->address - USER_FLASH_START) >> 15);
+			if (write_flash((unsigned *) f->address, (char *) f->payload, f->length) != CMD_SUCCESS)
+				return VENDOR_ERR_FLASH;
+			written = f->address + f->length;
+			return VENDOR_OK;
+		case VENDOR_FINISH:
+			if (flush_flash() != CMD_SUCCESS)
+				return VENDOR_ERR_FLASH;
+			printf("VENDOR: image complete, %u sectors written, %u unchanged\n", flash_sectors_written, flash_sectors_skipped);
+			complete = 1;
+			return VENDOR_OK;
+	}
+	return VENDOR_ERR_FRAME;
+}
+
+void VENDOR_task()
+{
+	// every frame's reply goes out as soon as it's done
+	while (FRAMES_QUEUED && usb_can_write(VENDOR_EP_IN))
+	{
+		uint8_t i = tail % VENDOR_FRAMES;
+
+		reply.cmd = frames[i].cmd;
+		reply.seq = frames[i].seq;
+		reply.status = frame_bad[i]?VENDOR_ERR_FRAME:VENDOR_process(&frames[i]);
+		reply.address = written;
+		if (reply.status != VENDOR_OK)
+			printf("VENDOR: frame %u error %u\n", reply.seq, reply.status);
+		usb_write_packet(VENDOR_EP_IN, &reply, sizeof(reply));
+
+		// the endpoint may have NAKed for want of a frame
+		NVIC_DisableIRQ(USB_IRQn);
+		tail++;
+		VENDOR_receive();
+		NVIC_EnableIRQ(USB_IRQn);
+	}
+}
+
+// nothing queued, or waiting for the host to collect a reply
+int VENDOR_idle()
+{
+	return (FRAMES_QUEUED == 0) || (usb_can_write(VENDOR_EP_IN) == 0);
+}
+
+int VENDOR_complete()
+{
+	return complete && (usb_write_pending(VENDOR_EP_IN) == 0);
+}
@@ -0,0 +1,105 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+#ifndef _VENDOR_H
+#define _VENDOR_H
+
+#include <stdint.h>
+
+/*
+ * Vendor class bulk interface for flashing, added to the DFU configuration
+ * when built with VENDOR defined. It saves DFU's SETUP, status stage and
+ * GETSTATUS round trips for every 512 bytes.
+ *
+ * The host sends frames on VENDOR_EP_OUT, each as one bulk transfer, little
+ * endian:
+ *
+ *   uint8_t  cmd       VENDOR_WRITE or VENDOR_FINISH
+ *   uint8_t  seq       echoed in the reply
+ *   uint16_t length    of the payload, at most VENDOR_PAYLOAD
+ *   uint32_t address   absolute flash address, within user flash
+ *   uint32_t crc       CRC32 of the payload
+ *   uint8_t  payload[length]
+ *
+ * Writes must arrive in ascending address order, a frame below the end of
+ * the data written so far gets VENDOR_ERR_ADDRESS. VENDOR_FRAMES frames are
+ * buffered, so the host can keep sending while a frame is being flashed;
+ * beyond that the OUT endpoint NAKs.
+ *
+ * Every frame is answered on VENDOR_EP_IN with a VENDOR_reply once it has
+ * been handed to the flash writer, carrying a VENDOR_ status and the end
+ * of the data written so far. VENDOR_FINISH flushes the last page, and once
+ * its reply has been collected the bootloader starts the new image.
+ */
+
+#ifdef MSC
+#define VENDOR_INTERFACE	2
+#else
+#define VENDOR_INTERFACE	1
+#endif
+
+#define VENDOR_EP_OUT		0x05
+#define VENDOR_EP_IN		0x85
+#define VENDOR_PACKET_SIZE	64
+
+#define VENDOR_HEADER		12
+#define VENDOR_PAYLOAD		1024
+#define VENDOR_FRAMES		2
+
+#define VENDOR_WRITE		'W'
+#define VENDOR_FINISH		'F'
+
+#define VENDOR_OK			0
+#define VENDOR_ERR_FRAME	1	// unknown command, or length doesn't match
+#define VENDOR_ERR_CRC		2
+#define VENDOR_ERR_ADDRESS	3	// outside user flash, or out of order
+#define VENDOR_ERR_FLASH	4	// flash writer failed
+
+typedef struct
+{
+	uint8_t		cmd;
+	uint8_t		seq;
+	uint16_t	length;
+	uint32_t	address;
+	uint32_t	crc;
+	uint8_t		payload[VENDOR_PAYLOAD];
+} VENDOR_frame;
+
+typedef struct
+{
+	uint8_t		cmd;
+	uint8_t		seq;
+	uint8_t		status;
+	uint8_t		reserved;
+	uint32_t	address;
+} VENDOR_reply;
+
+void VENDOR_init(void);
+void VENDOR_configure(void);
+void VENDOR_task(void);
+int  VENDOR_idle(void);
+int  VENDOR_complete(void);
+
+#endif /* _VENDOR_H */
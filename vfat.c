@@ -0,0 +1,351 @@
+/*****************************************************************************
+ *                                                                            *
+ * DFU/SD/SDHC Bootloader for LPC17xx                                         *
+ *                                                                            *
+ * by Triffid Hunter                                                          *
+ *                                                                            *
+ *                                                                            *
+ * This firmware is Copyright (C) 2009-2010 Michael Moon aka Triffid_Hunter   *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program; if not, write to the Free Software                *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+/*
+ * With MSC_VFAT, the mass storage function serves a FAT16 volume made up
+ * on the fly instead of the SD card. It holds CURRENT.BIN, a read-only view
+ * of user flash, and has room for the host to copy a new image next to it.
+ *
+ * Nothing is stored: the boot sector, FAT and root directory are generated
+ * as the host reads them, and the data of CURRENT.BIN comes straight out
+ * of flash. Writes to the data area go to the flash writer once one of
+ * them starts with a plausible vector table, and carry on for as long as
+ * the host writes the sectors that follow. Hosts allocate a new file from
+ * the first free cluster and write it in order, so that is the image.
+ *
+ * Root directory writes are only looked at for file sizes; once the file
+ * that starts at the image holds no more than we have flashed, the image
+ * is complete.
+ */
+
+#ifdef MSC_VFAT
+
+#include "msc.h"
+
+#include "sbl_iap.h"
+#include "sbl_config.h"
+
+#include <string.h>
+
+#include "min-printf.h"
+
+#if !(defined DEBUG)
+#define printf(...) do {} while (0)
+#endif
+
+#define VFAT_SECTORS		8192
+#define VFAT_FATS			2
+#define VFAT_FAT_SECTORS	32		// 256 entries each, enough for every cluster
+#define VFAT_ROOT_ENTRIES	64
+
+#define VFAT_FAT_START		1
+#define VFAT_ROOT_START		(VFAT_FAT_START + (VFAT_FATS * VFAT_FAT_SECTORS))
+#define VFAT_DATA_START		(VFAT_ROOT_START + (VFAT_ROOT_ENTRIES * 32 / MSC_BLOCK_SIZE))
+
+// one sector per cluster, from cluster 2
+#define SECTOR2CLUSTER(s)	((s) - VFAT_DATA_START + 2)
+#define CLUSTER2SECTOR(c)	((c) - 2 + VFAT_DATA_START)
+
+#define ATTR_READ_ONLY		0x01
+#define ATTR_VOLUME_ID		0x08
+#define ATTR_DIRECTORY		0x10
+#define ATTR_LONG_NAME		0x0F
+
+typedef struct
+{
+	uint8_t		jump[3];
+	char		oem[8];
+	uint16_t	bytes_per_sector;
+	uint8_t		sectors_per_cluster;
+	uint16_t	reserved_sectors;
+	uint8_t		fats;
+	uint16_t	root_entries;
+	uint16_t	sectors16;
+	uint8_t		media;
+	uint16_t	sectors_per_fat;
+	uint16_t	sectors_per_track;
+	uint16_t	heads;
+	uint32_t	hidden_sectors;
+	uint32_t	sectors32;
+	uint8_t		drive;
+	uint8_t		reserved;
+	uint8_t		boot_signature;
+	uint32_t	serial;
+	char		label[11];
+	char		fs_type[8];
+} vfat_boot_sector;
+
+typedef struct
+{
+	char		name[11];
+	uint8_t		attr;
+	uint8_t		nt_reserved;
+	uint8_t		create_tenths;
+	uint16_t	create_time;
+	uint16_t	create_date;
+	uint16_t	access_date;
+	uint16_t	cluster_high;
+	uint16_t	write_time;
+	uint16_t	write_date;
+	uint16_t	cluster;
+	uint32_t	size;
+} vfat_dirent;
+
+// 2010-01-01 00:00
+#define VFAT_DATE			(((2010 - 1980) << 9) | (1 << 5) | 1)
+
+static const vfat_boot_sector boot =
+{
+	{ 0xEB, 0x3C, 0x90 },
+	{ 'S', 'M', 'O', 'O', 'T', 'H', 'I', 'E' },
+	MSC_BLOCK_SIZE,
+	1,							// sectors per cluster
+	VFAT_FAT_START,				// reserved sectors
+	VFAT_FATS,
+	VFAT_ROOT_ENTRIES,
+	VFAT_SECTORS,
+	0xF8,						// fixed disk
+	VFAT_FAT_SECTORS,
+	1,							// sectors per track
+	1,							// heads
+	0,							// hidden sectors
+	0,							// sectors32, we fit in sectors16
+	0x80,						// drive number
+	0,
+	0x29,						// extended boot signature
+	0x534D4F4F,					// serial
+	{ 'S', 'M', 'O', 'O', 'T', 'H', 'I', 'E', ' ', ' ', ' ' },
+	{ 'F', 'A', 'T', '1', '6', ' ', ' ', ' ' },
+};
+
+static const vfat_dirent root[2] =
+{
+	{
+		{ 'S', 'M', 'O', 'O', 'T', 'H', 'I', 'E', ' ', ' ', ' ' },
+		ATTR_VOLUME_ID,
+		0, 0, 0, VFAT_DATE, VFAT_DATE, 0, 0, VFAT_DATE, 0, 0
+	},
+	{
+		{ 'C', 'U', 'R', 'R', 'E', 'N', 'T', ' ', 'B', 'I', 'N' },
+		ATTR_READ_ONLY,
+		0, 0, 0, VFAT_DATE, VFAT_DATE, 0, 0, VFAT_DATE, 2, 0	// size filled in
+	},
+};
+
+static uint32_t current_size;		// bytes of CURRENT.BIN, 0 until measured
+
+static uint32_t image_sector;		// where the new image starts, 0 until seen
+static uint32_t image_next;			// sector that continues it
+static uint8_t image_complete;
+
+// first cluster and size of every file in the root directory, as last written
+static uint16_t dir_cluster[VFAT_ROOT_ENTRIES];
+static uint32_t dir_size[VFAT_ROOT_ENTRIES];
+
+// trailing erased flash isn't part of the image
+static uint32_t current_bytes()
+{
+	if (current_size == 0)
+	{
+		const uint32_t *p = (const uint32_t *) (USER_FLASH_START + USER_FLASH_SIZE);
+		while ((p > (const uint32_t *) USER_FLASH_START) && (p[-1] == 0xFFFFFFFF))
+			p--;
+		current_size = ((uint32_t) p) - USER_FLASH_START;
+	}
+	return current_size;
+}
+
+static uint32_t current_clusters()
+{
+	return (current_bytes() + MSC_BLOCK_SIZE - 1) / MSC_BLOCK_SIZE;
+}
+
+static void vfat_read_fat(uint8_t *buf, uint32_t sector)
+{
+	uint16_t *fat = (uint16_t *) buf;
+	uint32_t last = 1 + current_clusters();
+	uint32_t e = sector * (MSC_BLOCK_SIZE / 2);
+	int i;
+
+	for (i = 0; i < (MSC_BLOCK_SIZE / 2); i++, e++)
+	{
+		if (e == 0)
+			fat[i] = 0xFFF8;			// media byte
+		else if (e == 1)
+			fat[i] = 0xFFFF;
+		else if (e < last)
+			fat[i] = e + 1;				// CURRENT.BIN is one chain
+		else if (e == last)
+			fat[i] = 0xFFFF;
+		else
+			fat[i] = 0;
+	}
+}
+
+static void vfat_read(uint8_t *buf, uint32_t sector)
+{
+	memset(buf, 0, MSC_BLOCK_SIZE);
+
+	if (sector == 0)
+	{
+		memcpy(buf, &boot, sizeof(boot));
+		buf[510] = 0x55;
+		buf[511] = 0xAA;
+	}
+	else if (sector < VFAT_ROOT_START)
+		vfat_read_fat(buf, (sector - VFAT_FAT_START) % VFAT_FAT_SECTORS);
+	else if (sector == VFAT_ROOT_START)
+	{
+		vfat_dirent *d = (vfat_dirent *) buf;
+		memcpy(d, root, sizeof(root));
+		d[1].size = current_bytes();
+		if (d[1].size == 0)
+			d[1].cluster = 0;
+	}
+	else if (sector >= VFAT_DATA_START)
+	{
+		uint32_t offset = (SECTOR2CLUSTER(sector) - 2) * MSC_BLOCK_SIZE;
+		if (offset < current_bytes())
+			memcpy(buf, (const void *) (USER_FLASH_START + offset), MSC_BLOCK_SIZE);
+	}
+}
+
+// initial stack pointer in RAM, reset handler a thumb address in user flash
+static int vfat_is_image(const uint8_t *buf)
+{
+	const uint32_t *v = (const uint32_t *) buf;
+
+	if (((v[0] < 0x10000000) || (v[0] > 0x10008000)) && ((v[0] < 0x2007C000) || (v[0] > 0x20084000)))
+		return 0;
+	return ((v[1] & 1) && (v[1] >= USER_FLASH_START) && (v[1] <= USER_FLASH_END));
+}
+
+static void vfat_write_dir(const uint8_t *buf, uint32_t sector)
+{
+	const vfat_dirent *d = (const vfat_dirent *) buf;
+	uint32_t n = (sector - VFAT_ROOT_START) * (MSC_BLOCK_SIZE / sizeof(vfat_dirent));
+	int i;
+
+	for (i = 0; i < (MSC_BLOCK_SIZE / sizeof(vfat_dirent)); i++, n++)
+	{
+		dir_cluster[n] = 0;
+		if ((d[i].name[0] == 0) || (d[i].name[0] == (char) 0xE5))
+			continue;
+		if ((d[i].attr == ATTR_LONG_NAME) || (d[i].attr & (ATTR_VOLUME_ID | ATTR_DIRECTORY)))
+			continue;
+		dir_cluster[n] = d[i].cluster;
+		dir_size[n] = d[i].size;
+	}
+}
+
+static int vfat_write_data(const uint8_t *buf, uint32_t sector)
+{
+	// CURRENT.BIN is read only
+	if (SECTOR2CLUSTER(sector) < 2 + current_clusters())
+		return 0;
+
+	if ((image_sector == 0) && vfat_is_image(buf))
+	{
+		printf("VFAT: image at sector %lu\n", sector);
+		image_sector = image_next = sector;
+	}
+
+	if ((image_sector == 0) || (sector != image_next))
+		return 0;
+
+	uint32_t offset = (sector - image_sector) * MSC_BLOCK_SIZE;
+	if (offset >= USER_FLASH_SIZE)
+		return 0;
+
+	if (write_flash((unsigned *) (USER_FLASH_START + offset), (char *) buf, MSC_BLOCK_SIZE) != CMD_SUCCESS)
+		return 1;
+	image_next++;
+	return 0;
+}
+
+static void vfat_check_complete()
+{
+	int i;
+
+	if ((image_sector == 0) || image_complete)
+		return;
+
+	for (i = 0; i < VFAT_ROOT_ENTRIES; i++)
+	{
+		if ((dir_cluster[i] == SECTOR2CLUSTER(image_sector)) && dir_size[i] &&
+			(dir_size[i] <= (image_next - image_sector) * MSC_BLOCK_SIZE))
+		{
+			printf("VFAT: %lu byte image complete\n", dir_size[i]);
+			if (flush_flash() == CMD_SUCCESS)
+				image_complete = 1;
+			return;
+		}
+	}
+}
+
+int MSC_disk_ready()
+{
+	return 1;
+}
+
+uint32_t MSC_disk_blocks()
+{
+	return VFAT_SECTORS;
+}
+
+int MSC_disk_read(uint8_t *buffer, uint32_t block, int count)
+{
+	for (; count; count--, block++, buffer += MSC_BLOCK_SIZE)
+		vfat_read(buffer, block);
+	return 0;
+}
+
+int MSC_disk_write(const uint8_t *buffer, uint32_t block, int count)
+{
+	for (; count; count--, block++, buffer += MSC_BLOCK_SIZE)
+	{
+		if ((block >= VFAT_ROOT_START) && (block < VFAT_DATA_START))
+			vfat_write_dir(buffer, block);
+		else if (block >= VFAT_DATA_START)
+		{
+			if (vfat_write_data(buffer, block))
+				return 1;
+		}
+	}
+	vfat_check_complete();
+	return 0;
+}
+
+int MSC_disk_sync()
+{
+	return (flush_flash() == CMD_SUCCESS)?0:1;
+}
+
+int MSC_disk_complete()
+{
+	return image_complete;
+}
+
+#endif /* MSC_VFAT */